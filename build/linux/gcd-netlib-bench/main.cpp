@@ -0,0 +1,339 @@
+//
+//  main.cpp
+//  gcd-netlib-bench
+//
+//  Loopback throughput and latency benchmark of NetworkAgent.
+//  One SERVER agent echoes every package back, M CLIENT agents keep a fixed number
+//  of packages in flight per connection. every combination of payload size,
+//  connection count and pipelining depth is run for a fixed duration.
+//
+//  build (clang with blocks, libdispatch and the blocks runtime installed):
+//  clang++ -std=c++11 -fblocks -O2 -I../../../src main.cpp ../../../src/*.cpp
+//          -ldispatch -lBlocksRuntime -lpthread -o gcd-netlib-bench
+//
+//  usage: gcd-netlib-bench [--engine dispatch|epoll|uring] [--shards N] [--agents M]
+//                          [--sizes 16,256,4096] [--conns 1,16,64] [--depth 1,8,32]
+//                          [--duration SEC] [--port PORT] [--json]
+//
+
+#include "NetworkAgent.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <sys/resource.h>
+
+using namespace libgcdnet;
+
+static const unsigned int ECHO_AGENT = 1;
+static const unsigned int CLIENT_AGENT = 2;
+static const uint32_t MAGIC = 0x62656e63; //"benc", tells bench packages from the server hello
+static const size_t STAMP_SIZE = 12; //u32 magic, u64 send time
+
+static std::atomic<bool> g_running(false);
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//server side, one delegate answers for every session
+class EchoDelegate : public NetworkAgentClientDelegate, public NetworkAgentDispatcherDelegate
+{
+public:
+    unsigned int agent_id() const { return ECHO_AGENT; }
+    void closed(){}
+    void connected(NetworkAgentClientSession* request){}
+    void data_received(){}
+    void data_sent(){}
+
+    //echo the received payload back as is, no copy out of the session
+    bool accepts_payloads() const { return true; }
+    void payload_received(NetworkAgentClientSession* session, const NetworkAgentPackageHead& head, 
+                          NetworkAgentPayload* payload)
+    {
+        session->write_data(ECHO_AGENT, CLIENT_AGENT, payload);
+    }
+
+    NetworkAgentClientDelegate* search(unsigned int target_agent_id) const
+    {
+        return target_agent_id == ECHO_AGENT ? (NetworkAgentClientDelegate*)this : NULL;
+    }
+};
+
+//client side, one delegate per connection, only ever touched on the session's context
+class Connection final : public NetworkAgentClientDelegate
+{
+public:
+    Connection(NetworkAgentClientSession* s, size_t payload) : session(s), echoed(0), inflight(0), gone(false)
+    {
+        frame.assign(payload < STAMP_SIZE ? STAMP_SIZE : payload, 'x');
+        memcpy(&frame[0], &MAGIC, sizeof(MAGIC));
+        rtt_ns.reserve(1 << 16);
+    }
+
+    unsigned int agent_id() const { return CLIENT_AGENT; }
+    void closed(){}
+    void connected(NetworkAgentClientSession* request){}
+    void data_received(){}
+    void data_sent(){}
+
+    //last call on the delegate, it can be deleted from here on
+    void session_closed(NetworkAgentClientSession* s)
+    {
+        gone.store(true);
+    }
+
+    void session_data_received(NetworkAgentClientSession* s)
+    {
+        std::string data;
+        s->read_data(data);
+
+        uint32_t magic;
+        if(data.size() < STAMP_SIZE || (memcpy(&magic, data.data(), sizeof(magic)), magic != MAGIC))
+            return;
+
+        //only echoes inside the measured window count, the rest is just drained
+        bool running = g_running.load(std::memory_order_relaxed);
+        if(running)
+        {
+            uint64_t sent;
+            memcpy(&sent, data.data() + sizeof(magic), sizeof(sent));
+            rtt_ns.push_back(now_ns() - sent);
+            echoed++;
+        }
+        inflight.fetch_sub(1); //publishes rtt_ns to the main thread
+
+        if(running)
+            send();
+    }
+
+    //from the main thread for the first packages, from the session's context for the rest,
+    //every send stamps a copy of its own
+    void send()
+    {
+        std::string stamped(frame);
+        uint64_t t = now_ns();
+        memcpy(&stamped[sizeof(MAGIC)], &t, sizeof(t));
+        inflight.fetch_add(1, std::memory_order_relaxed);
+        session->write_data(CLIENT_AGENT, ECHO_AGENT, stamped);
+    }
+
+    NetworkAgentClientSession* session;
+    std::string frame; //magic and padding, never written after construction
+    std::vector<uint64_t> rtt_ns;
+    uint64_t echoed;
+    std::atomic<long> inflight;
+    std::atomic<bool> gone;
+};
+
+struct Options
+{
+    NetworkAgentOptions agent;
+    unsigned int agents;
+    std::vector<size_t> sizes;
+    std::vector<size_t> conns;
+    std::vector<size_t> depths;
+    double duration;
+    std::string port;
+    bool json;
+};
+
+struct Result
+{
+    uint64_t messages;
+    double seconds;
+    double p50_us, p99_us, p999_us;
+    double cpu_us_per_msg;
+};
+
+static std::vector<size_t> parse_list(const char* arg)
+{
+    std::vector<size_t> out;
+    std::stringstream ss(arg);
+    std::string item;
+    while(std::getline(ss, item, ','))
+        out.push_back(strtoul(item.c_str(), NULL, 10));
+    return out;
+}
+
+static const char* engine_name(NetworkAgentEngine::Kind kind)
+{
+    switch(kind)
+    {
+        case NetworkAgentEngine::EPOLL: return "epoll";
+        case NetworkAgentEngine::URING: return "uring";
+        default: return "dispatch";
+    }
+}
+
+static double cpu_seconds()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double percentile_us(const std::vector<uint64_t>& sorted, double p)
+{
+    if(sorted.empty())
+        return 0;
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i] / 1000.0;
+}
+
+//one point of the sweep, its connections are closed once it is measured
+static Result run(const Options& opt, std::vector<NetworkAgent*>& clients, size_t payload, size_t conns, size_t depth)
+{
+    std::vector<Connection*> connections;
+    for(size_t i=0; i<conns; i++)
+    {
+        NetworkAgentClientSession* s = clients[i % clients.size()]->connect("127.0.0.1", opt.port.c_str());
+        Connection* c = new Connection(s, payload);
+        s->setDelegate(c);
+        connections.push_back(c);
+    }
+
+    //give the server hello time to arrive so it is not counted
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    double cpu0 = cpu_seconds();
+    uint64_t t0 = now_ns();
+    g_running.store(true);
+    for(size_t i=0; i<conns; i++)
+        for(size_t d=0; d<depth; d++)
+            connections[i]->send();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds((long)(opt.duration * 1000)));
+    g_running.store(false);
+    Result r;
+    r.seconds = (now_ns() - t0) / 1e9;
+    double cpu = cpu_seconds() - cpu0;
+
+    //let the packages still in flight come back, with an upper bound for lost ones
+    uint64_t deadline = now_ns() + 2000000000ull;
+    for(size_t i=0; i<conns; i++)
+        while(connections[i]->inflight.load() > 0 && now_ns() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    //the sessions are idle now, their state can be read from here
+    std::vector<uint64_t> rtt;
+    r.messages = 0;
+    for(size_t i=0; i<conns; i++)
+    {
+        r.messages += connections[i]->echoed;
+        rtt.insert(rtt.end(), connections[i]->rtt_ns.begin(), connections[i]->rtt_ns.end());
+    }
+    std::sort(rtt.begin(), rtt.end());
+    r.p50_us = percentile_us(rtt, 0.50);
+    r.p99_us = percentile_us(rtt, 0.99);
+    r.p999_us = percentile_us(rtt, 0.999);
+    r.cpu_us_per_msg = r.messages ? cpu * 1e6 / r.messages : 0;
+
+    //a delegate still attached to a session that did not close in time is leaked, not freed under it
+    for(size_t i=0; i<conns; i++)
+        connections[i]->session->close();
+    deadline = now_ns() + 2000000000ull;
+    for(size_t i=0; i<conns; i++)
+    {
+        while(!connections[i]->gone.load() && now_ns() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if(connections[i]->gone.load())
+            delete connections[i];
+    }
+    return r;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: gcd-netlib-bench [--engine dispatch|epoll|uring] [--shards N] [--agents M]\n"
+                    "                        [--sizes 16,256,4096] [--conns 1,16,64] [--depth 1,8,32]\n"
+                    "                        [--duration SEC] [--port PORT] [--json]\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+    opt.agents = 4;
+    opt.sizes = parse_list("16,256,4096,65536");
+    opt.conns = parse_list("1,16,64");
+    opt.depths = parse_list("1,8,32");
+    opt.duration = 2;
+    opt.port = "19090";
+    opt.json = false;
+
+    for(int i=1; i<argc; i++)
+    {
+        std::string a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : NULL;
+        if(a == "--json"){ opt.json = true; continue; }
+        if(!v)
+            usage();
+        i++;
+        if(a == "--engine")
+        {
+            std::string e = v;
+            opt.agent.engine = e == "epoll" ? NetworkAgentEngine::EPOLL : e == "uring" ? NetworkAgentEngine::URING : NetworkAgentEngine::DISPATCH;
+        }
+        else if(a == "--shards") opt.agent.shards = atoi(v);
+        else if(a == "--agents") opt.agents = atoi(v) > 0 ? atoi(v) : 1;
+        else if(a == "--sizes") opt.sizes = parse_list(v);
+        else if(a == "--conns") opt.conns = parse_list(v);
+        else if(a == "--depth") opt.depths = parse_list(v);
+        else if(a == "--duration") opt.duration = atof(v);
+        else if(a == "--port") opt.port = v;
+        else usage();
+    }
+
+    try{
+        EchoDelegate echo;
+        NetworkAgent server(NetworkAgent::SERVER, &echo, opt.agent);
+        server.listen(NULL, opt.port.c_str());
+
+        std::vector<NetworkAgent*> clients;
+        for(unsigned int i=0; i<opt.agents; i++)
+            clients.push_back(new NetworkAgent(NetworkAgent::CLIENT, NULL, opt.agent));
+
+        if(!opt.json)
+            printf("%-8s %8s %6s %6s %12s %10s %10s %10s %10s %12s\n",
+                   "engine", "payload", "conns", "depth", "msgs/sec", "MB/sec", "p50 us", "p99 us", "p999 us", "cpu us/msg");
+
+        for(size_t si=0; si<opt.sizes.size(); si++)
+            for(size_t ci=0; ci<opt.conns.size(); ci++)
+                for(size_t di=0; di<opt.depths.size(); di++)
+                {
+                    size_t payload = opt.sizes[si] < STAMP_SIZE ? STAMP_SIZE : opt.sizes[si];
+                    Result r = run(opt, clients, payload, opt.conns[ci], opt.depths[di]);
+                    double mps = r.messages / r.seconds;
+                    double mbps = mps * payload / (1024.0 * 1024.0);
+
+                    if(opt.json)
+                        printf("{\"engine\":\"%s\",\"payload\":%zu,\"connections\":%zu,\"depth\":%zu,"
+                               "\"messages\":%llu,\"seconds\":%.3f,\"msgs_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+                               "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"cpu_us_per_msg\":%.3f}\n",
+                               engine_name(opt.agent.engine), payload, opt.conns[ci], opt.depths[di],
+                               (unsigned long long)r.messages, r.seconds, mps, mbps,
+                               r.p50_us, r.p99_us, r.p999_us, r.cpu_us_per_msg);
+                    else
+                        printf("%-8s %8zu %6zu %6zu %12.1f %10.2f %10.2f %10.2f %10.2f %12.3f\n",
+                               engine_name(opt.agent.engine), payload, opt.conns[ci], opt.depths[di],
+                               mps, mbps, r.p50_us, r.p99_us, r.p999_us, r.cpu_us_per_msg);
+                    fflush(stdout);
+                }
+    }catch(NetworkAgentException e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+//
+//  main.cpp
+//  gcd-netlib-coroutine
+//
+//  Echo server and request/response client written as C++20 coroutines on top of
+//  NetworkAgentCoSession. The server runs one coroutine per session, started by an
+//  acceptor delegate on the session's first package. The client coroutine hops onto
+//  its session's context once and then sends a request, waits for the echo and so on,
+//  with every resumption coming straight from the session's own I/O handlers.
+//
+//  build (clang with blocks, libdispatch and the blocks runtime installed):
+//  clang++ -std=c++20 -fblocks -O2 -I../../../src main.cpp ../../../src/*.cpp
+//          -ldispatch -lBlocksRuntime -lpthread -o gcd-netlib-coroutine
+//
+//  usage: gcd-netlib-coroutine [--engine dispatch|epoll|uring] [--requests N] [--size BYTES] [--port PORT]
+//
+
+#include "NetworkAgent.h"
+#include "NetworkAgentCoroutine.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+using namespace libgcdnet;
+
+static const unsigned int ECHO_AGENT = 1;
+static const unsigned int CLIENT_AGENT = 2;
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//one per accepted session, runs on the session's context from the start
+static NetworkAgentCoroutine serve(NetworkAgentCoSession* co)
+{
+    for(;;)
+    {
+        NetworkAgentCoFrame f = co_await co->read_frame();
+        if(!f.payload)
+            break;
+        //the payload goes back out as it came in, no copy
+        if(!co_await co->write(ECHO_AGENT, f.head.source_agent_id, f.payload))
+            break;
+    }
+    co->release();
+}
+
+//server side, hands every new session over to a coroutine of its own
+class Acceptor : public NetworkAgentClientDelegate, public NetworkAgentDispatcherDelegate
+{
+public:
+    unsigned int agent_id() const { return ECHO_AGENT; }
+    void closed(){}
+    void connected(NetworkAgentClientSession* request){}
+    void data_received(){}
+    void data_sent(){}
+    bool accepts_payloads() const { return true; }
+
+    //first package of a session, on its context: the coroutine session takes the delegate
+    //over right here, the coroutine starts waiting and gets this package first
+    void payload_received(NetworkAgentClientSession* session, const NetworkAgentPackageHead& head,
+                          NetworkAgentPayload* payload)
+    {
+        NetworkAgentCoSession* co = new NetworkAgentCoSession(session, ECHO_AGENT);
+        serve(co);
+        co->payload_received(session, head, payload);
+    }
+
+    NetworkAgentClientDelegate* search(unsigned int target_agent_id) const
+    {
+        return target_agent_id == ECHO_AGENT ? (NetworkAgentClientDelegate*)this : NULL;
+    }
+};
+
+//client side, one request in flight, round trip times go to the promise
+static NetworkAgentCoroutine ping(NetworkAgentCoSession* co, size_t requests, size_t size,
+                                  std::promise<std::vector<uint64_t> >* result)
+{
+    std::vector<uint64_t> rtt;
+    rtt.reserve(requests);
+    std::string request(size, 'x');
+
+    co_await co->schedule();
+    for(size_t i=0; i<requests; i++)
+    {
+        uint64_t t = now_ns();
+        co_await co->write(CLIENT_AGENT, ECHO_AGENT, request.data(), request.size());
+        NetworkAgentCoFrame f = co_await co->read_frame();
+        if(!f.payload)
+            break;
+        f.payload->release();
+        rtt.push_back(now_ns() - t);
+    }
+    co->close();
+    co->release();
+    result->set_value(rtt);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: gcd-netlib-coroutine [--engine dispatch|epoll|uring] [--requests N] [--size BYTES] [--port PORT]\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    NetworkAgentOptions options;
+    size_t requests = 100000;
+    size_t size = 64;
+    std::string port = "19091";
+
+    for(int i=1; i<argc; i++)
+    {
+        std::string a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : NULL;
+        if(!v)
+            usage();
+        i++;
+        if(a == "--engine")
+        {
+            std::string e = v;
+            options.engine = e == "epoll" ? NetworkAgentEngine::EPOLL : e == "uring" ? NetworkAgentEngine::URING : NetworkAgentEngine::DISPATCH;
+        }
+        else if(a == "--requests") requests = strtoul(v, NULL, 10);
+        else if(a == "--size") size = strtoul(v, NULL, 10);
+        else if(a == "--port") port = v;
+        else usage();
+    }
+
+    try{
+        Acceptor acceptor;
+        NetworkAgent server(NetworkAgent::SERVER, &acceptor, options);
+        server.listen(NULL, port.c_str());
+
+        NetworkAgent client(NetworkAgent::CLIENT, NULL, options);
+        NetworkAgentClientSession* session = client.connect("127.0.0.1", port.c_str());
+        NetworkAgentCoSession* co = new NetworkAgentCoSession(session, CLIENT_AGENT);
+
+        std::promise<std::vector<uint64_t> > result;
+        std::future<std::vector<uint64_t> > done = result.get_future();
+        uint64_t t0 = now_ns();
+        ping(co, requests, size, &result);
+        std::vector<uint64_t> rtt = done.get();
+        double seconds = (now_ns() - t0) / 1e9;
+
+        std::sort(rtt.begin(), rtt.end());
+        if(rtt.empty())
+        {
+            fprintf(stderr, "no echo received\n");
+            return 1;
+        }
+        printf("%zu requests of %zu bytes in %.3f s: %.1f req/sec, p50 %.2f us, p99 %.2f us\n",
+               rtt.size(), size, seconds, rtt.size() / seconds,
+               rtt[rtt.size() / 2] / 1000.0, rtt[(size_t)(0.99 * (rtt.size() - 1))] / 1000.0);
+    }catch(NetworkAgentException e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,186 @@
+//
+//  main.cpp
+//  gcd-netlib-replay
+//
+//  Replays a trace written by NetworkAgent::start_capture() against a SERVER agent.
+//  Every session of the trace gets a connection of its own, opened before its first
+//  package, and every package is sent with the source and target agent of the capture.
+//  Packages leave at the captured pace, N times faster (--speed N) or back to back (--speed 0).
+//  Whatever the server sends back is dropped.
+//
+//  build (clang with blocks, libdispatch and the blocks runtime installed):
+//  clang++ -std=c++11 -fblocks -O2 -I../../../src main.cpp ../../../src/*.cpp
+//          -ldispatch -lBlocksRuntime -lpthread -o gcd-netlib-replay
+//
+//  usage: gcd-netlib-replay --trace FILE [--host HOST] [--port PORT] [--speed N]
+//                           [--loops N] [--engine dispatch|epoll|uring] [--shards N] [--json]
+//
+
+#include "NetworkAgent.h"
+#include "NetworkAgentCapture.h"
+#include <map>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+using namespace libgcdnet;
+
+struct Options
+{
+    NetworkAgentOptions agent;
+    std::string trace;
+    std::string host;
+    std::string port;
+    double speed; //0 as fast as possible
+    unsigned int loops;
+    bool json;
+};
+
+struct Result
+{
+    uint64_t packages;
+    uint64_t bytes;
+    size_t sessions;
+    double seconds;
+    double max_lag_ms; //furthest behind the captured schedule
+};
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: gcd-netlib-replay --trace FILE [--host HOST] [--port PORT] [--speed N]\n"
+                    "                         [--loops N] [--engine dispatch|epoll|uring] [--shards N] [--json]\n");
+    exit(1);
+}
+
+static Result replay(const Options& opt, NetworkAgentTraceReader& trace, NetworkAgent& client)
+{
+    std::map<uint64_t, NetworkAgentClientSession*> sessions; //by session of the trace
+    Result r;
+    memset(&r, 0, sizeof(r));
+
+    uint64_t t0 = now_ns();
+    uint64_t offset = 0; //schedule of the current loop, relative to t0
+    for(unsigned int loop=0; loop<opt.loops; loop++)
+    {
+        trace.rewind();
+        NetworkAgentTraceRecord rec;
+        uint64_t first = 0, last = 0;
+        bool started = false;
+        while(trace.next(rec))
+        {
+            if(!started)
+            {
+                first = rec.time_ns;
+                started = true;
+            }
+            last = rec.time_ns;
+
+            NetworkAgentClientSession*& s = sessions[rec.session];
+            if(!s)
+                s = client.connect(opt.host.c_str(), opt.port.c_str());
+
+            if(opt.speed > 0)
+            {
+                uint64_t due = t0 + offset + (uint64_t)((rec.time_ns - first) / opt.speed);
+                uint64_t now = now_ns();
+                if(due > now)
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+                else if((now - due) / 1e6 > r.max_lag_ms)
+                    r.max_lag_ms = (now - due) / 1e6;
+            }
+
+            NetworkAgentPayload* payload = NetworkAgentPayload::create(rec.head.payload_size);
+            memcpy(payload->mutable_data(), rec.payload, rec.head.payload_size);
+            s->write_data(rec.head.source_agent_id, rec.head.target_agent_id, payload);
+            r.packages++;
+            r.bytes += rec.head.payload_size;
+        }
+        if(opt.speed > 0)
+            offset += (uint64_t)((last - first) / opt.speed);
+    }
+
+    //let the queued packages leave before the clock stops, with an upper bound for stuck sessions
+    uint64_t deadline = now_ns() + 10000000000ull;
+    for(std::map<uint64_t, NetworkAgentClientSession*>::iterator it = sessions.begin(); it != sessions.end(); ++it)
+        while(it->second->stats().queued_bytes > 0 && now_ns() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    r.seconds = (now_ns() - t0) / 1e9;
+    r.sessions = sessions.size();
+    return r;
+}
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+    opt.host = "127.0.0.1";
+    opt.port = "19090";
+    opt.speed = 1;
+    opt.loops = 1;
+    opt.json = false;
+
+    for(int i=1; i<argc; i++)
+    {
+        std::string a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : NULL;
+        if(a == "--json"){ opt.json = true; continue; }
+        if(!v)
+            usage();
+        i++;
+        if(a == "--engine")
+        {
+            std::string e = v;
+            opt.agent.engine = e == "epoll" ? NetworkAgentEngine::EPOLL : e == "uring" ? NetworkAgentEngine::URING : NetworkAgentEngine::DISPATCH;
+        }
+        else if(a == "--shards") opt.agent.shards = atoi(v);
+        else if(a == "--trace") opt.trace = v;
+        else if(a == "--host") opt.host = v;
+        else if(a == "--port") opt.port = v;
+        else if(a == "--speed") opt.speed = atof(v) > 0 ? atof(v) : 0;
+        else if(a == "--loops") opt.loops = atoi(v) > 0 ? atoi(v) : 1;
+        else usage();
+    }
+    if(opt.trace.empty())
+        usage();
+
+    NetworkAgentTraceReader trace;
+    int error = trace.open(opt.trace.c_str());
+    if(error)
+    {
+        fprintf(stderr, "%s: %s\n", opt.trace.c_str(), error == EINVAL ? "not a trace file" : strerror(error));
+        return 1;
+    }
+
+    try{
+        NetworkAgent client(NetworkAgent::CLIENT, NULL, opt.agent);
+        Result r = replay(opt, trace, client);
+        double pps = r.seconds > 0 ? r.packages / r.seconds : 0;
+        double mbps = r.seconds > 0 ? r.bytes / r.seconds / (1024.0 * 1024.0) : 0;
+
+        if(opt.json)
+            printf("{\"trace\":\"%s\",\"speed\":%.2f,\"sessions\":%zu,\"packages\":%llu,\"bytes\":%llu,"
+                   "\"seconds\":%.3f,\"packages_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"max_lag_ms\":%.3f}\n",
+                   opt.trace.c_str(), opt.speed, r.sessions, (unsigned long long)r.packages, (unsigned long long)r.bytes,
+                   r.seconds, pps, mbps, r.max_lag_ms);
+        else
+            printf("%zu sessions, %llu packages, %llu bytes in %.3f s: %.1f packages/sec, %.2f MB/sec, max lag %.3f ms\n",
+                   r.sessions, (unsigned long long)r.packages, (unsigned long long)r.bytes,
+                   r.seconds, pps, mbps, r.max_lag_ms);
+    }catch(NetworkAgentException e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
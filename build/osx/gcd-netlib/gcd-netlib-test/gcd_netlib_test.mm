@@ -8,6 +8,22 @@
 
 #import <XCTest/XCTest.h>
 #import "NetworkAgent.h"
+#import "NetworkAgentBuffer.h"
+#import "NetworkAgentFrame.h"
+#import "NetworkAgentMetrics.h"
+#import "NetworkAgentPayload.h"
+#import "NetworkAgentRegistry.h"
+#import "NetworkAgentTimingWheel.h"
+#import "NetworkAgentStream.h"
+#import "NetworkAgentPolicy.h"
+#import "NetworkAgentCapture.h"
+#import "NetworkAgentConnectionPool.h"
+#import "NetworkAgentRpc.h"
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <unistd.h>
+#import <sys/stat.h>
 
 
 
@@ -31,6 +47,40 @@
     [super tearDown];
 }
 
+//client side of testTCPConn, signals once the server hello arrived and once the session closed
+class HelloClient : public libgcdnet::NetworkAgentClientDelegate, public libgcdnet::NetworkAgentDispatcherDelegate
+{
+public:
+    HelloClient() : hello(dispatch_semaphore_create(0)), gone(dispatch_semaphore_create(0)) {}
+    ~HelloClient()
+    {
+        dispatch_release(hello);
+        dispatch_release(gone);
+    }
+    
+    unsigned int agent_id() const { return 912; }
+    void closed(){}
+    void connected(libgcdnet::NetworkAgentClientSession* request){}
+    void data_received(){}
+    void data_sent(){}
+    void session_data_received(libgcdnet::NetworkAgentClientSession* session)
+    {
+        dispatch_semaphore_signal(hello);
+    }
+    void session_closed(libgcdnet::NetworkAgentClientSession* session)
+    {
+        dispatch_semaphore_signal(gone);
+    }
+    
+    libgcdnet::NetworkAgentClientDelegate* search(unsigned int target_agent_id) const
+    {
+        return (libgcdnet::NetworkAgentClientDelegate*)this;
+    }
+    
+    dispatch_semaphore_t hello;
+    dispatch_semaphore_t gone;
+};
+
 - (void)testTCPConn
 {
     using namespace libgcdnet;
@@ -41,17 +91,1234 @@
          const char* hostname = "localhost";
          const char* servname = "8888";
          
+         HelloClient hello;
          NetworkAgent server(NetworkAgent::SERVER, NULL); server.listen(NULL, servname);
-         NetworkAgent client(NetworkAgent::CLIENT,NULL); client.connect(hostname, servname);
+         NetworkAgent client(NetworkAgent::CLIENT, &hello);
+         NetworkAgentClientSession* session = client.connect(hostname, servname);
        
-        dispatch_main();
+        //the test has to return, later ones would never run
+        long waited = dispatch_semaphore_wait(hello.hello, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC));
+        XCTAssertEqual(waited, 0L, @"server hello received");
+        
+        //sessions outlive the agents, the delegate has to outlive the session
+        session->close();
+        waited = dispatch_semaphore_wait(hello.gone, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC));
+        XCTAssertEqual(waited, 0L, @"client session closed");
     }
     catch(NetworkAgentException e)
     {
-        std::cout << e.what() << std::endl;
+        XCTFail(@"%s", e.what());
+    }
+    
+    
+}
+
+- (void)testRingBuffer
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentRingBuffer ring;
+    std::string expected;
+    
+    //push the head around the storage several times so reads and writes wrap
+    for(int i=0; i<64; i++)
+    {
+        std::string chunk(1000 + i*13, 'a' + i%26);
+        ring.append(chunk.data(), chunk.size());
+        expected += chunk;
+        
+        std::string out;
+        ring.extract(out, 700);
+        XCTAssertTrue(out == expected.substr(0, out.size()), @"ring content out of order");
+        expected.erase(0, out.size());
+        XCTAssertEqual(ring.size(), expected.size(), @"ring size mismatch");
     }
     
+    //iovec view spans the wrap point without copying
+    struct iovec iov[2];
+    int cnt = ring.read_iov(iov, 0, ring.size());
+    size_t total = 0;
+    for(int i=0; i<cnt; i++)
+        total += iov[i].iov_len;
+    XCTAssertEqual(total, expected.size(), @"iovec does not cover the readable region");
+}
+
+- (void)testOutboundQueuePartialWrite
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentOutboundQueue queue;
+    queue.push("H1", 2, "first", 5);
+    queue.push("H2", 2, "second", 6);
+    XCTAssertEqual(queue.frames(), (size_t)2, @"two frames queued");
+    
+    //the socket accepts only part of the first payload
+    XCTAssertEqual(queue.advance(4), (size_t)0, @"no frame completed yet");
     
+    struct iovec iov[NetworkAgentOutboundQueue::MAX_IOV];
+    int cnt = queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV);
+    std::string wire;
+    for(int i=0; i<cnt; i++)
+        wire.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    XCTAssertTrue(wire == "rstH2second", @"resume at the exact partial offset");
+    
+    XCTAssertEqual(queue.advance(wire.size()), (size_t)2, @"both frames completed");
+    XCTAssertTrue(queue.empty(), @"queue drained");
+}
+
+- (void)testOutboundQueuePinnedGrowth
+{
+    using namespace libgcdnet;
+
+    NetworkAgentOutboundQueue queue;
+    std::string first(3000, 'a');
+    queue.push("H", 1, first.data(), first.size());
+
+    //a send is in flight on the gathered iovecs while more frames are queued
+    struct iovec iov[NetworkAgentOutboundQueue::MAX_IOV];
+    int cnt = queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV);
+    XCTAssertEqual(cnt, 2, @"header and payload");
+    queue.pin();
+    std::string second(10000, 'b');
+    queue.push("H", 1, second.data(), second.size());
+    XCTAssertTrue(memcmp(iov[1].iov_base, first.data(), first.size()) == 0, @"gathered bytes survive the growth");
+    XCTAssertFalse(queue.shrink(), @"pinned storage is kept");
+
+    queue.advance(1 + first.size());
+    queue.unpin();
+    cnt = queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV);
+    XCTAssertTrue(memcmp(iov[1].iov_base, second.data(), second.size()) == 0, @"next frame in the grown storage");
+}
+
+static int released_frames = 0;
+static void count_release(void* owner)
+{
+    released_frames++;
+}
+
+- (void)testOutboundQueueExternalPayload
+{
+    using namespace libgcdnet;
+    
+    released_frames = 0;
+    NetworkAgentOutboundQueue queue;
+    const char* shared = "broadcast";
+    queue.push("H1", 2, "own", 3);
+    queue.push_external("H2", 2, shared, strlen(shared), count_release, NULL);
+    queue.push("H3", 2, "tail", 4);
+    
+    struct iovec iov[NetworkAgentOutboundQueue::MAX_IOV];
+    int cnt = queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV);
+    std::string wire;
+    for(int i=0; i<cnt; i++)
+        wire.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    XCTAssertTrue(wire == "H1ownH2broadcastH3tail", @"shared payload in wire order");
+    
+    //stop in the middle of the shared payload, it is still referenced
+    queue.advance(5 + 2 + 4);
+    XCTAssertEqual(released_frames, 0, @"not written yet");
+    cnt = queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV);
+    XCTAssertTrue(iov[0].iov_base == shared + 4, @"written from where it is");
+    
+    queue.advance(5);
+    XCTAssertEqual(released_frames, 1, @"released once written");
+    queue.push_external("H4", 2, shared, strlen(shared), count_release, NULL);
+    queue.clear();
+    XCTAssertEqual(released_frames, 2, @"released when dropped");
+}
+
+- (void)testOutboundQueueSplicedFrame
+{
+    using namespace libgcdnet;
+    
+    released_frames = 0;
+    NetworkAgentOutboundQueue queue;
+    int owner = 0;
+    queue.push("H1", 2, "own", 3);
+    queue.push_spliced("H2", 2, "pre", 3, 1000, count_release, &owner);
+    queue.push("H3", 2, "tail", 4);
+    XCTAssertEqual(queue.bytes(), (size_t)(5 + 5 + 1000 + 6), @"spliced bytes count as queued");
+    
+    //everything up to the spliced part goes out, nothing queued behind it
+    struct iovec iov[NetworkAgentOutboundQueue::MAX_IOV];
+    int cnt = queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV);
+    std::string wire;
+    for(int i=0; i<cnt; i++)
+        wire.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    XCTAssertTrue(wire == "H1ownH2pre", @"stops in front of the spliced part");
+    XCTAssertTrue(queue.splicing() == NULL, @"not due yet");
+    
+    queue.advance(5 + 4);
+    XCTAssertTrue(queue.splicing() == NULL, @"copied part not written yet");
+    queue.advance(1);
+    XCTAssertTrue(queue.splicing() == &owner, @"due once the copied part is out");
+    XCTAssertEqual(queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV), 0, @"nothing to gather meanwhile");
+    
+    //the spliced bytes are reported like written ones
+    queue.advance(600);
+    XCTAssertTrue(queue.splicing() == &owner, @"still splicing");
+    XCTAssertEqual(queue.advance(400), (size_t)1, @"frame complete");
+    XCTAssertEqual(released_frames, 1, @"owner told");
+    cnt = queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV);
+    wire.clear();
+    for(int i=0; i<cnt; i++)
+        wire.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    XCTAssertTrue(wire == "H3tail", @"the rest follows");
+    
+    queue.push_spliced("H4", 2, NULL, 0, 10, count_release, &owner);
+    queue.clear();
+    XCTAssertEqual(released_frames, 2, @"released when dropped");
+}
+
+- (void)testFrameDecoderSplitAndCoalesced
+{
+    using namespace libgcdnet;
+    
+    //two packages back to back on the wire
+    std::string wire;
+    const char* payloads[] = { "hello", "world!" };
+    for(int i=0; i<2; i++)
+    {
+        NetworkAgentPackageHead head;
+        head.protocol = NetworkAgentWireHeader::PROTOCOL;
+        head.payload_size = strlen(payloads[i]);
+        head.source_agent_id = 12;
+        head.target_agent_id = 912 + i;
+        unsigned char raw[NetworkAgentWireHeader::SIZE];
+        NetworkAgentWireHeader::encode(head, raw);
+        wire.append((const char*)raw, sizeof(raw));
+        wire.append(payloads[i]);
+    }
+    
+    NetworkAgentRingBuffer stream;
+    NetworkAgentFrameDecoder decoder;
+    NetworkAgentPackageHead head;
+    
+    //first read ends in the middle of the first header
+    stream.append(wire.data(), 7);
+    XCTAssertEqual(decoder.next(stream, head), NetworkAgentFrameDecoder::NEED_MORE, @"partial header");
+    
+    //second read carries the rest of both packages
+    stream.append(wire.data() + 7, wire.size() - 7);
+    XCTAssertEqual(decoder.next(stream, head), NetworkAgentFrameDecoder::FRAME, @"first package");
+    XCTAssertEqual(head.target_agent_id, 912u, @"first target");
+    XCTAssertEqual(decoder.next(stream, head), NetworkAgentFrameDecoder::FRAME, @"second package");
+    XCTAssertEqual(decoder.next(stream, head), NetworkAgentFrameDecoder::NEED_MORE, @"nothing left");
+    
+    std::string payload;
+    XCTAssertTrue(decoder.pop(stream, head, &payload) && payload == "hello", @"first payload");
+    XCTAssertTrue(decoder.pop(stream, head, &payload) && payload == "world!", @"second payload");
+    XCTAssertTrue(stream.empty(), @"stream drained");
+}
+
+static uint64_t fired_at[3];
+static libgcdnet::NetworkAgentTimingWheel* fired_wheel;
+static void note_fired(void* owner)
+{
+    fired_at[(size_t)owner] = fired_wheel->now();
+}
+
+- (void)testTimingWheel
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentTimingWheel wheel;
+    fired_wheel = &wheel;
+    NetworkAgentWheelTimer timers[3];
+    for(size_t i=0; i<3; i++)
+    {
+        timers[i].fire = note_fired;
+        timers[i].owner = (void*)i;
+        fired_at[i] = 0;
+    }
+    
+    //one timer per level range, the far one cascades down twice before firing
+    wheel.arm(&timers[0], 10);
+    wheel.arm(&timers[1], 100);
+    wheel.arm(&timers[2], 5000);
+    wheel.advance(50);
+    XCTAssertEqual(fired_at[0], 10ull, @"fired on its tick");
+    
+    //rearming moves it, cancelling takes it out for good
+    wheel.arm(&timers[1], 70);
+    wheel.cancel(&timers[2]);
+    wheel.advance(10000);
+    XCTAssertEqual(fired_at[1], 70ull, @"fired on the new tick");
+    XCTAssertEqual(fired_at[2], 0ull, @"cancelled");
+    XCTAssertEqual(wheel.armed(), (size_t)0, @"nothing left");
+    
+    wheel.arm(&timers[2], 12345);
+    wheel.advance(20000);
+    XCTAssertEqual(fired_at[2], 12345ull, @"fired after cascading");
+}
+
+- (void)testFrameDecoderHeartbeat
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentRingBuffer stream;
+    NetworkAgentFrameDecoder decoder;
+    unsigned char raw[NetworkAgentWireHeader::SIZE];
+    NetworkAgentPackageHead beat = {NetworkAgentWireHeader::HEARTBEAT, 0, 0, 0};
+    NetworkAgentPackageHead head = {NetworkAgentWireHeader::PROTOCOL, 3, 12, 912};
+    NetworkAgentWireHeader::encode(beat, raw);
+    stream.append(raw, sizeof(raw));
+    NetworkAgentWireHeader::encode(head, raw);
+    stream.append(raw, sizeof(raw));
+    stream.append("abc", 3);
+    
+    //heartbeats are framed, popping steps over them
+    NetworkAgentPackageHead out;
+    XCTAssertEqual(decoder.next(stream, out), NetworkAgentFrameDecoder::FRAME, @"heartbeat framed");
+    XCTAssertEqual(out.protocol, NetworkAgentWireHeader::HEARTBEAT, @"seen as heartbeat");
+    XCTAssertEqual(decoder.next(stream, out), NetworkAgentFrameDecoder::FRAME, @"package framed");
+    std::string payload;
+    XCTAssertTrue(decoder.pop(stream, out, &payload), @"package popped");
+    XCTAssertTrue(payload == "abc", @"payload intact");
+    XCTAssertEqual(stream.size(), (size_t)0, @"heartbeat consumed");
+    XCTAssertFalse(decoder.compact(), @"nothing offered");
+    
+    //the flag in its source offers compact headers
+    beat.source_agent_id = NetworkAgentWireHeader::OFFER_COMPACT;
+    NetworkAgentWireHeader::encode(beat, raw);
+    stream.append(raw, sizeof(raw));
+    XCTAssertEqual(decoder.next(stream, out), NetworkAgentFrameDecoder::FRAME, @"offer framed");
+    XCTAssertTrue(decoder.compact(), @"compact headers offered");
+    XCTAssertFalse(decoder.pop(stream, out, &payload), @"nothing but the offer");
+    XCTAssertEqual(stream.size(), (size_t)0, @"offer consumed");
+    
+    //a heartbeat carries nothing
+    beat.payload_size = 1;
+    NetworkAgentWireHeader::encode(beat, raw);
+    stream.append(raw, sizeof(raw));
+    XCTAssertEqual(decoder.next(stream, out), NetworkAgentFrameDecoder::CORRUPT, @"rejected");
+}
+
+- (void)testFrameDecoderCompactHeaders
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentPackageHead head;
+    head.protocol = NetworkAgentWireHeader::PROTOCOL;
+    head.payload_size = 5;
+    head.source_agent_id = 12;
+    head.target_agent_id = 912;
+    
+    //a small package between low agent ids takes 6 header bytes instead of 13
+    unsigned char compact[NetworkAgentCompactCodec::MAX_SIZE];
+    size_t compact_size = NetworkAgentCompactCodec::encode(head, compact);
+    XCTAssertEqual(compact_size, (size_t)6, @"compact size");
+    XCTAssertEqual(compact_size, NetworkAgentCompactCodec::size(head), @"size known up front");
+    
+    //both layouts in one stream, split inside the varints
+    unsigned char fixed[NetworkAgentWireHeader::SIZE];
+    NetworkAgentFixedCodec::encode(head, fixed);
+    std::string wire;
+    wire.append((const char*)compact, compact_size).append("hello");
+    wire.append((const char*)fixed, sizeof(fixed)).append("world");
+    
+    NetworkAgentRingBuffer stream;
+    NetworkAgentFrameDecoder decoder;
+    NetworkAgentPackageHead out;
+    stream.append(wire.data(), 4);
+    XCTAssertEqual(decoder.next(stream, out), NetworkAgentFrameDecoder::NEED_MORE, @"header incomplete");
+    stream.append(wire.data() + 4, wire.size() - 4);
+    XCTAssertEqual(decoder.next(stream, out), NetworkAgentFrameDecoder::FRAME, @"compact package");
+    XCTAssertEqual(out.target_agent_id, 912u, @"varint target");
+    XCTAssertEqual(decoder.next(stream, out), NetworkAgentFrameDecoder::FRAME, @"fixed package");
+    XCTAssertTrue(decoder.compact(), @"peer understands compact headers");
+    
+    std::string payload;
+    XCTAssertTrue(decoder.pop(stream, out, &payload) && payload == "hello", @"first payload");
+    XCTAssertTrue(decoder.pop(stream, out, &payload) && payload == "world", @"second payload");
+    XCTAssertTrue(stream.empty(), @"stream drained");
+}
+
+static int released[3];
+static void note_released(void* owner)
+{
+    released[(size_t)owner]++;
+}
+
+- (void)testWriteCoalescer
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentCoalescer* coalescer = new NetworkAgentCoalescer(1);
+    NetworkAgentHold holds[3];
+    for(size_t i=0; i<3; i++)
+    {
+        holds[i].fire = note_released;
+        holds[i].owner = (void*)i;
+        released[i] = 0;
+    }
+    
+    //one flush run covers every later deadline of the shard
+    coalescer->hold(0, &holds[0], 100);
+    XCTAssertTrue(coalescer->claim(0, 100), @"first deadline needs a run");
+    coalescer->hold(0, &holds[1], 200);
+    XCTAssertFalse(coalescer->claim(0, 200), @"the earlier run comes first");
+    coalescer->hold(0, &holds[2], 300);
+    coalescer->drop(&holds[2]);
+    
+    coalescer->ran(0, 100);
+    XCTAssertEqual(coalescer->expire(0, 150), 200ull, @"next deadline left");
+    XCTAssertEqual(released[0], 1, @"due hold released");
+    XCTAssertEqual(released[1], 0, @"later hold kept");
+    XCTAssertTrue(coalescer->claim(0, 200), @"rescheduled");
+    
+    XCTAssertEqual(coalescer->expire(0, 250), NetworkAgentCoalescer::NONE, @"nothing left");
+    XCTAssertEqual(released[1], 1, @"released on its deadline");
+    XCTAssertEqual(released[2], 0, @"dropped hold never released");
+    coalescer->release();
+}
+
+- (void)testStreamInterleaving
+{
+    using namespace libgcdnet;
+    
+    //two bulk streams, one weighted 4x, and a small package showing up in the middle
+    NetworkAgentStreamScheduler scheduler(1000);
+    scheduler.set_weight(1, 4 * NetworkAgentStreamScheduler::DEFAULT_WEIGHT);
+    NetworkAgentPayload* bulk[2];
+    for(int i=0; i<2; i++)
+    {
+        bulk[i] = NetworkAgentPayload::create(100000);
+        memset(bulk[i]->mutable_data(), 'a' + i, bulk[i]->size());
+        scheduler.push(i + 1, 12, 912, bulk[i]);
+    }
+    
+    NetworkAgentRingBuffer wire;
+    NetworkAgentFrameDecoder decoder;
+    NetworkAgentStreamAssembler assembler;
+    NetworkAgentSegment seg;
+    int segments = 0, small_at = 0;
+    std::string completed;
+    while(scheduler.next(seg))
+    {
+        segments++;
+        wire.append(seg.head, sizeof(seg.head));
+        wire.append(seg.data, seg.len);
+        seg.payload->release();
+        if(segments == 10)
+        {
+            NetworkAgentPayload* small = NetworkAgentPayload::create(1);
+            small->mutable_data()[0] = 'c';
+            scheduler.push(3, 12, 912, small);
+        }
+        
+        NetworkAgentPackageHead head;
+        NetworkAgentPayload* payload;
+        while(decoder.next(wire, head) == NetworkAgentFrameDecoder::FRAME)
+        {
+            decoder.unframe(wire, head);
+            if(assembler.take(wire, head, &payload, NULL) != NetworkAgentStreamAssembler::COMPLETE)
+                continue;
+            XCTAssertEqual(head.target_agent_id, 912u, @"package header restored");
+            completed += payload->data()[0];
+            if(payload->data()[0] == 'c')
+                small_at = segments;
+            payload->release();
+        }
+    }
+    XCTAssertEqual(small_at, 11, @"small package right after the segment in flight");
+    XCTAssertTrue(completed == "cab", @"weighted stream finishes first");
+    XCTAssertEqual(wire.size(), (size_t)0, @"all segments taken");
+}
+
+- (void)testBufferPoolRecycling
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentBufferPool* pool = new NetworkAgentBufferPool();
+    {
+        NetworkAgentRingBuffer ring;
+        ring.set_pool(pool);
+        
+        //every read event leases a block and hands it back once drained
+        for(int i=0; i<100; i++)
+        {
+            ring.reserve(3000);
+            ring.append("payload", 7);
+            ring.consume(7);
+            XCTAssertTrue(ring.shrink(), @"empty cache releases its storage");
+        }
+    }
+    
+    NetworkAgentBufferPool::Stats stats = pool->stats();
+    XCTAssertEqual(stats.misses, 1ull, @"only the first lease hits the allocator");
+    XCTAssertEqual(stats.hits, 99ull, @"later leases are served from the free list");
+    pool->release();
+}
+
+- (void)testPayloadHandoff
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentBufferPool* pool = new NetworkAgentBufferPool();
+    std::string wire;
+    std::string small(100, 's'), large(5000, 'l');
+    const std::string* payloads[] = { &small, &large };
+    for(int i=0; i<2; i++)
+    {
+        NetworkAgentPackageHead head;
+        head.protocol = NetworkAgentWireHeader::PROTOCOL;
+        head.payload_size = payloads[i]->size();
+        head.source_agent_id = 1;
+        head.target_agent_id = 2;
+        unsigned char raw[NetworkAgentWireHeader::SIZE];
+        NetworkAgentWireHeader::encode(head, raw);
+        wire.append((const char*)raw, sizeof(raw));
+        wire.append(*payloads[i]);
+    }
+    
+    {
+        NetworkAgentRingBuffer stream;
+        stream.set_pool(pool);
+        NetworkAgentFrameDecoder decoder;
+        NetworkAgentPackageHead head;
+        
+        //a complete package leaves the stream as a payload of its own
+        stream.append(wire.data(), 2*NetworkAgentWireHeader::SIZE + small.size() + 10);
+        XCTAssertEqual(decoder.next(stream, head), NetworkAgentFrameDecoder::FRAME, @"first package");
+        NetworkAgentPayload* payload;
+        XCTAssertTrue(decoder.pop(stream, head, &payload, pool), @"payload handed out");
+        XCTAssertTrue(std::string(payload->data(), payload->size()) == small, @"payload bytes");
+        payload->release();
+        
+        //the started one moves out of the stream and the rest is read straight into place
+        XCTAssertEqual(decoder.next(stream, head), NetworkAgentFrameDecoder::NEED_MORE, @"second package incomplete");
+        XCTAssertTrue(decoder.pending(head) && head.payload_size == large.size(), @"second header known");
+        payload = NetworkAgentPayload::create(head.payload_size, pool);
+        size_t filled = decoder.take_pending(stream, payload->mutable_data());
+        XCTAssertEqual(filled, (size_t)10, @"bytes already received");
+        XCTAssertTrue(stream.empty(), @"stream handed over");
+        memcpy(payload->mutable_data() + filled, wire.data() + wire.size() - large.size() + filled, large.size() - filled);
+        XCTAssertTrue(std::string(payload->data(), payload->size()) == large, @"large payload bytes");
+        payload->release();
+    }
+    pool->release();
+}
+
+- (void)testSessionPoolRecycling
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentSessionPool* pool = new NetworkAgentSessionPool(1);
+    NetworkAgentClientSession* a = pool->acquire();
+    NetworkAgentClientSession* b = pool->acquire();
+    NetworkAgentClientSession::dispose(a);
+    NetworkAgentClientSession::dispose(b); //free list full, deleted
+    
+    NetworkAgentSessionPool::Stats st = pool->stats();
+    XCTAssertEqual(st.created, 2ull, @"both allocated");
+    XCTAssertEqual(st.recycled, 1ull, @"first one kept");
+    XCTAssertEqual(st.discarded, 1ull, @"second one deleted");
+    XCTAssertEqual(st.idle, (size_t)1, @"one waiting");
+    
+    NetworkAgentClientSession* c = pool->acquire();
+    XCTAssertTrue(c == a, @"same object again");
+    XCTAssertEqual(pool->stats().reused, 1ull, @"served from the free list");
+    XCTAssertEqual(c->stats().bytes_in, 0ull, @"counters start over");
+    
+    //the session handed out keeps the pool alive
+    pool->release();
+    NetworkAgentClientSession::dispose(c);
+}
+
+- (void)testCaptureRoundTrip
+{
+    using namespace libgcdnet;
+    
+    std::string path = std::string([NSTemporaryDirectory() UTF8String]) + "/gcd-netlib-test.trace";
+    NetworkAgentCapture* capture = new NetworkAgentCapture();
+    XCTAssertEqual(capture->start(path.c_str()), 0, @"trace file created");
+    
+    //one package recorded from memory, one still in a session's stream
+    NetworkAgentPackageHead head;
+    head.protocol = NetworkAgentWireHeader::PROTOCOL;
+    head.payload_size = 5;
+    head.source_agent_id = 12;
+    head.target_agent_id = 912;
+    uint64_t first = 0, second = 0;
+    capture->record(first, head, "hello");
+    NetworkAgentRingBuffer stream;
+    stream.append("..world", 7);
+    capture->record(second, head, stream, 2);
+    capture->stop();
+    capture->release();
+    
+    NetworkAgentTraceReader trace;
+    XCTAssertEqual(trace.open(path.c_str()), 0, @"trace file read");
+    NetworkAgentTraceRecord rec;
+    XCTAssertTrue(trace.next(rec) && std::string(rec.payload, rec.head.payload_size) == "hello", @"first package");
+    XCTAssertEqual(rec.head.target_agent_id, 912u, @"target kept");
+    XCTAssertTrue(trace.next(rec) && std::string(rec.payload, rec.head.payload_size) == "world", @"second package");
+    XCTAssertTrue(rec.session != first, @"sessions told apart");
+    XCTAssertFalse(trace.next(rec), @"nothing left");
+    unlink(path.c_str());
+}
+
+- (void)testRegistryEpoch
+{
+    using namespace libgcdnet;
+    
+    struct Agent : NetworkAgentClientDelegate
+    {
+        unsigned int id;
+        unsigned int agent_id() const { return id; }
+        void closed(){}
+        void connected(NetworkAgentClientSession* request){}
+        void data_received(){}
+        void data_sent(){}
+    };
+    
+    //start small so that registering forces the table to grow
+    NetworkAgentRegistry registry(2);
+    Agent agents[100];
+    for(int i=0; i<100; i++)
+    {
+        agents[i].id = 912 + i;
+        registry.register_agent(&agents[i]);
+    }
+    XCTAssertEqual(registry.size(), (size_t)100, @"all registered");
+    XCTAssertTrue(registry.search(912 + 42) == &agents[42], @"found after growth");
+    XCTAssertTrue(registry.search(12) == NULL, @"unknown agent");
+    
+    //new agents leave cached routes alone, removing one invalidates them
+    uint64_t epoch = registry.epoch();
+    XCTAssertTrue(registry.unregister_agent(912 + 42), @"unregistered");
+    XCTAssertEqual(registry.epoch(), epoch + 1, @"epoch moved on");
+    XCTAssertTrue(registry.search(912 + 42) == NULL, @"gone");
+    XCTAssertTrue(registry.search(912 + 43) == &agents[43], @"neighbour still found");
+    XCTAssertFalse(registry.unregister_agent(912 + 42), @"only once");
+}
+
+- (void)testMetricsSnapshot
+{
+    using namespace libgcdnet;
+    
+    NetworkAgentMetrics* metrics = new NetworkAgentMetrics(2);
+    metrics->shard(0).counters.bytes_in.add(5);
+    metrics->shard(1).counters.bytes_in.add(10);
+    for(int i=0; i<99; i++)
+        metrics->shard(0).counters.read_handler.record(100);
+    metrics->shard(1).counters.read_handler.record(1000000);
+    
+    NetworkAgentMetrics::Snapshot snap = metrics->snapshot();
+    XCTAssertEqual(snap.totals.bytes_in, 15ull, @"shard slots are summed");
+    XCTAssertEqual(snap.read_handler.count(), 100ull, @"every handler run recorded");
+    XCTAssertEqual(snap.read_handler.percentile(0.5), 128ull, @"median falls in the 2^7 ns bucket");
+    XCTAssertEqual(snap.read_handler.percentile(1.0), 1ull << 20, @"slowest run in the 2^20 ns bucket");
+    metrics->release();
+}
+
+//server side agent of the session tests, signals every package and the close of its session
+class Sink : public libgcdnet::NetworkAgentClientDelegate
+{
+public:
+    Sink(unsigned int agent) : id(agent), received(dispatch_semaphore_create(0)), gone(dispatch_semaphore_create(0)) {}
+    ~Sink()
+    {
+        dispatch_release(received);
+        dispatch_release(gone);
+    }
+    
+    unsigned int agent_id() const { return id; }
+    void closed(){ dispatch_semaphore_signal(gone); }
+    void connected(libgcdnet::NetworkAgentClientSession* request){}
+    void data_received(){ dispatch_semaphore_signal(received); }
+    void data_sent(){}
+    
+    unsigned int id;
+    dispatch_semaphore_t received;
+    dispatch_semaphore_t gone;
+};
+
+//hands every package to the sink of its target
+class SinkDispatcher : public libgcdnet::NetworkAgentDispatcherDelegate
+{
+public:
+    libgcdnet::NetworkAgentClientDelegate* search(unsigned int target_agent_id) const
+    {
+        for(size_t i=0; i<sinks.size(); i++)
+            if(sinks[i]->agent_id() == target_agent_id)
+                return sinks[i];
+        return NULL;
+    }
+    
+    std::vector<libgcdnet::NetworkAgentClientDelegate*> sinks;
+};
+
+static bool signaled(dispatch_semaphore_t sem)
+{
+    return dispatch_semaphore_wait(sem, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)) == 0;
+}
+
+//a plain loopback connection that takes the server hello, then sends one package with the
+//end of its stream right behind it, in the same segment where the socket can be corked
+static int send_and_hang_up(unsigned short port, unsigned int target_agent_id, const char* payload)
+{
+    using namespace libgcdnet;
+    
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    
+    //the hello is written by then, nothing else wakes the session up
+    char hello[256];
+    recv(sock, hello, sizeof(hello), 0);
+    usleep(50000);
+    
+    NetworkAgentPackageHead head;
+    head.protocol = NetworkAgentWireHeader::PROTOCOL;
+    head.payload_size = strlen(payload);
+    head.source_agent_id = 12;
+    head.target_agent_id = target_agent_id;
+    unsigned char raw[NetworkAgentWireHeader::SIZE];
+    NetworkAgentWireHeader::encode(head, raw);
+    std::string wire((const char*)raw, sizeof(raw));
+    wire.append(payload);
+#ifdef TCP_CORK
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+    send(sock, wire.data(), wire.size(), 0);
+    shutdown(sock, SHUT_WR);
+    return sock;
+}
+
+- (void)testPeerHangupClosesSession
+{
+    using namespace libgcdnet;
+    
+    std::vector<NetworkAgentEngine::Kind> engines(1, NetworkAgentEngine::DISPATCH);
+#ifdef __linux__
+    engines.push_back(NetworkAgentEngine::EPOLL);
+#endif
+    for(size_t i=0; i<engines.size(); i++)
+    {
+        unsigned short port = 8890 + i;
+        char servname[8];
+        snprintf(servname, sizeof(servname), "%u", port);
+        Sink sink(912);
+        SinkDispatcher dispatcher;
+        dispatcher.sinks.push_back(&sink);
+        NetworkAgentOptions options;
+        options.engine = engines[i];
+        
+        try{
+            NetworkAgent server(NetworkAgent::SERVER, &dispatcher, options);
+            server.listen(NULL, servname);
+            
+            //the package and the end of the stream come in together, the session sees both
+            int sock = send_and_hang_up(port, 912, "bye");
+            XCTAssertTrue(sock >= 0, @"connected");
+            XCTAssertTrue(signaled(sink.received), @"package received");
+            XCTAssertTrue(signaled(sink.gone), @"session closed on the hangup");
+            close(sock);
+        }
+        catch(NetworkAgentException e)
+        {
+            XCTFail(@"%s", e.what());
+        }
+    }
+}
+
+
+- (void)testBroadcastTargets
+{
+    using namespace libgcdnet;
+    
+    Sink first(1001), second(1002);
+    SinkDispatcher dispatcher;
+    dispatcher.sinks.push_back(&first);
+    dispatcher.sinks.push_back(&second);
+    
+    try{
+        NetworkAgent server(NetworkAgent::SERVER, &dispatcher);
+        server.listen(NULL, "8892");
+        NetworkAgent client(NetworkAgent::CLIENT, NULL);
+        
+        //one header, patched per session, each package finds the sink of its own target
+        std::vector<NetworkAgentBroadcastTarget> targets(2);
+        for(size_t i=0; i<targets.size(); i++)
+        {
+            targets[i].session = client.connect("localhost", "8892");
+            targets[i].target_agent_id = 1001 + i;
+        }
+        const char* text = "fan out";
+        NetworkAgentPayload* payload = NetworkAgentPayload::create(strlen(text));
+        memcpy(payload->mutable_data(), text, strlen(text));
+        client.broadcast(targets, 12, payload);
+        XCTAssertTrue(signaled(first.received), @"first target reached");
+        XCTAssertTrue(signaled(second.received), @"second target reached");
+        
+        //the sinks have to outlive the server sessions
+        for(size_t i=0; i<targets.size(); i++)
+            targets[i].session->close();
+        XCTAssertTrue(signaled(first.gone), @"first session closed");
+        XCTAssertTrue(signaled(second.gone), @"second session closed");
+    }
+    catch(NetworkAgentException e)
+    {
+        XCTFail(@"%s", e.what());
+    }
+}
+
+
+//client side of testWriteWatermarks, signals the congestion of its session and the end of it
+class Producer : public libgcdnet::NetworkAgentClientDelegate
+{
+public:
+    Producer() : congested(dispatch_semaphore_create(0)), resumed(dispatch_semaphore_create(0)), gone(dispatch_semaphore_create(0)) {}
+    ~Producer()
+    {
+        dispatch_release(congested);
+        dispatch_release(resumed);
+        dispatch_release(gone);
+    }
+    
+    unsigned int agent_id() const { return 12; }
+    void closed(){ dispatch_semaphore_signal(gone); }
+    void connected(libgcdnet::NetworkAgentClientSession* request){}
+    void data_received(){}
+    void data_sent(){}
+    void write_congested(libgcdnet::NetworkAgentClientSession* session){ dispatch_semaphore_signal(congested); }
+    void write_resumed(libgcdnet::NetworkAgentClientSession* session){ dispatch_semaphore_signal(resumed); }
+    
+    dispatch_semaphore_t congested;
+    dispatch_semaphore_t resumed;
+    dispatch_semaphore_t gone;
+};
+
+//server side of testWriteWatermarks, leaves every package unread until the test reads them
+class Holder : public Sink
+{
+public:
+    Holder() : Sink(912), session(NULL) {}
+    
+    void session_data_received(libgcdnet::NetworkAgentClientSession* s)
+    {
+        session.store(s);
+    }
+    
+    std::atomic<libgcdnet::NetworkAgentClientSession*> session;
+};
+
+- (void)testWriteWatermarks
+{
+    using namespace libgcdnet;
+    
+    const size_t count = 512;
+    Holder holder;
+    SinkDispatcher dispatcher;
+    dispatcher.sinks.push_back(&holder);
+    NetworkAgentOptions server_options;
+    server_options.watermarks.read_pause_frames = 4;
+    NetworkAgentOptions client_options;
+    client_options.watermarks.session_high = 256 * 1024;
+    client_options.watermarks.session_low = 64 * 1024;
+    Producer producer;
+    
+    try{
+        NetworkAgent server(NetworkAgent::SERVER, &dispatcher, server_options);
+        server.listen(NULL, "8893");
+        NetworkAgent client(NetworkAgent::CLIENT, NULL, client_options);
+        NetworkAgentClientSession* session = client.connect("localhost", "8893");
+        session->setDelegate(&producer);
+        
+        //the server stops reading after a few packages, the rest piles up in the client's queue
+        std::string chunk(64 * 1024, 'w');
+        for(size_t i=0; i<count; i++)
+            session->write_data(12, 912, chunk);
+        XCTAssertTrue(signaled(producer.congested), @"congested past the high watermark");
+        XCTAssertFalse(session->writable(), @"not writable while congested");
+        
+        //reading the backlog resumes the server's reads, the client's queue drains
+        size_t read = 0, intact = 0;
+        for(int idle = 0; read < count && idle < 10000; )
+        {
+            NetworkAgentClientSession* s = holder.session.load();
+            std::string data;
+            if(s)
+                s->read_data(data);
+            if(data.empty())
+            {
+                usleep(1000);
+                idle++;
+                continue;
+            }
+            read++;
+            if(data == chunk)
+                intact++;
+        }
+        XCTAssertEqual(read, count, @"every package read");
+        XCTAssertEqual(intact, count, @"every package intact");
+        XCTAssertTrue(signaled(producer.resumed), @"resumed below the low watermark");
+        XCTAssertTrue(session->writable(), @"writable again");
+        
+        session->close();
+        XCTAssertTrue(signaled(producer.gone), @"client session closed");
+        XCTAssertTrue(signaled(holder.gone), @"server session closed");
+    }
+    catch(NetworkAgentException e)
+    {
+        XCTFail(@"%s", e.what());
+    }
+}
+
+- (void)testConnectAsync
+{
+    using namespace libgcdnet;
+    
+    Sink user(12);
+    try{
+        NetworkAgent server(NetworkAgent::SERVER, NULL);
+        server.listen(NULL, "8894");
+        NetworkAgent client(NetworkAgent::CLIENT, NULL);
+        
+        __block NetworkAgentClientSession* session = NULL;
+        __block int error = -1;
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        client.connect_async("localhost", "8894", &user, ^(NetworkAgentClientSession* s, int e){
+            session = s;
+            error = e;
+            dispatch_semaphore_signal(done);
+        }, 2000);
+        XCTAssertTrue(signaled(done), @"connect reported");
+        XCTAssertTrue(session != NULL && error == 0, @"connected");
+        NetworkAgentClientSession* connected = session;
+        
+        //nobody listens there, the attempt fails right away instead of running into the timeout
+        client.connect_async("localhost", "8899", &user, ^(NetworkAgentClientSession* s, int e){
+            session = s;
+            error = e;
+            dispatch_semaphore_signal(done);
+        }, 2000);
+        XCTAssertTrue(signaled(done), @"failure reported");
+        XCTAssertTrue(session == NULL && error != 0 && error != ETIMEDOUT, @"refused");
+        
+        if(connected)
+        {
+            connected->close();
+            XCTAssertTrue(signaled(user.gone), @"session closed");
+        }
+        dispatch_release(done);
+    }
+    catch(NetworkAgentException e)
+    {
+        XCTFail(@"%s", e.what());
+    }
+}
+
+//a session of the pool to localhost:servname with delegate installed, NULL if none came
+static libgcdnet::NetworkAgentClientSession* acquire_session(libgcdnet::NetworkAgentConnectionPool& pool, const char* servname,
+                                                             libgcdnet::NetworkAgentClientDelegate* delegate)
+{
+    __block libgcdnet::NetworkAgentClientSession* session = NULL;
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    pool.acquire("localhost", servname, delegate, ^(libgcdnet::NetworkAgentClientSession* s, int error){
+        session = s;
+        dispatch_semaphore_signal(done);
+    });
+    bool came = signaled(done);
+    dispatch_release(done);
+    return came ? session : NULL;
+}
+
+- (void)testConnectionPoolTrimsIdle
+{
+    using namespace libgcdnet;
+    
+    Sink user(12);
+    try{
+        NetworkAgent server(NetworkAgent::SERVER, NULL);
+        server.listen(NULL, "8895");
+        NetworkAgent client(NetworkAgent::CLIENT, NULL);
+        NetworkAgentConnectionPool pool(&client, 0, 1);
+        
+        NetworkAgentClientSession* first = acquire_session(pool, "8895", &user);
+        NetworkAgentClientSession* second = acquire_session(pool, "8895", &user);
+        XCTAssertTrue(first && second && first != second, @"two connections");
+        XCTAssertEqual(pool.idle("localhost", "8895"), (size_t)0, @"both handed out");
+        
+        //given back on their contexts, the one beyond max_idle is closed
+        pool.release("localhost", "8895", first);
+        pool.release("localhost", "8895", second);
+        for(int i=0; i<1000 && pool.idle("localhost", "8895") < 1; i++)
+            usleep(1000);
+        usleep(50000);
+        XCTAssertEqual(pool.idle("localhost", "8895"), (size_t)1, @"trimmed to max_idle");
+        
+        //handed out warm, no new connection
+        NetworkAgentClientSession* third = acquire_session(pool, "8895", &user);
+        XCTAssertTrue(third && (third == first || third == second), @"idle session reused");
+        XCTAssertEqual(pool.idle("localhost", "8895"), (size_t)0, @"taken from the pool");
+        if(third)
+            pool.release("localhost", "8895", third);
+    }
+    catch(NetworkAgentException e)
+    {
+        XCTFail(@"%s", e.what());
+    }
+}
+
+
+//server side of testRpcDeadlines, signals the close of its session
+class RpcEcho final : public libgcdnet::NetworkAgentRpcServer
+{
+public:
+    RpcEcho(libgcdnet::NetworkAgentRpcServeHandler handler)
+    : libgcdnet::NetworkAgentRpcServer(700, handler), gone(dispatch_semaphore_create(0)) {}
+    ~RpcEcho()
+    {
+        dispatch_release(gone);
+    }
+    
+    void session_closed(libgcdnet::NetworkAgentClientSession* session){ dispatch_semaphore_signal(gone); }
+    
+    dispatch_semaphore_t gone;
+};
+
+//the outcome of one call, filled in on the session's context
+struct RpcResult
+{
+    RpcResult() : error(-1), done(dispatch_semaphore_create(0)) {}
+    ~RpcResult()
+    {
+        dispatch_release(done);
+    }
+    
+    int error;
+    std::string body;
+    dispatch_semaphore_t done;
+};
+
+static void rpc_call(libgcdnet::NetworkAgentRpcClient* rpc, const char* body, RpcResult* result, unsigned int deadline_ms = 0)
+{
+    rpc->call(700, body, strlen(body), ^(int error, const char* response, size_t len){
+        result->error = error;
+        if(response)
+            result->body.assign(response, len);
+        dispatch_semaphore_signal(result->done);
+    }, deadline_ms);
+}
+
+- (void)testRpcDeadlines
+{
+    using namespace libgcdnet;
+    
+    //echoes every call, those naming a delay in ms answer only after it
+    __block RpcEcho* echo = NULL;
+    echo = new RpcEcho(^(NetworkAgentRpcCall call, const char* body, size_t len){
+        std::string text(body, len);
+        int delay = atoi(text.c_str());
+        if(!delay)
+        {
+            echo->respond(call, body, len);
+            return;
+        }
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay * NSEC_PER_MSEC),
+                       dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            echo->respond(call, text.data(), text.size());
+        });
+    });
+    SinkDispatcher dispatcher;
+    dispatcher.sinks.push_back(echo);
+    
+    try{
+        NetworkAgent server(NetworkAgent::SERVER, &dispatcher);
+        server.listen(NULL, "8896");
+        NetworkAgent client(NetworkAgent::CLIENT, NULL);
+        NetworkAgentClientSession* session = client.connect("localhost", "8896");
+        NetworkAgentRpcClient* rpc = new NetworkAgentRpcClient(session, 12);
+        
+        RpcResult ping;
+        rpc_call(rpc, "ping", &ping);
+        XCTAssertTrue(signaled(ping.done), @"ping answered");
+        XCTAssertTrue(ping.error == 0 && ping.body == "ping", @"ping echoed");
+        
+        //the slot of the timed out call is reused while its response is still on the way,
+        //the late response must not complete the call now in it
+        RpcResult slow, later;
+        rpc_call(rpc, "300", &slow, 100);
+        XCTAssertTrue(signaled(slow.done), @"deadline fired");
+        XCTAssertEqual(slow.error, ETIMEDOUT, @"timed out");
+        rpc_call(rpc, "600", &later);
+        XCTAssertTrue(signaled(later.done), @"second call answered");
+        XCTAssertTrue(later.error == 0 && later.body == "600", @"late response ignored");
+        XCTAssertEqual(rpc->outstanding(), (size_t)0, @"nothing outstanding");
+        
+        //answered within the same read, the responses come back batched
+        const int burst = 10;
+        RpcResult results[burst];
+        std::string bodies[burst];
+        for(int i=0; i<burst; i++)
+        {
+            bodies[i] = std::string("call ") + (char)('a' + i);
+            rpc_call(rpc, bodies[i].c_str(), &results[i]);
+        }
+        int answered = 0;
+        for(int i=0; i<burst; i++)
+            if(signaled(results[i].done) && results[i].error == 0 && results[i].body == bodies[i])
+                answered++;
+        XCTAssertEqual(answered, burst, @"every call answered with its own response");
+        
+        session->close();
+        XCTAssertTrue(signaled(echo->gone), @"server session closed");
+        rpc->release();
+    }
+    catch(NetworkAgentException e)
+    {
+        XCTFail(@"%s", e.what());
+    }
+    delete echo;
+}
+
+
+- (void)testLocalSocket
+{
+    using namespace libgcdnet;
+    
+    std::string dir([NSTemporaryDirectory() UTF8String]);
+    while(dir.size() > 1 && dir[dir.size() - 1] == '/')
+        dir.erase(dir.size() - 1);
+    std::string path = dir + "/gcd-netlib.8897.sock";
+    Sink sink(912);
+    SinkDispatcher dispatcher;
+    dispatcher.sinks.push_back(&sink);
+    NetworkAgentOptions options;
+    options.local_dir = dir;
+    struct stat st;
+    
+    try{
+        NetworkAgent server(NetworkAgent::SERVER, &dispatcher, options);
+        server.listen(NULL, "8897");
+        XCTAssertTrue(stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode), @"listening on the local socket");
+        
+        //named explicitly
+        NetworkAgent client(NetworkAgent::CLIENT, NULL);
+        NetworkAgentClientSession* session = client.connect(("unix:" + path).c_str(), "8897");
+        session->write_data(12, 912, std::string("local"));
+        XCTAssertTrue(signaled(sink.received), @"package over the unix socket");
+        session->close();
+        XCTAssertTrue(signaled(sink.gone), @"session closed");
+        
+        //found through the port by a client sharing the directory
+        NetworkAgent local(NetworkAgent::CLIENT, NULL, options);
+        session = local.connect("localhost", "8897");
+        session->write_data(12, 912, std::string("local"));
+        XCTAssertTrue(signaled(sink.received), @"package over the port's socket");
+        session->close();
+        XCTAssertTrue(signaled(sink.gone), @"session closed");
+    }
+    catch(NetworkAgentException e)
+    {
+        XCTFail(@"%s", e.what());
+    }
+    XCTAssertTrue(stat(path.c_str(), &st) != 0, @"socket removed with the server");
+}
+
+
+//frames of a fixed layout peer's stream until a compact header turns up at the front
+//@return number of fixed frames taken off, the offers among them counted in offers
+static size_t take_fixed_frames(std::string& wire, size_t& offers)
+{
+    using namespace libgcdnet;
+    
+    size_t frames = 0;
+    while(wire.size() >= NetworkAgentWireHeader::SIZE && (unsigned char)wire[0] != NetworkAgentVarintLayout::MARKER)
+    {
+        NetworkAgentPackageHead head;
+        NetworkAgentWireHeader::decode((const unsigned char*)wire.data(), head);
+        if(wire.size() < NetworkAgentWireHeader::SIZE + head.payload_size)
+            break;
+        if(head.protocol == NetworkAgentWireHeader::HEARTBEAT && (head.source_agent_id & NetworkAgentWireHeader::OFFER_COMPACT))
+            offers++;
+        wire.erase(0, NetworkAgentWireHeader::SIZE + head.payload_size);
+        frames++;
+    }
+    return frames;
+}
+
+- (void)testCompactHeadersOffer
+{
+    using namespace libgcdnet;
+    
+    Sink sink(912);
+    SinkDispatcher dispatcher;
+    dispatcher.sinks.push_back(&sink);
+    NetworkAgentOptions options;
+    options.compact_headers = true;
+    options.timeouts.heartbeat = 100;
+    
+    try{
+        NetworkAgent server(NetworkAgent::SERVER, &dispatcher, options);
+        server.listen(NULL, "8898");
+        
+        //a peer of the fixed layout
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(8898);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        XCTAssertTrue(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0, @"connected");
+        struct timeval wait = {0, 100000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+        
+        //the hello and the offer come in the fixed layout, the heartbeats that follow too
+        std::string wire;
+        char buf[256];
+        size_t frames = 0, offers = 0;
+        for(int i=0; i<50 && frames < 3; i++)
+        {
+            ssize_t n = recv(sock, buf, sizeof(buf), 0);
+            if(n > 0)
+                wire.append(buf, n);
+            frames += take_fixed_frames(wire, offers);
+        }
+        XCTAssertTrue(frames >= 3 && wire.empty(), @"fixed headers only");
+        XCTAssertTrue(offers > 0, @"compact headers offered");
+        
+        //a package in the fixed layout is taken as ever
+        NetworkAgentPackageHead head = {NetworkAgentWireHeader::PROTOCOL, 3, 12, 912};
+        unsigned char raw[NetworkAgentWireHeader::SIZE];
+        NetworkAgentWireHeader::encode(head, raw);
+        std::string package((const char*)raw, sizeof(raw));
+        package.append("old");
+        send(sock, package.data(), package.size(), 0);
+        XCTAssertTrue(signaled(sink.received), @"package received");
+        
+        //once offered back, the server's heartbeats go compact
+        NetworkAgentPackageHead beat = {NetworkAgentWireHeader::HEARTBEAT, 0, NetworkAgentWireHeader::OFFER_COMPACT, 0};
+        NetworkAgentWireHeader::encode(beat, raw);
+        send(sock, raw, sizeof(raw), 0);
+        for(int i=0; i<50 && wire.empty(); i++)
+        {
+            ssize_t n = recv(sock, buf, sizeof(buf), 0);
+            if(n > 0)
+                wire.append(buf, n);
+            take_fixed_frames(wire, offers);
+        }
+        XCTAssertTrue(!wire.empty() && (unsigned char)wire[0] == NetworkAgentVarintLayout::MARKER, @"switched to compact headers");
+        
+        close(sock);
+        XCTAssertTrue(signaled(sink.gone), @"session closed");
+    }
+    catch(NetworkAgentException e)
+    {
+        XCTFail(@"%s", e.what());
+    }
 }
 
 @end
@@ -5,12 +5,24 @@
 //
 
 #include "NetworkAgent.h"
+#include "NetworkAgentDispatchEngine.h"
+#include "NetworkAgentEpollEngine.h"
+#include "NetworkAgentUringEngine.h"
+#include "NetworkAgentTrace.h"
 #include <sstream>
+#include <chrono>
+#include <Block.h>
 #include <sys/socket.h> //socket() 
 #include <netdb.h> // ICPROTO_TCP  addrinfo
 #include <fcntl.h> // NON_BLOCKING I/O
 #include <cassert>
 #include <errno.h>
+#include <sys/uio.h> //readv() writev()
+#include <sys/un.h> //sockaddr_un
+#include <sys/stat.h> //stat()
+#include <netinet/in.h>
+#include <netinet/tcp.h> //TCP_NODELAY TCP_CORK
+#include <unistd.h> //sysconf()
 
 #include <cstring> //memcpy
 /**
@@ -23,467 +35,1882 @@
  **/
 namespace libgcdnet {
 
-        void NetworkAgent::client_worker_queue_finalizer(char* label)
+        //numbers of the connections of every agent, sessions are told apart by them across recycling
+        static std::atomic<uint64_t> session_serials(0);
+        
+        static uint64_t now_ns()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        
+        //"unix:/path" names a unix domain socket instead of a host
+        static const char* local_path(const char* hostname)
+        {
+            return hostname && strncmp(hostname, "unix:", 5) == 0 ? hostname + 5 : NULL;
+        }
+        
+        static bool loopback(const char* hostname)
+        {
+            return !hostname || !strcmp(hostname, "localhost") || !strcmp(hostname, "127.0.0.1") || !strcmp(hostname, "::1");
+        }
+        
+        //a single address entry for a unix domain socket, NULL if the path does not fit
+        static struct addrinfo* local_address(const std::string& path)
+        {
+            struct sockaddr_un* sun = (struct sockaddr_un*)calloc(1, sizeof(struct sockaddr_un));
+            if(path.size() >= sizeof(sun->sun_path))
+            {
+                free(sun);
+                return NULL;
+            }
+            sun->sun_family = AF_UNIX;
+            memcpy(sun->sun_path, path.c_str(), path.size() + 1);
+            
+            struct addrinfo* ai = (struct addrinfo*)calloc(1, sizeof(struct addrinfo));
+            ai->ai_family = AF_UNIX;
+            ai->ai_socktype = SOCK_STREAM;
+            ai->ai_protocol = 0;
+            ai->ai_addr = (struct sockaddr*)sun;
+            ai->ai_addrlen = sizeof(struct sockaddr_un);
+            return ai;
+        }
+        
+        //getaddrinfo() never comes up with unix domain sockets, those are ours
+        static void free_addresses(struct addrinfo* aires0)
+        {
+            if(aires0->ai_family == AF_UNIX)
+            {
+                free(aires0->ai_addr);
+                free(aires0);
+            }
+            else
+                freeaddrinfo(aires0);
+        }
+        
+        //socket options of an I/O policy that differ from what the socket has now, best effort,
+        //whatever the socket does not take is skipped. a fresh socket has the default policy
+        static void apply_policy(int sock, const NetworkAgentIOPolicy& p, const NetworkAgentIOPolicy& prev)
+        {
+            bool tcp = false;
+            if(p.nodelay != prev.nodelay || p.cork != prev.cork)
+            {
+                struct sockaddr_storage addr;
+                socklen_t len = sizeof(addr);
+                tcp = getsockname(sock, (struct sockaddr*)&addr, &len) == 0 && addr.ss_family != AF_UNIX;
+            }
+            
+            int on = p.nodelay ? 1 : 0;
+            if(tcp && p.nodelay != prev.nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)))
+                LIBGCDNET_TRACE("socket %d: TCP_NODELAY not set, errno %d", sock, errno);
+            on = p.cork ? 1 : 0;
+#if defined(TCP_CORK)
+            if(tcp && p.cork != prev.cork && setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)))
+                LIBGCDNET_TRACE("socket %d: TCP_CORK not set, errno %d", sock, errno);
+#elif defined(TCP_NOPUSH)
+            if(tcp && p.cork != prev.cork && setsockopt(sock, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on)))
+                LIBGCDNET_TRACE("socket %d: TCP_NOPUSH not set, errno %d", sock, errno);
+#endif
+            if(p.send_buffer && p.send_buffer != prev.send_buffer && 
+               setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &p.send_buffer, sizeof(p.send_buffer)))
+                LIBGCDNET_TRACE("socket %d: SO_SNDBUF not set, errno %d", sock, errno);
+            if(p.receive_buffer && p.receive_buffer != prev.receive_buffer && 
+               setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &p.receive_buffer, sizeof(p.receive_buffer)))
+                LIBGCDNET_TRACE("socket %d: SO_RCVBUF not set, errno %d", sock, errno);
+#ifdef SO_BUSY_POLL
+            int busy = (int)p.busy_poll_us;
+            if(p.busy_poll_us != prev.busy_poll_us && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy, sizeof(busy)))
+                LIBGCDNET_TRACE("socket %d: SO_BUSY_POLL not set, errno %d", sock, errno);
+#endif
+        }
+        
+        //a corked socket holds back the last partial segment, let it go once a coalesced batch is written
+        static void push_corked(int sock)
+        {
+            int off = 0, on = 1;
+#if defined(TCP_CORK)
+            setsockopt(sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+            setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+            setsockopt(sock, IPPROTO_TCP, TCP_NOPUSH, &off, sizeof(off));
+            setsockopt(sock, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#endif
+        }
+        
+        //a received package goes into the trace while capturing
+        void NetworkAgent::capture_package(struct NetworkAgentClientSession* req, const NetworkAgentPackageHead& head, const char* payload)
+        {
+            if(req->capture->active())
+                req->capture->record(req->c_session, head, payload);
+        }
+        
+        static void report(int sock, const NetworkAgentException& e)
+        {
+            LIBGCDNET_TRACE("session %d: %s", sock, e.what());
+        }
+        
+        //advance the wheel of a context once per tick until the agent is gone,
+        //each scheduled tick holds a reference of its own
+        static void tick(NetworkAgentEngine* engine, NetworkAgentTimeouts* timeouts, unsigned int context)
+        {
+            timeouts->retain();
+            engine->after(context, timeouts->tick_ns(), ^{
+                if(!timeouts->stopped())
+                {
+                    //a late tick catches up on every tick it missed
+                    timeouts->wheel(context).advance(timeouts->current_tick());
+                    tick(engine, timeouts, context);
+                }
+                timeouts->release();
+            });
+        }
+        
+        bool NetworkAgentEngine::handle_read(NetworkAgentClientSession* s, size_t estimated)
+        {
+            //a paused session leaves the bytes in the socket, resuming re-arms the engine
+            if(s->closed || !s->reading())
+                return false;
+            bool more = false;
+            uint64_t t0 = now_ns();
+            try{
+                more = NetworkAgent::client_worker_queue_read(s, estimated);
+            }catch(NetworkAgentException e)
+            {
+                report(s->sock, e);
+            }
+            s->time(&NetworkAgentSessionCounters::read_handler, now_ns() - t0);
+            return more;
+        }
+        
+        void NetworkAgentEngine::handle_write(NetworkAgentClientSession* s)
+        {
+            if(s->closed)
+                return;
+            uint64_t t0 = now_ns();
+            try{
+                NetworkAgent::client_worker_queue_write(s);
+            }catch(NetworkAgentException e)
+            {
+                report(s->sock, e);
+            }
+            s->time(&NetworkAgentSessionCounters::write_handler, now_ns() - t0);
+        }
+        
+        void NetworkAgentEngine::handle_input(NetworkAgentClientSession* s, const void* data, size_t len)
+        {
+            if(s->closed)
+                return;
+            uint64_t t0 = now_ns();
+            try{
+                s->count(&NetworkAgentSessionCounters::reads, 1);
+                if(len == 0){
+                    NetworkAgent::close_client_session(s);
+                    return;
+                }
+                //the payload in progress takes the first bytes
+                const char* bytes = (const char*)data;
+                if(s->r_direct){
+                    size_t direct = s->r_direct->size() - s->r_direct_filled;
+                    size_t taken = len < direct ? len : direct;
+                    memcpy(s->r_direct->mutable_data() + s->r_direct_filled, bytes, taken);
+                    NetworkAgent::client_worker_queue_direct(s, taken);
+                    bytes += taken;
+                    len -= taken;
+                }
+                if(len && !s->closed){
+                    s->r_buffer.append(bytes, len);
+                    NetworkAgent::client_worker_queue_ingest(s, len);
+                }
+            }catch(NetworkAgentException e)
+            {
+                report(s->sock, e);
+            }
+            s->time(&NetworkAgentSessionCounters::read_handler, now_ns() - t0);
+        }
+        
+        void NetworkAgentEngine::handle_sent(NetworkAgentClientSession* s, ssize_t result)
+        {
+            if(s->closed)
+                return;
+            uint64_t t0 = now_ns();
+            s->count(&NetworkAgentSessionCounters::writes, 1);
+            if(result < 0 && result != -EAGAIN && result != -EINTR){
+                s->count(&NetworkAgentSessionCounters::errors, 1);
+                LIBGCDNET_TRACE("session %d: send failed, errno %d", s->sock, (int)-result);
+                NetworkAgent::close_client_session(s);
+                return;
+            }
+            if(result > 0)
+                NetworkAgent::client_worker_queue_sent(s, result);
+            NetworkAgent::client_worker_queue_flushed(s);
+            s->time(&NetworkAgentSessionCounters::write_handler, now_ns() - t0);
+        }
+        
+        //gather write without raising SIGPIPE on a reset peer,
+        //BSD sockets get SO_NOSIGPIPE instead
+        static ssize_t send_iov(int sock, struct iovec* iov, int cnt)
         {
-            //const char* label = dispatch_queue_get_label(dispatch_get_current_queue());
-            std::cout << label << " exit." << std::endl;
-            delete[] label;
+#ifdef MSG_NOSIGNAL
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            return ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+#else
+            return ::writev(sock, iov, cnt);
+#endif
         }
         
-        //write all data from the req->w_data to client 
-        //invoked from within the client worker queue whenever the underlying socket has space to write
+        //flush queued frames from req->w_queue to client 
+        //invoked from within the session's I/O context whenever the underlying socket has space to write
         void NetworkAgent::client_worker_queue_write(NetworkAgentClientSession* req)
-        throw(NetworkAgentException)
+        LIBGCDNET_THROWS(NetworkAgentException)
         {
             //skip if nothing to write 
-            if(req->w_data.payload.size()==0)
+            if(req->w_queue.empty())
                 return;
             
-            int client_sock = dispatch_source_get_handle(req->w_source);
+            int client_sock = req->sock;
+            
+            //gather as many queued headers and payloads as one writev takes,
+            //a short write means the socket is flooded and we wait for the next event
+            ssize_t totalWriteBytes = 0, writeBytes = 0;
+            int err = 0;
+            while(!req->w_queue.empty())
+            {
+                //a relayed payload comes out of its pipe, nothing queued after it goes first
+                NetworkAgentRelaySplice* job = (NetworkAgentRelaySplice*)req->w_queue.splicing();
+                if(job)
+                {
+                    client_worker_queue_splice(job);
+                    if(req->closed || req->w_queue.splicing() == job)
+                        return;
+                    continue;
+                }
+                
+                struct iovec iov[NetworkAgentOutboundQueue::MAX_IOV];
+                int cnt = req->w_queue.gather(iov, NetworkAgentOutboundQueue::MAX_IOV);
+                size_t requested = 0;
+                for(int i=0; i<cnt; i++)
+                    requested += iov[i].iov_len;
+                
+                writeBytes = send_iov(client_sock, iov, cnt);
+                req->count(&NetworkAgentSessionCounters::writes, 1);
+                if(writeBytes < 0){
+                    err = errno;
+                    if(err == EINTR)
+                        continue;
+                    break;
+                }
+                
+                client_worker_queue_sent(req, writeBytes);
+                totalWriteBytes += writeBytes;
+                if((size_t)writeBytes < requested){
+                    req->count(&NetworkAgentSessionCounters::partial_writes, 1);
+                    break;
+                }
+            }
+            
+            LIBGCDNET_TRACE("session %d: %ld bytes written", client_sock, (long)totalWriteBytes);
             
-            //TODO: should really be getting what ever data that needs to write 
-            //copy whole data trunck to local buffer and clean up data cache
-            std::cout << "w_data=" << req->w_data.payload << std::endl;
+            //the rest stays queued at its exact offset until next available write
+            if(writeBytes < 0){
+                if(err == EAGAIN || err == EWOULDBLOCK)
+                    req->count(&NetworkAgentSessionCounters::eagain, 1);
+                else{
+                    req->count(&NetworkAgentSessionCounters::errors, 1);
+                    LIBGCDNET_TRACE("session %d: write failed, errno %d", client_sock, err);
+                }
+            }
             
-            //if first package to send, include header segment,
-            //otherwise jsut send the payload
-            int totalReadBytes;
-            if(req->w_data.complete())
-                totalReadBytes = req->w_data.size();
-            else 
-                totalReadBytes = req->w_data.payload.size();
-            char *buf = (char*)malloc(totalReadBytes);
+            client_worker_queue_flushed(req);
+        }
+        
+        //n bytes of the outbound queue were accepted by the socket
+        void NetworkAgent::client_worker_queue_sent(NetworkAgentClientSession* req, size_t n)
+        {
+            size_t done = req->w_queue.advance(n);
+            req->count(&NetworkAgentSessionCounters::bytes_out, n);
+            req->count(&NetworkAgentSessionCounters::frames_out, done);
+            req->backlog(-(int64_t)n, -(int64_t)done);
+            req->pump_streams();
+            req->update_congestion();
+            if(req->timeouts)
+                req->t_write = req->timeouts->wheel(req->context).now();
+        }
+        
+        //the session's timer is due, runs on its context from the wheel's tick.
+        //activity only moved the timestamps, what is really due is checked here
+        void NetworkAgent::client_worker_queue_timer(void* owner)
+        {
+            NetworkAgentClientSession* req = (NetworkAgentClientSession*)owner;
+            NetworkAgentTimeouts* t = req->timeouts;
+            const NetworkAgentTimeoutOptions& o = t->options();
+            uint64_t now = t->wheel(req->context).now();
+            
+            if(o.idle_read && now - req->t_read >= t->ticks(o.idle_read))
+            {
+                LIBGCDNET_TRACE("session %d: nothing received for %u ms, closing", req->sock, o.idle_read);
+                req->count(&NetworkAgentSessionCounters::errors, 1);
+                close_client_session(req);
+                return;
+            }
+            if(o.write_stall && req->w_active && now - req->t_write >= t->ticks(o.write_stall))
+            {
+                LIBGCDNET_TRACE("session %d: no write progress for %u ms, closing", req->sock, o.write_stall);
+                req->count(&NetworkAgentSessionCounters::errors, 1);
+                close_client_session(req);
+                return;
+            }
+            if(o.heartbeat && now - req->t_sent >= t->ticks(o.heartbeat))
+                req->enqueue_heartbeat();
+            
+            req->arm_timeouts();
+        }
+        
+        //all written, turn off writable notifications so that they do not repeatedly fire the write handler
+        //until the queue has some new frame
+        void NetworkAgent::client_worker_queue_flushed(NetworkAgentClientSession* req)
+        {
+            if(req->w_queue.empty() && req->w_active)
+            {
+                req->w_queue.shrink();
+                //every batch ends a coalescing window, without one the kernel decides when the tail leaves
+                if(req->policy.cork && req->policy.coalesce_us)
+                    push_corked(req->sock);
+
+                req->w_active = false;
+                req->engine->want_write(req, false);
+
+                if(req->delegate)
+                    req->delegate->data_sent();
+            }
+        }
+        
+        //client socket has available bytes to read
+        //invoked from within the session's I/O context 
+        //@param request - the associated request object 
+        //@param estimated - bytes the engine knows to be pending, 0 if unknown
+        //@return true if the read filled the whole buffer and more bytes may be pending
+        bool NetworkAgent::client_worker_queue_read(struct NetworkAgentClientSession* req, size_t estimated)
+        LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            //the payload coming in is spliced on, it is not read from here
+            if(req->r_splice)
+            {
+                client_worker_queue_splice(req->r_splice);
+                return !req->r_splice && !req->closed;
+            }
+            
+            int client_sock = req->sock;
+            
+            //read straight into the free region of the inbound stream, sized after
+            //the session's recent read volume, the source estimate can only raise it
+            size_t wanted = estimated > req->r_hint ? estimated : req->r_hint;
+            req->r_buffer.reserve(wanted);
+            struct iovec iov[3];
+            int cnt = 0;
+            
+            //the rest of a large payload goes straight into place, ahead of the stream
+            size_t direct = 0;
+            if(req->r_direct){
+                direct = req->r_direct->size() - req->r_direct_filled;
+                iov[0].iov_base = req->r_direct->mutable_data() + req->r_direct_filled;
+                iov[0].iov_len = direct;
+                cnt = 1;
+            }
+            cnt += req->r_buffer.write_iov(iov + cnt);
+            size_t requested = 0;
+            for(int i=0; i<cnt; i++)
+                requested += iov[i].iov_len;
+            ssize_t actual = ::readv(client_sock, iov, cnt);
+            int err = actual < 0 ? errno : 0;
+            req->count(&NetworkAgentSessionCounters::reads, 1);
+            
+            //some bytes are read
+            if(actual > 0){
+                size_t in_ring = actual;
+                if(direct){
+                    //the payload in progress takes the first bytes, whatever follows is already in the stream
+                    size_t taken = (size_t)actual < direct ? actual : direct;
+                    in_ring -= taken;
+                    req->r_buffer.commit(in_ring);
+                    client_worker_queue_direct(req, taken);
+                }
+                else
+                    req->r_buffer.commit(actual);
+                
+                if(in_ring && !req->closed)
+                    client_worker_queue_ingest(req, in_ring);
+            }
+            //reading end of the source
+            else
+                if(actual == 0)
+                    close_client_session(req);
+            
+            if(actual < 0 && (err == EAGAIN || err == EWOULDBLOCK))
+                req->count(&NetworkAgentSessionCounters::eagain, 1);
+            else if(actual < 0 && err != EINTR)
+            {
+                req->count(&NetworkAgentSessionCounters::errors, 1);
+                close_client_session(req);
+                throw NetworkAgentException("error reading socket");
+            }
+            
+            return actual > 0 && (size_t)actual == requested;
+        }
+        
+        //frame and deliver the packages completed by the bytes just appended to req->r_buffer
+        //@param received - number of bytes appended, feeds the read size estimate
+        void NetworkAgent::client_worker_queue_ingest(struct NetworkAgentClientSession* req, size_t received)
+        LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            LIBGCDNET_TRACE("session %d: %lu bytes read", req->sock, (unsigned long)received);
+            req->count(&NetworkAgentSessionCounters::bytes_in, received);
+            if(req->timeouts)
+                req->t_read = req->timeouts->wheel(req->context).now();
+            
+            //follow the read volume so that the next lease comes from the right size class
+            req->r_hint = (req->r_hint * 3 + received) / 4;
+            if(req->r_hint < NetworkAgentClientSession::MIN_READ_HINT)
+                req->r_hint = NetworkAgentClientSession::MIN_READ_HINT;
+            else if(req->r_hint > NetworkAgentClientSession::MAX_READ_HINT)
+                req->r_hint = NetworkAgentClientSession::MAX_READ_HINT;
+            
+            //a single read may complete any number of packages,
+            //whatever follows the last complete one waits for the next read
+            NetworkAgentPackageHead head;
+            NetworkAgentFrameDecoder::Status status;
+            while((status = req->r_decoder.next(req->r_buffer, head)) == NetworkAgentFrameDecoder::FRAME)
+            {
+                //a heartbeat only proves the peer alive, the bytes received did that already
+                if(head.protocol == NetworkAgentWireHeader::HEARTBEAT)
+                {
+                    if(req->r_decoder.framed() == 1)
+                        req->r_decoder.pop(req->r_buffer, head, NULL);
+                    continue;
+                }
+                
+                //segments are taken out as soon as nothing older waits in front of them
+                if(head.protocol == NetworkAgentWireHeader::SEGMENT)
+                {
+                    client_worker_queue_segments(req);
+                    if(req->closed)
+                        return;
+                    continue;
+                }
+                
+                req->count(&NetworkAgentSessionCounters::frames_in, 1);
+                if(req->capture->active())
+                    req->capture->record(req->c_session, head, req->r_buffer, req->r_decoder.framed_bytes() - head.payload_size);
+                
+                //packages for another node go on right away, unless older ones wait to be read here
+                if(req->relay->routing() && req->r_decoder.framed() == 1 && 
+                   req->relay->forwards(req->context, head.target_agent_id, req, req->r_hop))
+                {
+                    NetworkAgentPayload* payload;
+                    req->r_decoder.pop(req->r_buffer, head, &payload, req->r_buffer.pool());
+                    client_worker_queue_forward(req, head, payload);
+                    continue;
+                }
+                
+                relink(req, head.target_agent_id);
+                
+                //a complate package is received
+                //and delegates exist, notify it !!
+                //hand the payload over right away when nothing older is still waiting to be read
+                if(req->delegate && req->delegate->accepts_payloads() && req->r_decoder.framed() == 1)
+                {
+                    NetworkAgentPayload* payload;
+                    req->r_decoder.pop(req->r_buffer, head, &payload, req->r_buffer.pool());
+                    req->delegate->payload_received(req, head, payload);
+                }
+                else if(req->delegate)
+                    req->delegate->session_data_received(req);
+                //nobody to hand it to, drop it unless older packages are still waiting
+                else if(req->r_decoder.framed() == 1)
+                    req->r_decoder.pop(req->r_buffer, head, NULL);
+                
+                if(req->closed)
+                    return;
+            }
+            
+            //the peer offered compact headers, answer with them if we did too
+            if(req->compact_offered && !req->w_compact && req->r_decoder.compact())
+            {
+                LIBGCDNET_TRACE("session %d: compact headers", req->sock);
+                req->w_compact = true;
+            }
+            
+            if(status == NetworkAgentFrameDecoder::CORRUPT)
+            {
+                req->count(&NetworkAgentSessionCounters::errors, 1);
+                close_client_session(req);
+                throw NetworkAgentException("corrupted package stream");
+            }
+            
+            //the package just started is large, read the rest of its payload straight into
+            //the payload handed to the delegate instead of through the stream.
+            //relayed, it is spliced on from the socket where that is available
+            if(req->r_decoder.framed() == 0 && req->r_decoder.pending(head) && 
+               head.protocol == NetworkAgentWireHeader::PROTOCOL &&
+               head.payload_size >= NetworkAgentClientSession::DIRECT_READ_MIN)
+            {
+                bool relayed = req->relay->routing() && req->relay->forwards(req->context, head.target_agent_id, req, req->r_hop);
+                if(relayed && client_worker_queue_splice_start(req, head))
+                {
+                    req->r_buffer.shrink();
+                    return;
+                }
+                relink(req, head.target_agent_id);
+                if(relayed || (req->delegate && req->delegate->accepts_payloads()))
+                {
+                    req->r_direct = NetworkAgentPayload::create(head.payload_size, req->r_buffer.pool());
+                    req->r_direct_head = head;
+                    req->r_direct_filled = req->r_decoder.take_pending(req->r_buffer, req->r_direct->mutable_data());
+                }
+            }
+            
+            //stop reading while the delegate lags too far behind
+            req->update_read_pause();
+            if(req->r_paused)
+                LIBGCDNET_TRACE("session %d: reading paused, %lu packages waiting", req->sock, (unsigned long)req->r_decoder.framed());
+            
+            //everything handed out, the storage goes back to the pool until the next read
+            req->r_buffer.shrink();
+        }
+        
+        //received bytes were placed into the payload of req->r_direct, hand it over once complete
+        void NetworkAgent::client_worker_queue_direct(struct NetworkAgentClientSession* req, size_t received)
+        {
+            req->count(&NetworkAgentSessionCounters::bytes_in, received);
+            if(req->timeouts)
+                req->t_read = req->timeouts->wheel(req->context).now();
+            req->r_direct_filled += received;
+            if(req->r_direct_filled < req->r_direct->size())
+                return;
+            
+            NetworkAgentPayload* payload = req->r_direct;
+            req->r_direct = NULL;
+            req->r_direct_filled = 0;
+            req->count(&NetworkAgentSessionCounters::frames_in, 1);
+            capture_package(req, req->r_direct_head, payload->data());
+            if(req->relay->routing() && client_worker_queue_forward(req, req->r_direct_head, payload))
+                return;
+            
+            //the delegate may have been swapped for one that cannot take it, the package is dropped then
+            if(req->delegate && req->delegate->accepts_payloads())
+                req->delegate->payload_received(req, req->r_direct_head, payload);
+            else
+                payload->release();
+        }
+        
+        //reassemble the stream segments at the front of req->r_buffer, 
+        //complete packages go to the delegate like any other
+        void NetworkAgent::client_worker_queue_segments(struct NetworkAgentClientSession* req)
+        LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            unsigned char protocol;
+            while(req->r_decoder.front(req->r_buffer, protocol) && protocol == NetworkAgentWireHeader::SEGMENT)
+            {
+                NetworkAgentPackageHead head;
+                NetworkAgentPayload* payload;
+                req->r_decoder.unframe(req->r_buffer, head);
+                NetworkAgentStreamAssembler::Status status = req->r_streams.take(req->r_buffer, head, &payload, req->r_buffer.pool());
+                if(status == NetworkAgentStreamAssembler::CORRUPT)
+                {
+                    req->count(&NetworkAgentSessionCounters::errors, 1);
+                    close_client_session(req);
+                    throw NetworkAgentException("corrupted stream segment");
+                }
+                if(status == NetworkAgentStreamAssembler::PARTIAL)
+                    continue;
+                
+                req->count(&NetworkAgentSessionCounters::frames_in, 1);
+                capture_package(req, head, payload->data());
+                if(req->relay->routing() && client_worker_queue_forward(req, head, payload))
+                    continue;
+                relink(req, head.target_agent_id);
+                if(req->delegate && req->delegate->accepts_payloads())
+                    req->delegate->payload_received(req, head, payload);
+                else if(req->delegate)
+                {
+                    req->r_ready.push_back(std::make_pair(head, payload));
+                    req->delegate->session_data_received(req);
+                }
+                else
+                    payload->release();
+                
+                if(req->closed)
+                    return;
+            }
+        }
+        
+        void NetworkAgentClientSession::read_data(std::string& data)
+        {
+            __block std::string tmp;
+            engine->sync(this, ^{
+                NetworkAgentPackageHead head;
+                if(!r_ready.empty())
+                {
+                    NetworkAgentPayload* payload = r_ready.front().second;
+                    tmp.assign(payload->data(), payload->size());
+                    payload->release();
+                    r_ready.pop_front();
+                }
+                else
+                    r_decoder.pop(r_buffer, head, &tmp);
+                
+                //segments held up behind the package just read are taken out after this read
+                unsigned char protocol;
+                if(r_decoder.front(r_buffer, protocol) && protocol == NetworkAgentWireHeader::SEGMENT)
+                {
+                    engine->async(this, ^{
+                        if(closed)
+                            return;
+                        try{
+                            NetworkAgent::client_worker_queue_segments(this);
+                        }catch(NetworkAgentException e)
+                        {
+                            LIBGCDNET_TRACE("session %d: %s", sock, e.what());
+                        }
+                    });
+                }
+                update_read_pause();
+            });
+            data.swap(tmp);
+        }
+        
+        //we allow dynamic linking between each package and the target agent here
+        //if either link not exist, or link changed, re-link again
+        void NetworkAgent::relink(struct NetworkAgentClientSession* req, unsigned int target_agent_id)
+        {
+            if(!req->dispatcher)
+                return;
+            
+            //the last lookup still holds as long as the routing generation did not move on
+            uint64_t epoch = req->dispatcher->epoch();
+            if(req->delegate && req->delegate == req->r_route)
+            {
+                if(req->r_route_target == target_agent_id && req->r_route_epoch == epoch)
+                    return;
+            }
+            //a delegate set by hand stays while it is the target
+            else if(req->delegate && req->delegate->agent_id() == target_agent_id)
+                return;
+            
+            //search for target agent, and link to the session delegate
+            req->delegate = req->dispatcher->search(target_agent_id);
+            req->r_route = req->delegate;
+            req->r_route_target = target_agent_id;
+            req->r_route_epoch = epoch;
+        }
+        
+        //send a package received on req on to the next hop if the relay has a route for its target,
+        //taking over the reference to the payload. it is written from where it is
+        //@return false if the package is for this node
+        bool NetworkAgent::client_worker_queue_forward(struct NetworkAgentClientSession* req, const NetworkAgentPackageHead& head, 
+                                                       NetworkAgentPayload* payload)
+        {
+            NetworkAgentRelay* relay = req->relay;
+            bool known = false;
+            NetworkAgentClientSession* next = relay->route(req->context, head.target_agent_id, known, req->r_hop);
+            if(!known || next == req)
+                return false;
+            
+            //the route's connection closed, nothing to send it on with
+            if(!next)
+            {
+                relay->dropped(req->context);
+                payload->release();
+                return true;
+            }
+            
+            learn_route(req, head.source_agent_id);
+            relay->relayed(req->context, head.payload_size);
+            
+            //stream packages come reassembled and go on as plain ones
+            NetworkAgentPackageHead header = head;
+            header.protocol = NetworkAgentWireHeader::PROTOCOL;
+            NetworkAgentWireHead wire;
+            NetworkAgentWireHeader::encode(header, wire.bytes);
+            next->enqueue(wire, payload);
+            return true;
+        }
+        
+        //replies to source_agent_id go back to the client it sent from, unless an agent of this
+        //node goes by that id. replies coming back on a route's connection teach nothing
+        void NetworkAgent::learn_route(struct NetworkAgentClientSession* req, unsigned int source_agent_id)
+        {
+            NetworkAgentRelay* relay = req->relay;
+            if(req->r_hop || relay->learned(req->context, source_agent_id) == req)
+                return;
+            if(req->dispatcher && req->dispatcher->search(source_agent_id))
+                return;
+            relay->learn(req->context, source_agent_id, req);
+        }
+        
+        //hand the rest of a large relayed package over to the kernel. the header and the part of the
+        //payload that came with it are queued on the next hop, the rest goes from req's socket through
+        //a pipe into the next hop's socket once everything queued in front of it is written.
+        //only replies coming back on a route's connection are spliced, a client closing in the middle
+        //of a payload would take the route's connection down with it
+        //@return false if it cannot be spliced, the payload is read into memory then
+        bool NetworkAgent::client_worker_queue_splice_start(struct NetworkAgentClientSession* req, const NetworkAgentPackageHead& head)
+        {
+            NetworkAgentRelay* relay = req->relay;
+            if(!req->r_hop || !relay->splices())
+                return false;
+            bool known = false;
+            NetworkAgentClientSession* next = relay->route(req->context, head.target_agent_id, known, true);
+            if(!next)
+                return false;
+            
+            NetworkAgentRelaySplice* job = new NetworkAgentRelaySplice;
+            if(!relay->take_pipe(req->context, job->pipe))
+            {
+                LIBGCDNET_TRACE("session %d: no pipe to splice with, errno %d", req->sock, errno);
+                delete job;
+                return false;
+            }
+            
+            NetworkAgentPayload* copied = NetworkAgentPayload::create(req->r_buffer.size(), req->r_buffer.pool());
+            size_t received = req->r_decoder.take_pending(req->r_buffer, copied->mutable_data());
+            
+            job->relay = relay;
+            relay->retain();
+            job->context = req->context;
+            job->upstream = req;
+            job->downstream = next;
+            job->unread = head.payload_size - received;
+            job->buffered = 0;
+            job->refs = 2;
+            req->r_splice = job;
+            
+            req->count(&NetworkAgentSessionCounters::frames_in, 1);
+            relay->relayed(req->context, head.payload_size);
+            
+            unsigned char wire[NetworkAgentCompactCodec::MAX_SIZE];
+            size_t wire_size = next->w_compact ? NetworkAgentCompactCodec::encode(head, wire)
+                                               : NetworkAgentFixedCodec::encode(head, wire);
+            next->w_queue.push_spliced(wire, wire_size, copied->data(), received, job->unread,
+                                       client_worker_queue_spliced, job);
+            next->queued(wire_size + head.payload_size);
+            copied->release();
+            
+            LIBGCDNET_TRACE("session %d: splicing %lu bytes on to session %d", req->sock, (unsigned long)job->unread, next->sock);
+            client_worker_queue_splice(job);
+            return true;
+        }
+        
+        //move a spliced payload along, out of the upstream socket into the pipe and out of the pipe
+        //into the downstream socket, as far as both let it. runs from the handlers of either session.
+        //the upstream stops reading while the pipe holds bytes the downstream cannot take yet, 
+        //the downstream waits for writable only while the pipe holds bytes for it
+        void NetworkAgent::client_worker_queue_splice(NetworkAgentRelaySplice* job)
+        {
+            job->refs++;
+            NetworkAgentClientSession* down = job->downstream;
+            bool moved = true;
+            while(moved)
+            {
+                moved = false;
+                NetworkAgentClientSession* up = job->upstream;
+                if(up)
+                {
+                    ssize_t n = job->pipe.fill(up->sock, job->unread);
+                    int err = n < 0 ? errno : 0;
+                    up->count(&NetworkAgentSessionCounters::reads, 1);
+                    if(n > 0)
+                    {
+                        job->unread -= n;
+                        job->buffered += n;
+                        moved = true;
+                        up->count(&NetworkAgentSessionCounters::bytes_in, n);
+                        if(up->timeouts)
+                            up->t_read = up->timeouts->wheel(up->context).now();
+                    }
+                    else if(n == 0 || (err != EAGAIN && err != EINTR))
+                    {
+                        if(n < 0)
+                            up->count(&NetworkAgentSessionCounters::errors, 1);
+                        LIBGCDNET_TRACE("session %d: closed while splicing, errno %d", up->sock, err);
+                        close_client_session(up);
+                        break;
+                    }
+                    else if(err == EAGAIN)
+                        up->count(&NetworkAgentSessionCounters::eagain, 1);
+                    
+                    //all of the payload is in the pipe, whatever follows is read as usual
+                    if(!job->unread)
+                    {
+                        up->r_splice = NULL;
+                        job->upstream = NULL;
+                        splice_release(job);
+                        if(up->r_splice_paused)
+                        {
+                            up->r_splice_paused = false;
+                            if(up->reading())
+                                up->engine->want_read(up, true);
+                        }
+                    }
+                }
+                
+                if(down && !down->closed && job->buffered && down->w_queue.splicing() == job)
+                {
+                    ssize_t n = job->pipe.drain(down->sock, job->buffered, job->unread > 0);
+                    int err = n < 0 ? errno : 0;
+                    down->count(&NetworkAgentSessionCounters::writes, 1);
+                    if(n > 0)
+                    {
+                        job->buffered -= n;
+                        moved = true;
+                        job->relay->spliced(job->context, n);
+                        client_worker_queue_sent(down, n); //the frame done, its release runs in here
+                    }
+                    else if(err == EAGAIN)
+                    {
+                        down->count(&NetworkAgentSessionCounters::eagain, 1);
+                        if(!down->w_active)
+                        {
+                            down->w_active = true;
+                            down->engine->want_write(down, true);
+                        }
+                    }
+                    else if(err != EINTR)
+                    {
+                        down->count(&NetworkAgentSessionCounters::errors, 1);
+                        LIBGCDNET_TRACE("session %d: splice failed, errno %d", down->sock, err);
+                        close_client_session(down);
+                        break;
+                    }
+                }
+            }
+            
+            NetworkAgentClientSession* up = job->upstream;
+            if(up && !up->closed && job->buffered && !up->r_splice_paused)
+            {
+                up->r_splice_paused = true;
+                up->engine->want_read(up, false);
+            }
+            else if(up && !up->closed && !job->buffered && up->r_splice_paused)
+            {
+                up->r_splice_paused = false;
+                if(up->reading())
+                    up->engine->want_read(up, true);
+            }
+            
+            if(down && !down->closed)
+            {
+                //the pipe ran dry, the upstream brings more
+                if(job->downstream == down && down->w_queue.splicing() == job && !job->buffered && down->w_active)
+                {
+                    down->w_active = false;
+                    down->engine->want_write(down, false);
+                }
+                //the frame is through, whatever was queued behind it goes out as usual
+                else if(job->downstream != down)
+                {
+                    if(!down->w_active && !down->w_queue.empty())
+                    {
+                        down->w_active = true;
+                        down->engine->want_write(down, true);
+                    }
+                    client_worker_queue_flushed(down);
+                }
+            }
+            splice_release(job);
+        }
+        
+        //the downstream is done with a spliced frame, written out or dropped with its queue.
+        //an upstream still reading it has nowhere to send the rest and goes down
+        void NetworkAgent::client_worker_queue_spliced(void* owner)
+        {
+            NetworkAgentRelaySplice* job = (NetworkAgentRelaySplice*)owner;
+            job->downstream = NULL;
+            if(job->upstream)
+                close_client_session(job->upstream);
+            splice_release(job);
+        }
+        
+        //the upstream, the downstream or a pump is done with the splice
+        void NetworkAgent::splice_release(NetworkAgentRelaySplice* job)
+        {
+            if(--job->refs > 0)
+                return;
+            job->relay->give_pipe(job->context, job->pipe, job->buffered == 0);
+            job->relay->release();
+            delete job;
+        }
+        
+        void NetworkAgentClientSession::set_policy(const NetworkAgentIOPolicy& p)
+        {
+            //a block captures the reference, not the policy, take a copy along
+            NetworkAgentIOPolicy np = p;
+            submit(^{
+                if(closed)
+                    return;
+                apply_policy(sock, np, policy);
+                policy = np;
+                
+                //no more batching, whatever waits leaves now
+                if(!policy.coalesce_us && w_hold.held())
+                {
+                    coalescer->drop(&w_hold);
+                    release_writes(this);
+                }
+            });
+        }
+        
+        void NetworkAgentClientSession::dispose(NetworkAgentClientSession* s)
+        {
+            s->unhold();
+        }
+        
+        void NetworkAgentClientSession::teardown()
+        {
+            if(r_direct)
+                r_direct->release();
+            for(size_t i=0; i<r_ready.size(); i++)
+                r_ready[i].second->release();
+            r_ready.clear();
+            if(metrics)
+            {
+                //whatever was still queued leaves the agent's queue depth with us
+                backlog(-(int64_t)(w_queue.bytes() + w_streams.bytes()), -(int64_t)w_queue.frames());
+                metrics->shard(context).sessions_closed.add_shared(1);
+                metrics->release();
+            }
+            if(timeouts)
+                timeouts->release();
+            if(coalescer)
+                coalescer->release();
+            if(capture)
+                capture->release();
+            if(relay)
+                relay->release();
+            if(engine)
+                engine->release();
+            if(recycler)
+                recycler->release();
+            recycler = NULL;
+        }
+        
+        void NetworkAgentClientSession::give_back(NetworkAgentClientSession* s)
+        {
+            if(s->recycler)
+                s->recycler->recycle(s);
+            else
+                delete s;
+        }
+        
+        void NetworkAgentClientSession::release()
+        {
+            if(refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+            //closed and disposed of already, the shard's counters are only written on its context
+            NetworkAgentClientSession* s = this;
+            engine->post(context, ^{
+                give_back(s);
+            });
+        }
+        
+        void NetworkAgentClientSession::close()
+        {
+            submit(^{
+                NetworkAgent::close_client_session(this);
+            });
+        }
+        
+        void NetworkAgentClientSession::watch_close(NetworkAgentTask task)
+        {
+            c_watchers.push_back(Block_copy(task));
+        }
+        
+        //tear down a session from within its I/O context
+        void NetworkAgent::close_client_session(NetworkAgentClientSession* req)
+        {
+            if(req->closed)
+                return;
+            
+            //shall inform delegates that the peer has initiated a close 
+            //and that the session object will deconstruct itself afterwards
+            if(req->delegate)
+                req->delegate->session_closed(req);
+            for(size_t i=0; i<req->c_watchers.size(); i++)
+            {
+                req->c_watchers[i]();
+                Block_release(req->c_watchers[i]);
+            }
+            req->c_watchers.clear();
+            
+            if(req->timeouts)
+                req->timeouts->wheel(req->context).cancel(&req->t_timer);
+            req->coalescer->drop(&req->w_hold);
+            
+            //the downstream's copy of a payload being spliced from here would be cut short, 
+            //the peer could not tell where the next package starts. it goes down too
+            if(req->r_splice)
+            {
+                NetworkAgentRelaySplice* job = req->r_splice;
+                req->r_splice = NULL;
+                job->upstream = NULL;
+                if(job->downstream)
+                    close_client_session(job->downstream);
+                splice_release(job);
+            }
+            if(req->relay->routing())
+                req->relay->forget(req->context, req);
+            
+            //the engine makes sure no more handler runs beyond this point, 
+            //closes the socket and deletes the session once everything 
+            //submitted to its context before has had a valid session object to use
+            req->closed = true;
+            req->engine->detach(req);
+        }
+        
+        //invoked within the listener's context 
+        //triggered by the engine on the listener socket's event 
+        //that one or more clients have completed TCP handshake and are ready for connection
+        //@param shard - shard of a per-core acceptor, NULL to hash sessions over all shards
+        void NetworkAgent::accept(int listen_sock, NetworkAgentShard* shard) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            if(_mode!=SERVER)
+                return;
+            
+            //drain the whole backlog in one go, the listening socket is non-blocking
+            //so we stop as soon as the kernel has nothing more queued
+            for(;;)
+            {
+                //accept the client connectio and assigns a socket for I/O
+                struct sockaddr_storage client_addr;
+                socklen_t client_addr_size = sizeof(client_addr);
+#ifdef __linux__
+                int client_sock = ::accept4(listen_sock, (struct sockaddr *)&client_addr, &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+                int client_sock = ::accept(listen_sock, (struct sockaddr *)&client_addr, &client_addr_size);
+#endif
+                if(client_sock < 0)
+                {
+                    if(errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    if(errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+                    //the backlog stays, a level triggered listener would fire again right away
+                    if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                    {
+                        LIBGCDNET_TRACE("listener %d: accept failed, errno %d, backing off", listen_sock, errno);
+                        _engine->pause_listener(listen_sock, ACCEPT_BACKOFF_NS);
+                        break;
+                    }
+                    throw NetworkAgentException("failed to accept client socket connection");
+                }
+                
+                //create agent session
+                NetworkAgentClientSession* new_session = create_client_session(client_sock, shard);
+                
+                LIBGCDNET_TRACE("session %d: accepted on shard %u", client_sock, new_session->context);
+                
+                //there's nothing we can do at this stage
+                //since no communication is sent from remote peer yet 
+                //therefore there's no way of identify it's identify and intention
+                /*
+                //TODO: should I inform delegates that a client TCP connection is established
+                //and that bindirectional I/O is available
+                if(new_session->delegate)
+                    new_session->delegate->connected(new_session);
+                */
+                
+                //test sending a hell string to client 
+                new_session->write_data(12, 912, " Hello From Denny !!");
+            }
+        }
+        
+        
+        NetworkAgentClientSession* NetworkAgent::connect(const char *hostname, const char* servname) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            if(_mode!=CLIENT)
+                return NULL;
+            
+            //retrieving a valid listening interface
+            int rc = 0;
+            struct addrinfo* aires0 = resolve(hostname, servname, AI_PASSIVE, true, rc);
+            if(rc)
+                throw NetworkAgentException("error in getaddrinfo");
+            if(!aires0)
+                throw NetworkAgentException("no addr info available");
+            
+            //loop through all available network interface and listen to them all
+            NetworkAgentClientSession* first = NULL;
+            for(struct addrinfo* aires = aires0; aires; aires = aires->ai_next)
+            {
+                //create the raw socket
+                int s = socket(aires->ai_family, aires->ai_socktype, aires->ai_protocol);
+                if(s < 0)
+                    throw NetworkAgentException("failed to create socket");
+                
+                //misc socket options
+                int yes = 1;
+                if(aires->ai_family != AF_UNIX)
+                {
+                    rc += setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+                    rc += setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+                }
+#ifdef SO_NOSIGPIPE
+                rc += setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+                if(rc)
+                    throw NetworkAgentException("error in setsockopt");
+                
+                //try connection
+                int ret = ::connect(s, aires->ai_addr, aires->ai_addrlen);
+                if(ret < 0){
+                    close(s);
+                    throw NetworkAgentException("socket connect failed.");
+                }
+            
+                //create agent session
+                NetworkAgentClientSession* new_session = create_client_session(s);
+                if(!first)
+                    first = new_session;
+                
+                LIBGCDNET_TRACE("session %d: connected to %s:%s", s, hostname, servname);
+                
+                
+                //TODO: should I inform delegates that a client TCP connection is established
+                //and that bindirectional I/O is available
+                if(new_session->delegate)
+                    new_session->delegate->connected(new_session);
+                
+            }
+            
+            //free up addr info
+            free_addresses(aires0);
+            return first;
+        }
+        
+        
+        std::string NetworkAgent::local_socket(const char* servname) const
+        {
+            if(_options.local_dir.empty() || !servname)
+                return std::string();
+            return _options.local_dir + "/gcd-netlib." + servname + ".sock";
+        }
+        
+        //a unix domain socket for "unix:" names, and for same host peers that listen on one,
+        //getaddrinfo() for everything else
+        struct addrinfo* NetworkAgent::resolve(const char* hostname, const char* servname, int flags, bool connecting, int& error) const
+        {
+            const char* path = local_path(hostname);
+            if(path)
+            {
+                struct addrinfo* ai = local_address(path);
+                error = ai ? 0 : EAI_FAIL;
+                return ai;
+            }
+            
+            if(connecting)
+            {
+                std::string local = loopback(hostname) ? local_socket(servname) : std::string();
+                struct stat st;
+                if(!local.empty() && stat(local.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+                {
+                    struct addrinfo* ai = local_address(local);
+                    if(ai)
+                    {
+                        error = 0;
+                        return ai;
+                    }
+                }
+            }
+            
+            struct addrinfo hints, *aires0 = NULL;
+            bzero(&hints, sizeof(hints));
+            hints.ai_flags = flags;
+            hints.ai_family = PF_INET; // IPv4
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_protocol = IPPROTO_TCP;
+            
+            error = getaddrinfo(hostname, servname, &hints, &aires0);
+            return error ? NULL : aires0;
+        }
+        
+        //spread sessions over the shards by socket descriptor
+        NetworkAgentShard& NetworkAgent::shard_for(int client_sock)
+        {
+            unsigned int h = (unsigned int)client_sock * 2654435761u; //knuth multiplicative hash
+            return _shards[(h >> 16) % _shards.size()];
+        }
+        
+        /**
+         1. Hash the session onto one of the agent's I/O shards
+         2. Attach the socket to the engine, reads active right away
+         3. Writable notifications stay off until a write request comes from agents
+         **/
+        NetworkAgentClientSession* NetworkAgent::create_client_session(int client_sock, NetworkAgentShard* target, bool downstream) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            NetworkAgentShard& shard = target ? *target : shard_for(client_sock);
+            
+            NetworkAgentClientSession *new_req = shard.sessions->acquire();
+            new_req->serial = session_serials.fetch_add(1, std::memory_order_relaxed) + 1;
+            new_req->dispatcher = downstream ? NULL : _dispatcher;
+            new_req->r_hop = downstream;
+            new_req->r_buffer.set_pool(shard.pool);
+            new_req->w_queue.set_pool(shard.pool);
+            new_req->sock = client_sock;
+            new_req->context = shard.index;
+            new_req->limits = _options.watermarks;
+            new_req->w_streams.set_segment_size(_options.segment_size);
+            new_req->policy = _options.io;
+            new_req->compact_offered = _options.compact_headers;
+            new_req->coalescer = _coalescer;
+            _coalescer->retain();
+            new_req->capture = _capture;
+            _capture->retain();
+            new_req->relay = _relay;
+            _relay->retain();
+            new_req->engine = _engine;
+            _engine->retain();
+            new_req->metrics = _metrics;
+            _metrics->retain();
+            _metrics->shard(shard.index).sessions_opened.add_shared(1);
+            if(_timeouts)
+            {
+                new_req->timeouts = _timeouts;
+                _timeouts->retain();
+                new_req->t_timer.fire = client_worker_queue_timer;
+                new_req->t_timer.owner = new_req;
+            }
+            
+            try{
+                
+                //setup non-blocking socket I/O
+                fcntl(client_sock, F_SETFL, O_NONBLOCK);//avoid blocking read/write operation
+                
+#ifdef SO_NOSIGPIPE
+                int yes = 1;
+                setsockopt(client_sock, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+                apply_policy(client_sock, new_req->policy, NetworkAgentIOPolicy());
+                
+                _engine->attach(new_req);
+            }
+            catch(NetworkAgentException e)
+            {
+                close(client_sock);
+                NetworkAgentClientSession::dispose(new_req);
+                throw e;
+            }
+            
+            //offer compact headers with a heartbeat, sent in the fixed layout until the peer offered them too
+            if(new_req->compact_offered)
+            {
+                new_req->submit(^{
+                    if(!new_req->closed)
+                        new_req->enqueue_heartbeat();
+                });
+            }
+            
+            //the wheel belongs to the session's context, the clocks start there
+            if(new_req->timeouts)
+            {
+                new_req->submit(^{
+                    if(new_req->closed)
+                        return;
+                    new_req->t_read = new_req->t_write = new_req->t_sent = 
+                        new_req->timeouts->wheel(new_req->context).now();
+                    new_req->arm_timeouts();
+                });
+            }
+
+            return new_req;
+        }
+
+        void NetworkAgent::broadcast(const std::vector<NetworkAgentBroadcastTarget>& targets, 
+                                     unsigned int source_agent_id, NetworkAgentPayload* payload)
+        {
+            NetworkAgentPackageHead header;
+            header.protocol = NetworkAgentWireHeader::PROTOCOL;
+            header.payload_size = payload->size();
+            header.source_agent_id = source_agent_id;
+            header.target_agent_id = 0;
+            NetworkAgentWireHead head;
+            NetworkAgentWireHeader::encode(header, head.bytes);
+            
+            //every session holds its own reference until its copy of the frame is written
+            for(size_t i=0; i<targets.size(); i++)
+            {
+                NetworkAgentWireHeader::patch_target(head.bytes, targets[i].target_agent_id);
+                payload->retain();
+                targets[i].session->write_encoded(head, payload);
+            }
+            payload->release();
+        }
+        
+        void NetworkAgent::broadcast(const std::vector<NetworkAgentClientSession*>& sessions, 
+                                     unsigned int source_agent_id, unsigned int target_agent_id, 
+                                     const char* data, size_t len)
+        {
+            NetworkAgentPayload* payload = NetworkAgentPayload::create(len);
+            memcpy(payload->mutable_data(), data, len);
+            
+            std::vector<NetworkAgentBroadcastTarget> targets(sessions.size());
+            for(size_t i=0; i<sessions.size(); i++)
+            {
+                targets[i].session = sessions[i];
+                targets[i].target_agent_id = target_agent_id;
+            }
+            broadcast(targets, source_agent_id, payload);
+        }
+        
+        struct NetworkAgent::PendingConnect
+        {
+            NetworkAgentShard* shard; //context the attempts and the new session run on
+            NetworkAgentClientDelegate* delegate;
+            NetworkAgentConnectHandler done; //copied block
+            std::vector<int> socks; //per attempt, -1 once failed or handed over
+            std::vector<void*> watches; //per attempt, NULL when not waiting
+            unsigned int racing; //attempts still waiting for completion
+            bool resolving; //name resolution still running
+            bool finished; //done has run
+            bool timer_armed;
+            int error; //last failure seen
+        };
+        
+        void NetworkAgent::connect_async(const char *hostname, const char* servname, 
+                                         NetworkAgentClientDelegate* delegate, 
+                                         NetworkAgentConnectHandler done, 
+                                         unsigned int timeout_ms) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            if(_mode!=CLIENT)
+                throw NetworkAgentException("connect on a non client agent");
+            
+            PendingConnect* op = new PendingConnect;
+            op->shard = &_shards[_next_connect.fetch_add(1, std::memory_order_relaxed) % _shards.size()];
+            op->delegate = delegate;
+            op->done = Block_copy(done);
+            op->racing = 0;
+            op->resolving = true;
+            op->finished = false;
+            op->timer_armed = false;
+            op->error = 0;
+            
+            //the whole attempt, timeout included, lives on the chosen context
+            if(timeout_ms)
+            {
+                op->timer_armed = true;
+                _engine->after(op->shard->index, (uint64_t)timeout_ms * 1000000, ^{
+                    connect_timeout(op);
+                });
+            }
+            
+            //blocks capture the pointers only, take copies along
+            std::string* host = hostname ? new std::string(hostname) : NULL;
+            std::string* serv = new std::string(servname ? servname : "");
+            
+            //getaddrinfo blocks, resolve on a global queue and continue on the context
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                int rc = 0;
+                struct addrinfo* aires0 = resolve(host ? host->c_str() : NULL, serv->c_str(), 0, true, rc);
+                delete host;
+                delete serv;
+                
+                _engine->post(op->shard->index, ^{
+                    connect_start(op, aires0);
+                });
+            });
+        }
+        
+        //open a non-blocking socket per resolved address and let them race
+        void NetworkAgent::connect_start(PendingConnect* op, struct addrinfo* aires0)
+        {
+            op->resolving = false;
+            
+            //nothing to try once timed out while resolving
+            int won = -1;
+            for(struct addrinfo* aires = aires0; aires && !op->finished; aires = aires->ai_next)
+            {
+                int s = socket(aires->ai_family, aires->ai_socktype, aires->ai_protocol);
+                if(s < 0)
+                {
+                    op->error = errno;
+                    continue;
+                }
+                fcntl(s, F_SETFL, O_NONBLOCK);
+                
+                size_t attempt = op->socks.size();
+                op->socks.push_back(s);
+                op->watches.push_back(NULL);
+                
+                //loopback may connect right away
+                if(::connect(s, aires->ai_addr, aires->ai_addrlen) == 0)
+                {
+                    won = attempt;
+                    break;
+                }
+                
+                if(errno != EINPROGRESS)
+                {
+                    op->error = errno;
+                    close(s);
+                    op->socks[attempt] = -1;
+                    continue;
+                }
+                
+                try{
+                    op->watches[attempt] = _engine->watch_writable(s, op->shard->index, ^{
+                        connect_ready(op, attempt);
+                    });
+                    op->racing++;
+                }catch(NetworkAgentException e)
+                {
+                    op->error = EIO;
+                    close(s);
+                    op->socks[attempt] = -1;
+                }
+            }
             
+            if(aires0)
+                free_addresses(aires0);
+            else if(!op->error)
+                op->error = EHOSTUNREACH;
             
-            //the first package to sent, compile protocol header into buf
-            int pos = 0;
-            if(req->w_data.complete())
+            if(won >= 0)
             {
-                memcpy(buf, (void*)&(req->w_data.header), sizeof(req->w_data.header));
-                pos = sizeof(req->w_data.header);
+                int s = op->socks[won];
+                op->socks[won] = -1;
+                
+                NetworkAgentClientSession* session = NULL;
+                try{
+                    session = create_client_session(s, op->shard);
+                }catch(NetworkAgentException e)
+                {
+                    op->error = EIO;
+                }
+                connect_finish(op, session, op->error);
             }
+            else if(!op->racing)
+                connect_finish(op, NULL, op->error);
             
-            memcpy(buf + pos, req->w_data.payload.c_str(), req->w_data.payload.size());
- 
-            //attemp to write all data until socket is flooded 
-            ssize_t totalWriteBytes = 0, writeBytes;
-            do{
-                writeBytes = ::write(client_sock, buf + totalWriteBytes, totalReadBytes - totalWriteBytes);
-                if(writeBytes < 0)
-                    break;
-                
-                totalWriteBytes += writeBytes;
-                
-            }while(totalWriteBytes < totalReadBytes);
+            connect_release(op);
+        }
+        
+        //an attempt's socket turned writable, its connect is through one way or the other
+        void NetworkAgent::connect_ready(PendingConnect* op, size_t attempt)
+        {
+            op->watches[attempt] = NULL;
+            op->racing--;
             
-            std::cout << "total bytes written: " << totalWriteBytes << std::endl;
+            int s = op->socks[attempt];
+            op->socks[attempt] = -1;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if(getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                err = errno;
             
-            //if not all bytes written, just get ride of the written part, and wait for next available write
-            if(writeBytes < 0){
-                std::cout << "warning writeBytes < 0" << std::endl;
-                req->w_data.payload = "";
-                req->w_data.payload.append(buf + totalWriteBytes, totalReadBytes - totalWriteBytes);
+            if(err)
+            {
+                op->error = err;
+                close(s);
+                if(!op->racing)
+                    connect_finish(op, NULL, err);
             }
-            //all written, clean up the write cache
-            //SUSPEND the write source so that its does not repeatedly firing write handler 
-            //until the context write buffer has some new data 
             else
             {
-                req->w_data.reset(); 
-                
-                if(!req->w_source_suspended)
+                NetworkAgentClientSession* session = NULL;
+                try{
+                    session = create_client_session(s, op->shard);
+                }catch(NetworkAgentException e)
                 {
-                    dispatch_suspend(req->w_source);
-                    req->w_source_suspended = true;
-                    
-                    if(req->delegate)
-                        req->delegate->data_sent();
+                    op->error = EIO;
                 }
+                connect_finish(op, session, op->error);
             }
-                
-            free(buf);
+            
+            connect_release(op);
         }
         
-        //client socket has available bytes to read
-        //invoked from within a client socket working queue 
-        //@param request - the associated request object 
-        void NetworkAgent::client_worker_queue_read(struct NetworkAgentClientSession* req)
-        throw(NetworkAgentException)
-        {
-            size_t estimated = dispatch_source_get_data(req->r_source);
-            int client_sock = dispatch_source_get_handle(req->r_source);
-            
-            //if previously recieved a pakcage that is not prcossed 
-            //by delegates, just clear it
-            if(req->r_data.complete())
-                req->r_data.reset();
-            
-            //dynamically allocate buffer 
-            char* buf = new char[estimated+1];
-            if(!buf)
-                throw NetworkAgentException("heap memory allocation failed");
-           
-            bzero(buf, estimated + 1);
-            //attemp to read estimated bytes from the client socket
-            ssize_t actual = ::read(client_sock, buf, estimated);
+        void NetworkAgent::connect_timeout(PendingConnect* op)
+        {
+            op->timer_armed = false;
+            if(!op->finished)
+                connect_finish(op, NULL, ETIMEDOUT);
+            connect_release(op);
+        }
+        
+        //report the outcome once and drop the attempts still racing
+        void NetworkAgent::connect_finish(PendingConnect* op, NetworkAgentClientSession* session, int error)
+        {
+            if(op->finished)
+                return;
+            op->finished = true;
             
-            //some bytes are read
-            if(actual > 0){
-                
-                //here we are receiving the very first package
-                //which contains the header and a first segment of the payload
-                //copy over the protocol header
-                int pos = 0;
-                if(req->r_data.empty()){
-                    memcpy((void*)&(req->r_data.header), buf, sizeof(req->r_data.header));
-                    pos = sizeof(req->r_data.header);
-                    
-                    //we allow dynamic linking between each package and the target agent here
-                    //if either link not exist, or link changed, re-link again
-                    if( !(req->delegate) || (req->delegate->agent_id() != req->r_data.header.target_agent_id))
-                    {
-                        //search for target agent, and link to the session delegate
-                        if(req->dispatcher)
-                        {
-                            req->delegate = req->dispatcher->search(req->r_data.header.target_agent_id);
-                        }
-                    }
-                    
-                }
-                
-                //append payloads
-                std::cout << "reading " << actual << " bytes " << std::endl;
-                req->r_data.payload.append(buf+pos, actual-pos);
-                std::cout << req->r_data.payload << std::endl;
-                
-                //if a complate package is received
-                //and delegates exist, notify it !!
-                if(req->delegate && req->r_data.complete())
+            for(size_t i=0; i<op->socks.size(); i++)
+            {
+                if(op->watches[i])
                 {
-                    req->r_data.print();
-                    req->delegate->data_received();
+                    _engine->unwatch(op->watches[i]);
+                    op->watches[i] = NULL;
+                    op->racing--;
                 }
-                
-            }
-            //reading end of the source
-            else
-                if(actual == 0)
+                if(op->socks[i] >= 0)
                 {
-                    //shall inform delegates that the peer has initiated a close 
-                    //and that the session object will deconstruct itself afterwards
-                    if(req->delegate)
-                        req->delegate->closed(); 
-                    
-                    
-                    //first we make sure no more new handler blocks are submitted beyond this point
-                    req->cancel_all_sources(); 
-                
-                    //then we submit the deallocation taks to the same queue
-                    //this ensures that any submitted read/write block in the queue still has a valid 
-                    //session object to use
-                    //and that there's absolutely no more read/write block after this delete block!!!
-                    dispatch_async(req->queue, ^{
-                        delete req;
-                    });
-                    
+                    close(op->socks[i]);
+                    op->socks[i] = -1;
                 }
+            }
             
-            delete[] buf;
-            
-            if(actual < 0)
-                throw NetworkAgentException("error reading socket");
-            
+            if(session)
+            {
+                //still on the session's context, no read handler ran yet
+                session->delegate = op->delegate;
+                LIBGCDNET_TRACE("session %d: connected", session->sock);
+                if(session->delegate)
+                    session->delegate->connected(session);
+                op->done(session, 0);
+            }
+            else
+            {
+                LIBGCDNET_TRACE("connect failed, errno %d", error);
+                op->done(NULL, error ? error : EIO);
+            }
         }
         
-        //invoked within the worker queue 
-        //triggered by the dispatch source (listener socket)'s event 
-        //that a client has completed TCP handshake and ready for connection
-        void NetworkAgent::accept(int listen_sock) throw(NetworkAgentException)
+        void NetworkAgent::connect_release(PendingConnect* op)
         {
-            if(_mode!=SERVER)
+            if(!op->finished || op->racing || op->timer_armed || op->resolving)
                 return;
-           
+            Block_release(op->done);
+            delete op;
+        }
+        
+        //open a non-blocking listening socket on the interface and hand it to the engine
+        //@param shard - run the acceptor on this shard, NULL for the engine's listener context
+        void NetworkAgent::start_listener(const struct addrinfo* aires, NetworkAgentShard* shard, const char* servname) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            int rc = 0;
+            
+            //create the listening socket
+            int s = socket(aires->ai_family, aires->ai_socktype, aires->ai_protocol);
+            if(s < 0)
+                throw NetworkAgentException("failed to create listening socket");
+            
+            //misc socket options
+            int yes = 1;
+            if(aires->ai_family != AF_UNIX)
+            {
+                rc += setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+                rc += setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+            }
+#ifdef SO_NOSIGPIPE
+            rc += setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+            if(rc){
+                close(s);
+                throw NetworkAgentException("error in setsockopt");
+            }
             
-            //prevent further accept(2)s across multiple sources
-            dispatch_queue_t cur_queue = dispatch_get_current_queue();
-            dispatch_retain(cur_queue);
-            dispatch_suspend(cur_queue);  
+            //the accept loop drains until EAGAIN, it must never block
+            fcntl(s, F_SETFL, O_NONBLOCK);
             
-            //accept the client connectio and assigns a socket for I/O
-            struct sockaddr_in client_addr;
-            socklen_t client_addr_size = sizeof(client_addr);
-            int client_sock = ::accept(listen_sock, (struct sockaddr *)&client_addr, &client_addr_size);
-            if(client_sock < 0)
-                throw NetworkAgentException("failed to accept client socket connection");
+            //a unix domain socket left behind by an earlier run would fail the bind. it is only
+            //removed when nobody accepts on it anymore, a live agent's socket or any other file stays
+            const char* path = aires->ai_family == AF_UNIX ? ((const struct sockaddr_un*)aires->ai_addr)->sun_path : NULL;
+            if(path && !unlink_stale(path, aires)){
+                close(s);
+                throw NetworkAgentException("address in use");
+            }
             
-            //create agent session
-            NetworkAgentClientSession* new_session = create_client_session(client_sock);
+            //binding listen socket to a valid interface 
+            rc = bind(s, aires->ai_addr, aires->ai_addrlen);
+            if(rc < 0){
+                close(s);
+                throw NetworkAgentException("error in bind()");
+            }
             
-            std::cout << "new session from peer " << std::endl;
+            //ours from here on, removed again with the agent
+            if(path)
+                _local_paths.push_back(path);
             
-            //there's nothing we can do at this stage
-            //since no communication is sent from remote peer yet 
-            //therefore there's no way of identify it's identify and intention
-            /*
-            //TODO: should I inform delegates that a client TCP connection is established
-            //and that bindirectional I/O is available
-            if(new_session->delegate)
-                new_session->delegate->connected(new_session);
-            */
+            //start listening for client agent connections 
+            rc = ::listen(s,DEFAULT_MAX_SOCK_LISTEN_QUEUE);
+            if(rc){
+                close(s);
+                throw NetworkAgentException("error in listen");
+            }
             
-            //test sending a hell string to client 
-            //TODO: somehow the first character gets chuncated arbitrarily 
-            new_session->write_data(12, 912, " Hello From Denny !!");
+            LIBGCDNET_TRACE("listening on port %s", servname);
             
-            //resume the worker queue
-            dispatch_resume(cur_queue);
-            dispatch_release(cur_queue);
+            //whenever an incoming connection appears, the engine triggers the accept function.
+            //a per-core acceptor runs on its shard and keeps its sessions there,
+            //otherwise all listeners aggregate their events into the engine's listener context.
+            //the engine owns the socket from here on, it closes it when it fails
+            _engine->add_listener(s, shard ? (int)shard->index : -1, ^{ 
+                try{
+                    this->accept(s, shard); //s will capture the socket descriptor value for each accept
+                }catch(NetworkAgentException e)
+                {
+                    LIBGCDNET_TRACE("listener %d: %s", s, e.what());
+                }
+            });
+            _listen_socks.push_back(s);
         }
         
-        
-        void NetworkAgent::connect(const char *hostname, const char* servname) throw(NetworkAgentException)
+        void NetworkAgent::listen(const char *hostname, const char* servname) LIBGCDNET_THROWS(NetworkAgentException)
         {
-            if(_mode!=CLIENT)
+            if(_mode!=SERVER)
                 return;
             
             //retrieving a valid listening interface
-            struct addrinfo hints, *aires0 = NULL;
-            
-            bzero(&hints, sizeof(hints));
-            hints.ai_flags = AI_PASSIVE;//use bind() to bind addr
-            hints.ai_family = PF_INET; // IPv4
-            hints.ai_socktype = SOCK_STREAM;
-            hints.ai_protocol = IPPROTO_TCP;
-            
-            int rc = getaddrinfo(hostname, servname, &hints, &aires0);
+            int rc = 0;
+            struct addrinfo* aires0 = resolve(hostname, servname, AI_PASSIVE, false, rc);
             if(rc)
                 throw NetworkAgentException("error in getaddrinfo");
             if(!aires0)
                 throw NetworkAgentException("no addr info available");
+            bool unix_socket = aires0->ai_family == AF_UNIX;
+            
+            //with per-core acceptors every shard gets its own SO_REUSEPORT listening socket
+            //per interface, the kernel spreads incoming connections across them.
+            //a unix domain socket path can only be bound once
+            unsigned int acceptors = _options.reuseport_acceptors && !unix_socket ? _shards.size() : 1;
+            
+            //listening on some interfaces only is a failure, the ones started are taken down again
+            size_t started = _listen_socks.size();
             
             //loop through all available network interface and listen to them all
-            for(struct addrinfo* aires = aires0; aires; aires = aires->ai_next)
-            {
-                //create the raw socket
-                int s = socket(aires->ai_family, aires->ai_socktype, aires->ai_protocol);
-                if(s < 0)
-                    throw NetworkAgentException("failed to create socket");
-                
-                //misc socket options
-                int yes = 1;
-                rc += setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-                rc += setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
-                rc += setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
-                if(rc)
-                    throw NetworkAgentException("error in setsockopt");
-                
-                //try connection
-                int ret = ::connect(s, aires->ai_addr, aires->ai_addrlen);
-                if(ret < 0){
-                    close(s);
-                    throw NetworkAgentException("socket connect failed.");
+            try{
+                for(struct addrinfo* aires = aires0; aires; aires = aires->ai_next)
+                {
+                    for(unsigned int i=0; i<acceptors; i++)
+                        start_listener(aires, acceptors > 1 ? &_shards[i] : NULL, servname);
                 }
-            
-                //create agent session
-                NetworkAgentClientSession* new_session = create_client_session(s);
-                
-                std::cout << "connected to remote peer " << hostname << ":" << servname << std::endl; 
-                
-                
-                //TODO: should I inform delegates that a client TCP connection is established
-                //and that bindirectional I/O is available
-                if(new_session->delegate)
-                    new_session->delegate->connected(new_session);
-                
+            }catch(NetworkAgentException&)
+            {
+                free_addresses(aires0);
+                stop_listeners(started);
+                throw;
             }
             
             //free up addr info
-            freeaddrinfo(aires0);
+            free_addresses(aires0);
+            
+            //same host peers connecting to the port find the agent on its local socket too
+            std::string local = local_socket(servname);
+            if(!unix_socket && !local.empty())
+            {
+                struct addrinfo* ai = local_address(local);
+                if(!ai)
+                {
+                    stop_listeners(started);
+                    throw NetworkAgentException("local socket path too long");
+                }
+                try{
+                    start_listener(ai, NULL, servname);
+                }catch(NetworkAgentException&)
+                {
+                    free_addresses(ai);
+                    stop_listeners(started);
+                    throw;
+                }
+                free_addresses(ai);
+            }
+        }
+        
+        //@return false if something else is at the path: a socket still accepting, or not a socket
+        bool NetworkAgent::unlink_stale(const char* path, const struct addrinfo* aires)
+        {
+            struct stat st;
+            if(lstat(path, &st) < 0)
+                return errno == ENOENT;
+            if(!S_ISSOCK(st.st_mode))
+                return false;
+            
+            //non-blocking, a live agent with a full backlog answers EAGAIN
+            int probe = socket(AF_UNIX, aires->ai_socktype, 0);
+            if(probe < 0)
+                return false;
+            fcntl(probe, F_SETFL, O_NONBLOCK);
+            bool stale = ::connect(probe, aires->ai_addr, aires->ai_addrlen) < 0 && errno == ECONNREFUSED;
+            close(probe);
+            
+            return stale && (unlink(path) == 0 || errno == ENOENT);
         }
         
+        void NetworkAgent::stop_listeners(size_t first)
+        {
+            for(size_t i=first; i<_listen_socks.size(); i++)
+                _engine->remove_listener(_listen_socks[i]);
+            _listen_socks.resize(first);
+        }
         
-        /**
-         1. Create a dedicated client session worker queue 
-         2. Create a read dispatch source over the socket, active it
-         3. Create a write dispatch source over the socket, in suspended state
-         **/
-        NetworkAgentClientSession* NetworkAgent::create_client_session(int client_sock) throw(NetworkAgentException)
+        
+        NetworkAgent::NetworkAgent(Mode mode, NetworkAgentDispatcherDelegate *d, const NetworkAgentOptions& options) 
+        : _mode(mode), _dispatcher(d), _options(options), _engine(NULL), _metrics(NULL), _timeouts(NULL), _coalescer(NULL), _capture(NULL), _relay(NULL), _next_connect(0)
         {
-            NetworkAgentClientSession *new_req = new NetworkAgentClientSession;
-            new_req->dispatcher = _dispatcher;
-            static int requestID = 0; //a unique request identifier
+#ifndef __linux__
+            if(_options.engine == NetworkAgentEngine::EPOLL)
+                throw NetworkAgentException("epoll engine is only available on linux");
+#endif
+#if !defined(__linux__) || !defined(LIBGCDNET_HAVE_IO_URING)
+            if(_options.engine == NetworkAgentEngine::URING)
+                throw NetworkAgentException("io_uring engine is not compiled in, build with LIBGCDNET_HAVE_IO_URING");
+#endif
             
-            try{
-                
-                                //setup non-blocking socket I/O
-                fcntl(client_sock, F_SETFL, O_NONBLOCK);//avoid blocking read/write operation
-                
-                //assign a dispatch queue to handle the async socket read/write I/O 
-                std::ostringstream oss; oss<< "ibgcdnet.engine.network.session." << "req" << requestID++ << "#" << client_sock;
-                dispatch_queue_t myqueue = dispatch_queue_create(oss.str().c_str(), NULL);
-                if(!myqueue)
-                    throw NetworkAgentException("failed to create dispach queue");
-                else 
-                    new_req->queue = myqueue;
-                
-                char* lable = new char[oss.str().length()];
-                memcpy(lable, oss.str().c_str(), oss.str().length());
-                dispatch_set_context(myqueue, lable);//let the queue know the request contetnt
-                dispatch_set_finalizer_f(myqueue, (dispatch_function_t)client_worker_queue_finalizer);
-                
-                
-                //create a dispatch source over the client socket for async I/O 
-                dispatch_source_t read_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, client_sock, 0, myqueue);
-                if(!read_source)
-                    throw NetworkAgentException("failed to create dispatch read source");
-                else
-                    new_req->r_source = read_source;
-                
-                dispatch_source_set_event_handler(read_source, ^{
-                    try{
-                        client_worker_queue_read(new_req);
-                    }catch(NetworkAgentException e)
-                    {
-                        std::cerr << e.what() << std::endl;
-                    }
-                });
-                dispatch_source_set_cancel_handler(read_source, ^{
-                    int ret = close(client_sock); 
-                    std::cout << "read source cancedl with code " << ret << std::endl;
-                });
-                
-                //alwasy active the read dispatch source
-                dispatch_resume(new_req->r_source);
-                
-                //create a write dispatch source on the client socket 
-                dispatch_source_t write_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, client_sock, 0, myqueue);
-                if(!write_source)
-                    throw NetworkAgentException("failed to create dispatch write source");
-                else 
-                    new_req->w_source = write_source;
-                
-                dispatch_source_set_event_handler(write_source, ^{
-                    try{
-                        client_worker_queue_write(new_req);
-                    }catch(NetworkAgentException e)
-                    {
-                        std::cerr << e.what() << std::endl;
-                    }
-                });
-                dispatch_source_set_cancel_handler(write_source, ^{
-                    int ret = close(client_sock);  //might close twice
-                    std::cout << "write source cancedl with code " << ret << std::endl;
-                });
-                
-                new_req->w_source_suspended = true; //by default, the write source is suspended until a write request comes from agents that resumes it 
-                
-                //dispatch source will retain the dispatch queue, we just release it from here
-                dispatch_release(new_req->queue);
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            if(cores < 1)
+                cores = 1;
+            unsigned int count = _options.shards ? _options.shards : (unsigned int)cores;
+            
+            //a bounded set of I/O contexts created once, instead of one per connection
+            for(unsigned int i=0; i<count; i++)
+            {
+                NetworkAgentShard shard;
+                shard.index = i;
+                shard.pool = new NetworkAgentBufferPool();
+                shard.sessions = new NetworkAgentSessionPool(_options.session_pool);
+                shard.cpu = _options.cpu_affinity ? (int)(i % cores) : -1;
+                _shards.push_back(shard);
             }
-            catch(NetworkAgentException e)
+            _metrics = new NetworkAgentMetrics(count);
+            _coalescer = new NetworkAgentCoalescer(count);
+            _capture = new NetworkAgentCapture();
+            //splicing needs the handlers to do the syscalls, completion engines relay from memory
+            _relay = new NetworkAgentRelay(count, _options.engine != NetworkAgentEngine::URING);
+            
+#ifdef __linux__
+            if(_options.engine == NetworkAgentEngine::EPOLL)
+                _engine = new NetworkAgentEpollEngine(_shards);
+            else
+#endif
+#if defined(__linux__) && defined(LIBGCDNET_HAVE_IO_URING)
+            if(_options.engine == NetworkAgentEngine::URING)
+                _engine = new NetworkAgentUringEngine(_shards);
+            else
+#endif
+                _engine = new NetworkAgentDispatchEngine(_shards);
+            
+            if(_options.timeouts.enabled())
             {
-                close(client_sock);
-                delete new_req;
-                throw e;
+                _timeouts = new NetworkAgentTimeouts(count, _options.timeouts);
+                for(unsigned int i=0; i<count; i++)
+                    tick(_engine, _timeouts, i);
             }
-
-            return new_req;
         }
-
-        void NetworkAgent::listen(const char *hostname, const char* servname) throw(NetworkAgentException)
+        
+        NetworkAgentBufferPool::Stats NetworkAgent::buffer_pool_stats() const
         {
-            if(_mode!=SERVER)
-                return;
-            
-            //retrieving a valid listening interface
-            struct addrinfo hints, *aires0 = NULL;
-            
-            bzero(&hints, sizeof(hints));
-            hints.ai_flags =  AI_PASSIVE;//use bind() to bind addr
-            hints.ai_family = PF_INET; // IPv4
-            hints.ai_socktype = SOCK_STREAM;
-            hints.ai_protocol = IPPROTO_TCP;
-            
-            int rc = getaddrinfo(hostname, servname, &hints, &aires0);
-            if(rc)
-                throw NetworkAgentException("error in getaddrinfo");
+            NetworkAgentBufferPool::Stats total;
+            memset(&total, 0, sizeof(total));
+            for(size_t i=0; i<_shards.size(); i++)
+            {
+                NetworkAgentBufferPool::Stats st = _shards[i].pool->stats();
+                total.hits += st.hits;
+                total.misses += st.misses;
+                total.oversize += st.oversize;
+                total.released += st.released;
+                total.trimmed += st.trimmed;
+                total.cached_bytes += st.cached_bytes;
+            }
+            return total;
+        }
+        
+        void NetworkAgent::start_capture(const char* path) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            int error = _capture->start(path);
+            if(error)
+                throw NetworkAgentException(std::string("cannot capture to ") + path + ": " + strerror(error));
+        }
+        
+        int NetworkAgent::dial(const char* hostname, const char* servname) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            int rc = 0;
+            struct addrinfo* aires0 = resolve(hostname, servname, 0, true, rc);
             if(!aires0)
-                throw NetworkAgentException("no addr info available");
+                throw NetworkAgentException(std::string("cannot resolve ") + (hostname ? hostname : "") + ":" + servname);
             
-            //loop through all available network interface and listen to them all
-            for(struct addrinfo* aires = aires0; aires; aires = aires->ai_next)
+            int s = -1;
+            for(struct addrinfo* aires = aires0; aires && s < 0; aires = aires->ai_next)
             {
-                
-                //create the listening socket
-                int s = socket(aires->ai_family, aires->ai_socktype, aires->ai_protocol);
+                s = socket(aires->ai_family, aires->ai_socktype, aires->ai_protocol);
                 if(s < 0)
-                    throw NetworkAgentException("failed to create listening socket");
-                
-                //misc socket options
+                    continue;
+#ifdef SO_NOSIGPIPE
                 int yes = 1;
-                rc += setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-                rc += setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
-                rc += setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
-                if(rc)
-                    throw NetworkAgentException("error in setsockopt");
-                
-                //binding listen socket to a valid interface 
-                rc = bind(s, aires->ai_addr, aires->ai_addr->sa_len);
-                if(rc < 0){
+                setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+                if(::connect(s, aires->ai_addr, aires->ai_addrlen) < 0)
+                {
                     close(s);
-                    throw NetworkAgentException("error in bind()");
+                    s = -1;
                 }
-                
-                //start listening for client agent connections 
-                rc = ::listen(s,DEFAULT_MAX_SOCK_LISTEN_QUEUE);
-                if(rc)
-                    throw NetworkAgentException("error in listen");
-                
-                std::cout << "listening on port " << servname << std::endl;
-                
-                //create dispatch source over the listening socket
-                //whenever an incoming connection appears, it triggers the accept function
-                //on this agent's worker queue (dispatch sources from multiple network interfaces )
-                // will aggreate events into this worker queue
-                dispatch_source_t listener_ds = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, s, 0, _workqueue);
-                
-                if(!listener_ds)
-                    throw NetworkAgentException("failed to create dispatch source");
-                
-                //hold record for the listenre 
-                //WARNING: this somehow breaks the whole listener source ???
-                //_listeners.push_back(listener_ds);
-                
-                //read event handler
-                dispatch_source_set_event_handler(listener_ds, ^{ 
-                    try{
-                        this->accept(s); //s will capture the socket descriptor value for each accept
-                    }catch(NetworkAgentException e)
-                    {
-                        std::cerr << e.what() << std::endl;
-                    }
-                    
-                });
-                
-                //cancel handler (close listern socket)
-                dispatch_source_set_cancel_handler(listener_ds, ^{
-                    close(s);
-                });
-                
-                //active the source and begin processing events
-                dispatch_resume(listener_ds); 
-
+            }
+            free_addresses(aires0);
+            if(s < 0)
+                throw NetworkAgentException(std::string("cannot connect to ") + (hostname ? hostname : "") + ":" + servname);
+            return s;
+        }
+        
+        void NetworkAgent::add_route(unsigned int target_agent_id, const char* hostname, const char* servname) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            //a connection per shard, a package never has to leave the context it came in on
+            std::vector<NetworkAgentClientSession*> sessions;
+            try{
+                for(size_t i=0; i<_shards.size(); i++)
+                    sessions.push_back(create_client_session(dial(hostname, servname), &_shards[i], true));
+            }catch(NetworkAgentException e)
+            {
+                for(size_t i=0; i<sessions.size(); i++)
+                    sessions[i]->close();
+                throw e;
             }
             
-            //free up addr info
-            freeaddrinfo(aires0);
+            LIBGCDNET_TRACE("relaying agent %u to %s:%s", target_agent_id, hostname, servname);
+            NetworkAgentRelay* relay = _relay;
+            relay->enable();
+            for(size_t i=0; i<sessions.size(); i++)
+            {
+                NetworkAgentClientSession* next = sessions[i];
+                next->submit(^{
+                    if(next->closed)
+                        return;
+                    NetworkAgentClientSession* old = relay->install(next->context, target_agent_id, next);
+                    if(old)
+                        close_client_session(old);
+                });
+            }
         }
         
+        void NetworkAgent::remove_route(unsigned int target_agent_id)
+        {
+            NetworkAgentRelay* relay = _relay;
+            for(size_t i=0; i<_shards.size(); i++)
+            {
+                unsigned int context = _shards[i].index;
+                relay->retain();
+                _engine->post(context, ^{
+                    NetworkAgentClientSession* next = relay->uninstall(context, target_agent_id);
+                    if(next)
+                        close_client_session(next);
+                    relay->release();
+                });
+            }
+        }
         
-        NetworkAgent::NetworkAgent(Mode mode, NetworkAgentDispatcherDelegate *d) 
-        : _mode(mode), _dispatcher(d)
+        NetworkAgentSessionPool::Stats NetworkAgent::session_pool_stats() const
         {
-            _workqueue = dispatch_queue_create("libgcdnet.engine.NetworkAgent", NULL);
+            NetworkAgentSessionPool::Stats total;
+            memset(&total, 0, sizeof(total));
+            for(size_t i=0; i<_shards.size(); i++)
+            {
+                NetworkAgentSessionPool::Stats st = _shards[i].sessions->stats();
+                total.created += st.created;
+                total.reused += st.reused;
+                total.recycled += st.recycled;
+                total.discarded += st.discarded;
+                total.idle += st.idle;
+            }
+            return total;
         }
         
         NetworkAgent::~NetworkAgent()
@@ -508,7 +1935,32 @@ namespace libgcdnet {
             });
             */
             
-            dispatch_release(_workqueue);
+            //the engine outlives the agent while sessions hold it, its listeners must not
+            //call accept() on us anymore. waits for an accept loop running right now
+            stop_listeners(0);
+            
+            //the ticks end with their next run, sessions still alive keep the wheels
+            if(_timeouts)
+            {
+                _timeouts->stop();
+                _timeouts->release();
+            }
+            
+            for(size_t i=0; i<_local_paths.size(); i++)
+                unlink(_local_paths[i].c_str());
+            
+            //sessions still alive keep their own reference to the engine and their pool
+            _engine->release();
+            _metrics->release();
+            _coalescer->release();
+            _capture->stop();
+            _capture->release();
+            _relay->release();
+            for(size_t i=0; i<_shards.size(); i++)
+            {
+                _shards[i].pool->release();
+                _shards[i].sessions->release();
+            }
         }
         
 }
\ No newline at end of file
@@ -8,72 +8,41 @@
 #include <exception>
 #include <string>
 #include <list>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 #include <dispatch/dispatch.h>
+#include <netdb.h> //addrinfo
+#include "NetworkAgentBuffer.h"
+#include "NetworkAgentFrame.h"
+#include "NetworkAgentMetrics.h"
+#include "NetworkAgentTimingWheel.h"
+#include "NetworkAgentStream.h"
+#include "NetworkAgentPolicy.h"
+#include "NetworkAgentCapture.h"
+#include "NetworkAgentRelay.h"
+
+//exception specifications, dynamic ones are gone from C++17 on (the coroutine API needs C++20)
+#if __cplusplus >= 201703L
+#define LIBGCDNET_THROWS(...) noexcept(false)
+#define LIBGCDNET_NOTHROW noexcept
+#else
+#define LIBGCDNET_THROWS(...) throw(__VA_ARGS__)
+#define LIBGCDNET_NOTHROW throw()
+#endif
 
 namespace libgcdnet{
 
-        struct NetworkAgentPackageHead
-        {
-            unsigned char protocol; //u8: 0xbb
-            unsigned int payload_size; //u32
-            unsigned int source_agent_id; //u32
-            unsigned int target_agent_id; //u32
-        };
-        
-        struct NetworkAgentPackage
-        {
-            struct NetworkAgentPackageHead header;
-            //TODO: replace this with a more efficient circular bytes cache!
-            std::string payload;
-            
-            int size() const
-            {
-                return sizeof(header) + payload.size();
-            }
-            
-            //check if it is a complete protocol content
-            bool complete() const
-            {
-                return header.payload_size == payload.size() && payload.size()> 0;
-            }
-            
-            bool empty() const
-            {
-                return payload.size()==0;
-            }
-            
-            void reset()
-            {
-                header.protocol = 0xbb;
-                header.payload_size = 0;
-                header.source_agent_id = header.target_agent_id = 0;
-                payload = "";
-            }
-            
-            NetworkAgentPackage()
-            {
-                reset();
-            }
-            
-            void print() const
-            {
-                std::cout << 
-                "[payload_size=" << header.payload_size <<
-                ", source_agent_id=" << header.source_agent_id <<
-                ", target_agent_id=" << header.target_agent_id << 
-                ", current_payload_size=" << payload.size() <<
-                "]" << std::endl;
-            }
-        };
-        
         class NetworkAgentException : public std::exception
         {    
         public:
-            NetworkAgentException(const std::string& msg = "") : message(msg){}
-            ~NetworkAgentException() throw(){}
-            const char* what() const throw()
+            NetworkAgentException(const std::string& msg = "") : message("Engine NetworkAgent Exception: " + msg){}
+            ~NetworkAgentException() LIBGCDNET_NOTHROW{}
+            const char* what() const LIBGCDNET_NOTHROW
             {
-                return ("Engine NetworkAgent Exception: " + message).c_str();
+                return message.c_str();
             }
         private:
             std::string message;
@@ -91,6 +60,38 @@ namespace libgcdnet{
             virtual void connected(NetworkAgentClientSession* request) = 0;
             virtual void data_received() = 0;
             virtual void data_sent() = 0;
+            
+            //same notification naming the session the package arrived on, 
+            //for delegates serving more than one session
+            virtual void session_data_received(NetworkAgentClientSession* session)
+            {
+                data_received();
+            }
+            
+            //same for closed(), the session is gone right after
+            virtual void session_closed(NetworkAgentClientSession* session)
+            {
+                closed();
+            }
+            
+            //zero copy delivery, delegates returning true get every package handed over in
+            //payload_received() instead of data_received() followed by read_data()
+            virtual bool accepts_payloads() const { return false; }
+            
+            //runs on the session's context, the delegate owns one reference to the payload
+            //and releases it once done, on whatever thread it likes
+            virtual void payload_received(NetworkAgentClientSession* session, 
+                                          const NetworkAgentPackageHead& head, 
+                                          NetworkAgentPayload* payload)
+            {
+                payload->release();
+            }
+            
+            //the session's outbound queue went past a write watermark, producers should hold
+            //back until write_resumed(). runs on the session's context
+            virtual void write_congested(NetworkAgentClientSession* session){}
+            //the queue drained below the low watermark, writable again
+            virtual void write_resumed(NetworkAgentClientSession* session){}
         };
         
         //interface for delegates that links 
@@ -104,151 +105,990 @@ namespace libgcdnet{
             //search if a givne target agent exist in the system
             //return handler to the agent if exist, otherwise NULL
             virtual NetworkAgentClientDelegate* search(unsigned int target_agent_id) const = 0;
+            
+            //routing generation, changes whenever an earlier search() result may no longer hold.
+            //sessions keep their last result per target until it changes, a constant 0
+            //keeps them until the target changes
+            virtual uint64_t epoch() const { return 0; }
         };
         
         
+        typedef void (^NetworkAgentTask)(void);
+        
+        //outcome of an asynchronous connect, the new session or NULL with an errno value
+        typedef void (^NetworkAgentConnectHandler)(NetworkAgentClientSession* session, int error);
+        
+        /**
+         I/O Engine Interface 
+         drives the sockets of an agent's sessions and serializes everything touching 
+         a session on the I/O context (shard) it is attached to. the GCD engine maps 
+         contexts onto serial dispatch queues with read/write dispatch sources, other 
+         engines run their own event loop threads. delegates never see the difference.
+         reference counted like the dispatch objects, every session retains its engine
+         **/
+        class NetworkAgentEngine
+        {
+        public:
+            enum Kind{
+                DISPATCH, //libdispatch sources on serial shard queues
+                EPOLL,    //native edge triggered epoll, one worker thread per shard (linux only)
+                URING     //io_uring completions, multishot receive into provided buffers (linux, LIBGCDNET_HAVE_IO_URING)
+            };
+            
+            NetworkAgentEngine() : _refcount(1){}
+            
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+            
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    destroy();
+            }
+            
+            virtual Kind kind() const = 0;
+            virtual unsigned int contexts() const = 0;
+            
+            //start delivering I/O events of the session's socket on its context, reads enabled
+            virtual void attach(NetworkAgentClientSession* s) LIBGCDNET_THROWS(NetworkAgentException) = 0;
+            //stop all events, close the socket and delete the session once
+            //nothing submitted before can still touch it. called on the session's context
+            virtual void detach(NetworkAgentClientSession* s) = 0;
+            //turn writable notifications on/off, called on the session's context
+            virtual void want_write(NetworkAgentClientSession* s, bool on) = 0;
+            //pause/resume reading the socket, called on the session's context. 
+            //bytes the engine already has in hand may still be delivered after a pause
+            virtual void want_read(NetworkAgentClientSession* s, bool on) = 0;
+            
+            //run a task on the session's context, serialized with its I/O handlers
+            virtual void async(NetworkAgentClientSession* s, NetworkAgentTask task) = 0;
+            //same but wait for it, runs inline when already on that context
+            virtual void sync(NetworkAgentClientSession* s, NetworkAgentTask task) = 0;
+            
+            //watch a non-blocking listening socket, on_ready runs on the given context
+            //(-1 for the engine's own listener context) whenever connections are pending
+            virtual void add_listener(int listen_sock, int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException) = 0;
+            //stop watching a listening socket and close it. on_ready never runs again once this
+            //returned, a run in progress on another context is waited for
+            virtual void remove_listener(int listen_sock) = 0;
+            //hold on_ready back for delay_ns, called from on_ready on the listener's context
+            virtual void pause_listener(int listen_sock, uint64_t delay_ns) = 0;
+            
+            //run a task on a context with no session involved, e.g. to set up new connections
+            virtual void post(unsigned int context, NetworkAgentTask task) = 0;
+            //same, once delay_ns have passed
+            virtual void after(unsigned int context, uint64_t delay_ns, NetworkAgentTask task) = 0;
+            
+            //one shot, called on the context. on_ready runs there once the socket turns writable,
+            //i.e. a non-blocking connect completed or failed. the socket stays with the caller
+            //@return handle for unwatch(), valid until on_ready runs
+            virtual void* watch_writable(int sock, unsigned int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException) = 0;
+            //drop a watch before its on_ready ran, called on its context
+            virtual void unwatch(void* watch) = 0;
+            
+        protected:
+            virtual ~NetworkAgentEngine(){}
+            
+            //last reference gone
+            virtual void destroy()
+            {
+                delete this;
+            }
+            
+            //entry points into the session handlers of NetworkAgent, exceptions are reported here
+            //readiness engines: the socket is readable/writable, the handler does the syscall
+            //@return true if the read filled the buffer, edge triggered engines read again
+            static bool handle_read(NetworkAgentClientSession* s, size_t estimated);
+            static void handle_write(NetworkAgentClientSession* s);
+            //completion engines: len bytes were received (0 on EOF or error),
+            //or a send of the gathered write queue finished with result bytes (-errno on error)
+            static void handle_input(NetworkAgentClientSession* s, const void* data, size_t len);
+            static void handle_sent(NetworkAgentClientSession* s, ssize_t result);
+            
+        private:
+            NetworkAgentEngine(const NetworkAgentEngine&);
+            NetworkAgentEngine& operator=(const NetworkAgentEngine&);
+            
+            std::atomic<int> _refcount;
+        };
+        
+        
+        //flow control limits of a session, see NetworkAgentOptions
+        struct NetworkAgentWatermarks
+        {
+            size_t session_high; //queued outbound bytes of one session that make it congested, 0 for no limit
+            size_t session_low; //writable again at or below this
+            size_t agent_high; //same over all sessions of the agent, 0 for no limit
+            size_t agent_low;
+            size_t read_pause_frames; //received packages not yet read that pause reading, 0 never pauses
+            
+            NetworkAgentWatermarks() : session_high(4 * 1024 * 1024), session_low(1024 * 1024), 
+                                       agent_high(0), agent_low(0), read_pause_frames(1024){}
+        };
+        
         class NetworkAgent;
+        class NetworkAgentSessionPool;
         //the client agent request 
         class NetworkAgentClientSession
         {
+            friend class NetworkAgentSessionPool;
             friend class NetworkAgent;
+            friend class NetworkAgentEngine;
+            friend class NetworkAgentDispatchEngine;
+            friend class NetworkAgentEpollEngine;
+            friend class NetworkAgentUringEngine;
+            friend class NetworkAgentConnectionPool;
+            friend class NetworkAgentRpcClient;
+            friend class NetworkAgentRpcServer;
+            friend class NetworkAgentCoSession;
         protected:
-            NetworkAgentPackage w_data; //write data cache
-            NetworkAgentPackage r_data; //read data cache
+            NetworkAgentOutboundQueue w_queue; //outbound frames yet to be written
+            NetworkAgentRingBuffer r_buffer; //inbound byte stream, framed packages wait here until read
+            NetworkAgentFrameDecoder r_decoder; //frames packages out of r_buffer
+            size_t r_hint; //recent read volume, sizes the next read
+            NetworkAgentPayload* r_direct; //large package whose payload is read straight into place
+            NetworkAgentPackageHead r_direct_head;
+            size_t r_direct_filled; //payload bytes of r_direct received so far
+            NetworkAgentStreamScheduler w_streams; //stream packages not yet cut into segments
+            NetworkAgentStreamAssembler r_streams; //stream packages partially received
+            std::deque<std::pair<NetworkAgentPackageHead, NetworkAgentPayload*> > r_ready; //complete stream packages waiting to be read
             
-            dispatch_queue_t queue; //client worker queue
-            dispatch_source_t r_source; //read dispatch source
+            NetworkAgentSessionCounters counters; //written on the session's context only
+            NetworkAgentMetrics* metrics; //agent wide totals, this session adds to its shard's slot
+            
+            int sock; //client socket
+            unsigned int context; //I/O context (shard) the session is hashed onto
+            NetworkAgentEngine* engine; //drives the socket and owns the context
+            bool w_active; //writable notifications requested
+            bool closed; //detached from the engine, deletion pending
             
+            //flow control
+            NetworkAgentWatermarks limits;
+            std::atomic<bool> w_congested; //past a write watermark, delegate told to hold back
+            bool r_paused; //reading paused until the delegate catches up
+            bool r_splice_paused; //reading paused while the pipe of a splice from here holds bytes
+            
+            //GCD engine state
+            dispatch_source_t r_source; //read dispatch source
             dispatch_source_t w_source; //write dispatch source
             bool w_source_suspended; //suspension flag for write source   
+            bool r_source_suspended; //read source paused by flow control
+            int sources_alive; //sources not yet through their cancel handler
+            
+            //readiness engine state
+            unsigned int io_events; //event mask currently registered
+            
+            //completion engine state
+            void* io_state; //owned by the engine between attach and deletion
             
             NetworkAgentClientDelegate* delegate; //delegate agent 
             NetworkAgentDispatcherDelegate *dispatcher; //dynamic lookup for target agent
+            NetworkAgentClientDelegate* r_route; //result of the last lookup,
+            unsigned int r_route_target; //for this target,
+            uint64_t r_route_epoch; //in this routing generation
+            
+            //header layout, compact once both ends offered it
+            bool compact_offered; //a heartbeat offering them went out first thing
+            bool w_compact; //packages go out with compact headers
+            
+            //socket policy
+            NetworkAgentIOPolicy policy;
+            NetworkAgentCoalescer* coalescer; //deadlines of the shard's sessions holding back writes
+            NetworkAgentHold w_hold; //held while new writes are being batched up
+            
+            NetworkAgentSessionPool* recycler; //free list the session goes back to once closed, NULL to delete it
+            std::atomic<int> refs; //the engine's until dispose(), outside references and tasks submitted from outside
+            uint64_t serial; //number of the connection, a recycled session gets a new one
+            std::vector<NetworkAgentTask> c_watchers; //run on the close whatever the delegate is by then
+            
+            //package capture of the agent
+            NetworkAgentCapture* capture;
+            uint64_t c_session; //number of the session in the traces, 0 until its first package
+            
+            //relaying of the agent
+            NetworkAgentRelay* relay;
+            NetworkAgentRelaySplice* r_splice; //payload being spliced out of the socket, not read from here
+            bool r_hop; //connection to the next hop of a route, packages on it may follow learned routes
+            
+            //timeouts, ticks of the shard's wheel
+            NetworkAgentTimeouts* timeouts; //NULL when the agent has none configured
+            NetworkAgentWheelTimer t_timer; //armed for the earliest deadline
+            uint64_t t_read; //last bytes received
+            uint64_t t_write; //last write progress, or when writing started
+            uint64_t t_sent; //last frame queued
+            
+            //neither paused by flow control nor by a splice
+            bool reading() const
+            {
+                return !r_paused && !r_splice_paused;
+            }
+            
+            //bump a counter of the session and of its shard
+            void count(NetworkAgentSessionCounters::Field field, uint64_t n)
+            {
+                (counters.*field).add(n);
+                (metrics->shard(context).counters.*field).add(n);
+            }
+            
+            void uncount(NetworkAgentSessionCounters::Field field, uint64_t n)
+            {
+                (counters.*field).sub(n);
+                (metrics->shard(context).counters.*field).sub(n);
+            }
+            
+            //time a handler run for the session and for its shard
+            void time(NetworkAgentSessionCounters::Timer timer, uint64_t ns)
+            {
+                (counters.*timer).record(ns);
+                (metrics->shard(context).counters.*timer).record(ns);
+            }
+            
+            //queue one package for writing, runs on the session's context
+            void enqueue(unsigned int source_agent_id, unsigned int target_agent_id, 
+                         const char* data, size_t len)
+            {
+                NetworkAgentPackageHead header;
+                header.protocol = NetworkAgentWireHeader::PROTOCOL;
+                header.payload_size = len;
+                header.source_agent_id = source_agent_id;
+                header.target_agent_id = target_agent_id;
+                
+                unsigned char head[NetworkAgentCompactCodec::MAX_SIZE];
+                size_t head_size = w_compact ? NetworkAgentCompactCodec::encode(header, head)
+                                             : NetworkAgentFixedCodec::encode(header, head);
+                w_queue.push(head, head_size, data, len);
+                queued(head_size + len);
+            }
+            
+            //same for an encoded header and a payload written in place, takes over the reference.
+            //the header comes in the fixed layout and is reencoded for a compact session
+            void enqueue(const NetworkAgentWireHead& head, NetworkAgentPayload* payload)
+            {
+                unsigned char compact[NetworkAgentCompactCodec::MAX_SIZE];
+                const unsigned char* bytes = head.bytes;
+                size_t head_size = sizeof(head.bytes);
+                if(w_compact)
+                {
+                    NetworkAgentPackageHead header;
+                    NetworkAgentWireHeader::decode(head.bytes, header);
+                    head_size = NetworkAgentCompactCodec::encode(header, compact);
+                    bytes = compact;
+                }
+                w_queue.push_external(bytes, head_size, payload->data(), payload->size(),
+                                      NetworkAgentPayload::release_fn, payload);
+                queued(head_size + payload->size());
+            }
+            
+            //keep the connection alive with a frame the peer's decoder skips.
+            //carries the offer of compact headers, a peer without them skips it all the same
+            void enqueue_heartbeat()
+            {
+                NetworkAgentPackageHead header;
+                memset(&header, 0, sizeof(header));
+                header.protocol = NetworkAgentWireHeader::HEARTBEAT;
+                if(compact_offered)
+                    header.source_agent_id = NetworkAgentWireHeader::OFFER_COMPACT;
+                
+                unsigned char head[NetworkAgentCompactCodec::MAX_SIZE];
+                size_t head_size = w_compact ? NetworkAgentCompactCodec::encode(header, head)
+                                             : NetworkAgentFixedCodec::encode(header, head);
+                w_queue.push(head, head_size, NULL, 0);
+                queued(head_size);
+            }
+            
+            //a frame of n bytes was queued
+            void queued(size_t n)
+            {
+                backlog(n, 1);
+                if(timeouts)
+                    timeouts_queued();
+                
+                if(!w_active && !closed)
+                {
+                    //batching: writing starts once enough is queued or the deadline passed
+                    if(policy.coalesce_us && (!policy.coalesce_bytes || w_queue.bytes() < policy.coalesce_bytes))
+                    {
+                        if(!w_hold.held())
+                            hold_writes();
+                    }
+                    else
+                    {
+                        coalescer->drop(&w_hold);
+                        w_active = true;
+                        engine->want_write(this, true);
+                    }
+                }
+                update_congestion();
+            }
+            
+            void hold_writes()
+            {
+                uint64_t due = NetworkAgentCoalescer::clock() + (uint64_t)policy.coalesce_us * 1000;
+                coalescer->hold(context, &w_hold, due);
+                if(coalescer->claim(context, due))
+                    schedule_flush(engine, coalescer, context, due);
+            }
+            
+            //the hold of a session is over, on its context
+            static void release_writes(void* owner)
+            {
+                NetworkAgentClientSession* s = (NetworkAgentClientSession*)owner;
+                if(s->closed || s->w_active || s->w_queue.empty())
+                    return;
+                s->w_active = true;
+                s->engine->want_write(s, true);
+            }
+            
+            //run the holds of a context due by then, and keep running while sessions hold
+            static void schedule_flush(NetworkAgentEngine* engine, NetworkAgentCoalescer* coalescer, 
+                                       unsigned int context, uint64_t due)
+            {
+                coalescer->retain();
+                uint64_t now = NetworkAgentCoalescer::clock();
+                engine->after(context, due > now ? due - now : 0, ^{
+                    coalescer->ran(context, due);
+                    uint64_t next = coalescer->expire(context, NetworkAgentCoalescer::clock());
+                    if(next != NetworkAgentCoalescer::NONE && coalescer->claim(context, next))
+                        schedule_flush(engine, coalescer, context, next);
+                    coalescer->release();
+                });
+            }
+            
+            //frames entering (n > 0) or leaving the outbound queue
+            void backlog(int64_t bytes, int64_t frames)
+            {
+                if(bytes >= 0)
+                {
+                    count(&NetworkAgentSessionCounters::queued_bytes, bytes);
+                    count(&NetworkAgentSessionCounters::queued_frames, frames);
+                    if(limits.agent_high)
+                        metrics->write_backlog.add_shared(bytes);
+                }
+                else
+                {
+                    uncount(&NetworkAgentSessionCounters::queued_bytes, -bytes);
+                    uncount(&NetworkAgentSessionCounters::queued_frames, -frames);
+                    if(limits.agent_high)
+                        metrics->write_backlog.sub_shared(-bytes);
+                }
+            }
+            
+            //compare the queue against the watermarks and tell the delegate about a change,
+            //runs on the session's context whenever the queue grew or shrank
+            void update_congestion()
+            {
+                uint64_t queued = w_queue.bytes() + w_streams.bytes();
+                uint64_t total = limits.agent_high ? metrics->write_backlog.get() : 0;
+                if(!w_congested.load(std::memory_order_relaxed))
+                {
+                    if((limits.session_high && queued > limits.session_high) || 
+                       (limits.agent_high && total > limits.agent_high))
+                    {
+                        w_congested.store(true, std::memory_order_relaxed);
+                        if(delegate)
+                            delegate->write_congested(this);
+                    }
+                }
+                //a session with nothing queued is not what holds the agent back
+                else if((!limits.session_high || queued <= limits.session_low) && 
+                        (!limits.agent_high || total <= limits.agent_low || queued == 0))
+                {
+                    w_congested.store(false, std::memory_order_relaxed);
+                    if(delegate)
+                        delegate->write_resumed(this);
+                }
+            }
+            
+            //cut stream packages into segments while about one segment is left to write,
+            //so that whatever stream is due next never waits behind more than that
+            void pump_streams()
+            {
+                while(!w_streams.empty() && w_queue.bytes() < w_streams.segment_size())
+                {
+                    NetworkAgentSegment seg;
+                    w_streams.next(seg);
+                    backlog(-(int64_t)seg.len, 0);
+                    w_queue.push_external(seg.head, sizeof(seg.head), seg.data, seg.len,
+                                          NetworkAgentPayload::release_fn, seg.payload);
+                    queued(sizeof(seg.head) + seg.len);
+                }
+            }
+            
+            //sending counts against the heartbeat, and the write stall clock starts
+            //with the first frame queued while nothing was being written
+            void timeouts_queued()
+            {
+                NetworkAgentTimingWheel& wheel = timeouts->wheel(context);
+                t_sent = wheel.now();
+                if(w_active || closed || !timeouts->options().write_stall)
+                    return;
+                t_write = t_sent;
+                uint64_t due = t_write + timeouts->ticks(timeouts->options().write_stall);
+                if(!t_timer.armed() || t_timer.expires > due)
+                    wheel.arm(&t_timer, due);
+            }
+            
+            //arm the timer for whichever deadline comes first
+            void arm_timeouts()
+            {
+                const NetworkAgentTimeoutOptions& o = timeouts->options();
+                uint64_t due = ~(uint64_t)0;
+                if(o.idle_read)
+                    due = std::min(due, t_read + timeouts->ticks(o.idle_read));
+                if(o.write_stall && w_active)
+                    due = std::min(due, t_write + timeouts->ticks(o.write_stall));
+                if(o.heartbeat)
+                    due = std::min(due, t_sent + timeouts->ticks(o.heartbeat));
+                if(due != ~(uint64_t)0)
+                    timeouts->wheel(context).arm(&t_timer, due);
+            }
+            
+            //reading stays paused until the delegate has read enough of what is waiting
+            void update_read_pause()
+            {
+                size_t waiting = r_decoder.framed() + r_ready.size();
+                if(!r_paused && limits.read_pause_frames && waiting >= limits.read_pause_frames)
+                {
+                    r_paused = true;
+                    engine->want_read(this, false);
+                }
+                else if(r_paused && waiting <= limits.read_pause_frames / 2)
+                {
+                    r_paused = false;
+                    if(!closed && reading())
+                        engine->want_read(this, true);
+                }
+            }
+            
+            //run a task on the session's context once it closes, on its context and not yet closed.
+            //for helpers keeping state per connection that must not depend on staying the delegate
+            void watch_close(NetworkAgentTask task);
             
         public:
+            static const size_t MIN_READ_HINT = 4096;
+            static const size_t MAX_READ_HINT = 1024 * 1024;
+            static const size_t DIRECT_READ_MIN = 64 * 1024; //payloads read straight into place from this size on
+            
             void setDispatcher(NetworkAgentDispatcherDelegate *d)
             {
-                dispatch_async(queue, ^{
+                submit(^{
                     dispatcher = d;
                 });
             }
             
             void setDelegate(NetworkAgentClientDelegate* d)
             {
-                dispatch_async(queue, ^{
+                submit(^{
                     delegate = d;
                 });
             }
 
-            //blocking read of the buffer 
+            //blocking read of the oldest received package 
             //@assume the delegate received noti that data trunk has received
-            void read_data(std::string& data)
-            {
-                __block std::string tmp;
-                dispatch_sync(queue, ^{
-                    tmp = r_data.payload;
-                    r_data.reset();
-                });
-                data = tmp;
-            }
+            //copying path, delegates accepting payloads get them handed over instead.
+            //packages of different streams may be read in another order than they completed
+            void read_data(std::string& data);
             
             //async write of data 
+            //frames are queued in order and flushed once the socket is writable, nothing
+            //queued earlier is dropped even if it is only partially written
             void write_data(unsigned int source_agent_id, 
                             unsigned int target_agent_id,
                             const std::string& data)
             {
-                dispatch_async(queue, ^{
-                    
-                    //TODO: the w_data might contains some data yet to be written
-                    //here we simply override previoys one
-                    w_data.reset();
-                    w_data.payload = data; 
-                    w_data.header.payload_size = data.size();
-                    w_data.header.source_agent_id = source_agent_id;
-                    w_data.header.target_agent_id = target_agent_id;
-                    
-                    if(w_source_suspended)
-                    {
-                        w_source_suspended = false;
-                        dispatch_resume(w_source);
-                    }
+                //a block captures the reference, not the string, take a copy along
+                std::string* payload = new std::string(data);
+                submit(^{
+                    enqueue(source_agent_id, target_agent_id, payload->data(), payload->size());
+                    delete payload;
                 });
                 
             }
             
+            //same, taking over the caller's reference to the payload, 
+            //e.g. to pass on a received package without copying it out first.
+            //the payload is written from where it is, no copy at all
+            void write_data(unsigned int source_agent_id, 
+                            unsigned int target_agent_id,
+                            NetworkAgentPayload* payload)
+            {
+                NetworkAgentPackageHead header;
+                header.protocol = NetworkAgentWireHeader::PROTOCOL;
+                header.payload_size = payload->size();
+                header.source_agent_id = source_agent_id;
+                header.target_agent_id = target_agent_id;
+                NetworkAgentWireHead head;
+                NetworkAgentWireHeader::encode(header, head.bytes);
+                write_encoded(head, payload);
+            }
+            
+            //async write of a package on a logical stream of the session, taking over the reference 
+            //to the payload. the package is sent in segments interleaved with those of other streams, 
+            //in order within its stream. packages written with write_data() go ahead of any segment
+            void write_stream(unsigned int stream_id,
+                              unsigned int source_agent_id, 
+                              unsigned int target_agent_id,
+                              NetworkAgentPayload* payload)
+            {
+                submit(^{
+                    w_streams.push(stream_id, source_agent_id, target_agent_id, payload);
+                    backlog(payload->size(), 0);
+                    pump_streams();
+                    update_congestion();
+                });
+            }
+            
+            //share of the session's bandwidth a stream gets while others have data too,
+            //1 to NetworkAgentStreamScheduler::MAX_WEIGHT, streams start out at DEFAULT_WEIGHT
+            void set_stream_weight(unsigned int stream_id, unsigned int weight)
+            {
+                submit(^{
+                    w_streams.set_weight(stream_id, weight);
+                });
+            }
+            
+            //queue an already encoded package, taking over the reference to its payload
+            void write_encoded(const NetworkAgentWireHead& head, NetworkAgentPayload* payload)
+            {
+                //a block captures the reference, not the header, take a copy along
+                NetworkAgentWireHead h = head;
+                submit(^{
+                    enqueue(h, payload);
+                });
+            }
+            
+            //replace the session's I/O policy, from any thread
+            void set_policy(const NetworkAgentIOPolicy& p);
+            
+            //close the connection from any thread, the delegate gets closed() 
+            //and the session is gone afterwards
+            void close();
+            
+            //keep the session from being recycled or deleted, for a thread that may still call
+            //into it after it closed. those calls do nothing visible then, the session is given
+            //back once the last reference is released
+            void retain()
+            {
+                refs.fetch_add(1, std::memory_order_relaxed);
+            }
+            
+            //from any thread
+            void release();
+            
+            //false while past a write watermark, readable from any thread.
+            //write_data() still queues everything, holding back is up to the producer
+            bool writable() const
+            {
+                return !w_congested.load(std::memory_order_relaxed);
+            }
+            
+            //I/O counters of this session so far, readable from any thread
+            NetworkAgentStats stats() const
+            {
+                NetworkAgentStats s;
+                memset(&s, 0, sizeof(s));
+                counters.collect(s);
+                return s;
+            }
+            
+            //run times of the handlers of this session, since it was opened
+            NetworkAgentHistogram latency(NetworkAgentSessionCounters::Timer timer) const
+            {
+                NetworkAgentHistogram h;
+                memset(&h, 0, sizeof(h));
+                (counters.*timer).collect(h);
+                return h;
+            }
+            
             NetworkAgentClientSession()
             {
-                w_source_suspended = true;
+                recycler = NULL;
+                init();
+            }
+            
+            ~NetworkAgentClientSession()
+            {
+                teardown();
+            }
+            
+            //the engine is done with a closed session, called on its context
+            static void dispose(NetworkAgentClientSession* s);
+            
+        private:
+            //run a task on the session's context from any thread, the session
+            //is not given back before the task ran
+            void submit(NetworkAgentTask task)
+            {
+                retain();
+                engine->async(this, ^{
+                    task();
+                    unhold();
+                });
+            }
+            
+            //drop a reference on the session's context
+            void unhold()
+            {
+                if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    give_back(this);
+            }
+            
+            //back to the free list or deleted, nothing references the session anymore
+            static void give_back(NetworkAgentClientSession* s);
+            
+            //fields of a session not yet attached to anything
+            void init()
+            {
+                metrics = NULL;
                 delegate = NULL;
                 dispatcher = NULL;
+                r_route = NULL;
+                r_route_target = 0;
+                r_route_epoch = 0;
+                compact_offered = w_compact = false;
+                policy = NetworkAgentIOPolicy();
+                coalescer = NULL;
+                capture = NULL;
+                c_session = 0;
+                relay = NULL;
+                r_splice = NULL;
+                r_hop = false;
+                w_hold.fire = release_writes;
+                w_hold.owner = this;
+                timeouts = NULL;
+                t_read = t_write = t_sent = 0;
+                r_hint = MIN_READ_HINT;
+                r_direct = NULL;
+                r_direct_filled = 0;
+                sock = -1;
+                context = 0;
+                engine = NULL;
+                w_active = closed = false;
+                w_congested = false;
+                r_paused = r_splice_paused = false;
+                r_source = w_source = NULL;
+                w_source_suspended = true;
+                r_source_suspended = false;
+                sources_alive = 0;
+                io_events = 0;
+                io_state = NULL;
+                refs.store(1, std::memory_order_relaxed);
+                serial = 0;
+            }
+            
+            //let go of everything the session references
+            void teardown();
+            
+            //back to a fresh session for the next connection of the shard, the containers keep
+            //what they allocated, buffer storage goes back to the shard's pool
+            void recycle()
+            {
+                teardown();
+                w_queue.clear();
+                w_queue.shrink();
+                r_buffer.clear();
+                r_buffer.shrink();
+                r_decoder = NetworkAgentFrameDecoder();
+                w_streams.reset();
+                r_streams.clear();
+                counters.clear();
+                init();
+            }
+        };
+        
+        /**
+         Session Recycling
+         closed sessions of a shard go back to a bounded free list instead of being deleted,
+         a new connection gets one with its containers already allocated and only the socket
+         bound parts (engine registration, dispatch sources) are set up again. any thread
+         may take a session, the shard's context gives it back. reference counted, every
+         session handed out keeps its pool alive
+         **/
+        class NetworkAgentSessionPool
+        {
+        public:
+            static const size_t DEFAULT_CAPACITY = 64; //idle sessions per shard
+            
+            struct Stats
+            {
+                unsigned long long created;   //sessions allocated
+                unsigned long long reused;    //served from the free list
+                unsigned long long recycled;  //closed sessions put on the free list
+                unsigned long long discarded; //closed sessions deleted while the free list was full
+                size_t idle;                  //sessions on the free list right now
+            };
+            
+            explicit NetworkAgentSessionPool(size_t capacity = DEFAULT_CAPACITY)
+            : _refcount(1), _capacity(capacity), _returning(0)
+            {
+                memset(&_stats, 0, sizeof(_stats));
             }
             
-            void cancel_all_sources()
+            void retain()
             {
-                if(w_source_suspended)
-                    dispatch_resume(w_source);
-                dispatch_source_cancel(w_source);
-                dispatch_source_cancel(r_source);
+                _refcount.fetch_add(1, std::memory_order_relaxed);
             }
             
-            ~NetworkAgentClientSession()
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+            
+            //a session not attached to anything, recycled if one is idle
+            NetworkAgentClientSession* acquire()
+            {
+                NetworkAgentClientSession* s = NULL;
+                {
+                    std::lock_guard<std::mutex> lock(_lock);
+                    if(!_idle.empty())
+                    {
+                        s = _idle.back();
+                        _idle.pop_back();
+                        _stats.reused++;
+                    }
+                    else
+                        _stats.created++;
+                }
+                if(!s)
+                    s = new NetworkAgentClientSession;
+                s->recycler = this;
+                retain();
+                return s;
+            }
+            
+            //take back a closed session the engine is done with
+            void recycle(NetworkAgentClientSession* s)
             {
-                //asynchornously send out cacnel signal 
-                //to all dispatch resource, release the resources,
-                //and eventually realeasing the queue object iself 
-                //dispatch_async(queue, ^{
-                    //need to resume write source and then cancel it 
-                    
-                    dispatch_release(w_source);
-                    dispatch_release(r_source);
-               // });
+                //a slot is reserved before the reset so that concurrent returns stay within capacity
+                bool keep;
+                {
+                    std::lock_guard<std::mutex> lock(_lock);
+                    keep = _idle.size() + _returning < _capacity;
+                    if(keep)
+                        _returning++;
+                    else
+                        _stats.discarded++;
+                }
                 
+                s->recycler = NULL;
+                if(!keep)
+                    delete s;
+                else
+                {
+                    s->recycle();
+                    std::lock_guard<std::mutex> lock(_lock);
+                    _returning--;
+                    _idle.push_back(s);
+                    _stats.recycled++;
+                }
+                release(); //the session's reference
+            }
+            
+            Stats stats() const
+            {
+                std::lock_guard<std::mutex> lock(_lock);
+                Stats st = _stats;
+                st.idle = _idle.size();
+                return st;
+            }
+            
+        private:
+            ~NetworkAgentSessionPool()
+            {
+                for(size_t i=0; i<_idle.size(); i++)
+                    delete _idle[i];
             }
+            
+            NetworkAgentSessionPool(const NetworkAgentSessionPool&);
+            NetworkAgentSessionPool& operator=(const NetworkAgentSessionPool&);
+            
+            std::atomic<int> _refcount;
+            size_t _capacity;
+            size_t _returning; //sessions being reset for a reserved slot
+            mutable std::mutex _lock;
+            std::vector<NetworkAgentClientSession*> _idle;
+            Stats _stats;
         };
     
 
+        //one receiver of a broadcast
+        struct NetworkAgentBroadcastTarget
+        {
+            NetworkAgentClientSession* session;
+            unsigned int target_agent_id;
+        };
+        
+        //construction time knobs of a NetworkAgent
+        struct NetworkAgentOptions
+        {
+            NetworkAgentEngine::Kind engine; //I/O engine driving the sessions
+            unsigned int shards; //number of I/O shards, 0 for one per online core
+            bool cpu_affinity; //pin shard i to core i, honored by engines that own their threads
+            bool reuseport_acceptors; //one SO_REUSEPORT listening socket and accept source per shard
+            NetworkAgentWatermarks watermarks; //write congestion and read pausing of every session
+            NetworkAgentTimeoutOptions timeouts; //idle, write stall and heartbeat timers of every session
+            size_t segment_size; //largest segment stream packages are cut into
+            std::string local_dir; //directory of the same host unix domain sockets, empty for TCP loopback only
+            NetworkAgentIOPolicy io; //socket policy of every session, see NetworkAgentClientSession::set_policy()
+            bool compact_headers; //offer compact package headers in a heartbeat, used once the peer offers them too. peers have to understand heartbeats
+            size_t session_pool; //closed sessions kept per shard for new connections, 0 deletes them
+            
+            NetworkAgentOptions() : engine(NetworkAgentEngine::DISPATCH), shards(0), cpu_affinity(false), reuseport_acceptors(false),
+                                    segment_size(NetworkAgentStreamScheduler::DEFAULT_SEGMENT_SIZE), compact_headers(false),
+                                    session_pool(NetworkAgentSessionPool::DEFAULT_CAPACITY){}
+        };
+        
+        //an I/O context shared by all sessions hashed onto it,
+        //together with the buffer pool those sessions lease from
+        struct NetworkAgentShard
+        {
+            unsigned int index;
+            NetworkAgentBufferPool* pool;
+            NetworkAgentSessionPool* sessions; //closed sessions waiting for the next connection
+            int cpu; //core the shard is bound to, -1 if unbound
+        };
+        
         /**
          GCD Based Networking Agent 
          **/
         class NetworkAgent
         {
+            friend class NetworkAgentEngine;
+            friend class NetworkAgentClientSession;
         public:
             
             //currently limited to this number in BSD spec
             static const int DEFAULT_MAX_SOCK_LISTEN_QUEUE = 128;
+            //a listener out of descriptors or memory waits this long before accepting again
+            static const uint64_t ACCEPT_BACKOFF_NS = 100 * 1000000ull;
             enum Mode{
                 SERVER,
                 CLIENT
             };
             
-            NetworkAgent(Mode mode, NetworkAgentDispatcherDelegate *d);
+            NetworkAgent(Mode mode, NetworkAgentDispatcherDelegate *d, 
+                         const NetworkAgentOptions& options = NetworkAgentOptions());
             ~NetworkAgent();
             
+            unsigned int shard_count() const { return _shards.size(); }
+            
+            //hit/miss counters of the buffer pools, summed over all shards
+            NetworkAgentBufferPool::Stats buffer_pool_stats() const;
+            //same for the session pools
+            NetworkAgentSessionPool::Stats session_pool_stats() const;
+            
+            //I/O counters and handler latencies of all sessions, past and present
+            NetworkAgentMetrics::Snapshot metrics() const { return _metrics->snapshot(); }
+            
+            //append every package received from now on to a trace file, until stop_capture().
+            //see NetworkAgentCapture.h for the format, gcd-netlib-replay plays a trace back
+            void start_capture(const char* path) LIBGCDNET_THROWS(NetworkAgentException);
+            void stop_capture() { _capture->stop(); }
+            
+            //relay packages for target_agent_id to the agent at hostname:servname instead of delivering
+            //them here, replies come back the same way. every shard connects on its own, a route
+            //added again replaces its connections. see NetworkAgentRelay.h
+            void add_route(unsigned int target_agent_id, const char* hostname, const char* servname) LIBGCDNET_THROWS(NetworkAgentException);
+            //packages for target_agent_id are delivered here again, its connections are closed
+            void remove_route(unsigned int target_agent_id);
+            NetworkAgentRelay::Stats relay_stats() const { return _relay->stats(); }
+            
             
         public:
             //activate server agent's network listening on specified port
-            void listen(const char *hostname, const char* servname) throw(NetworkAgentException); 
-            void connect(const char *hostname, const char* servname) throw(NetworkAgentException);
+            void listen(const char *hostname, const char* servname) LIBGCDNET_THROWS(NetworkAgentException); 
+            //@return the session of the first address connected to
+            NetworkAgentClientSession* connect(const char *hostname, const char* servname) LIBGCDNET_THROWS(NetworkAgentException);
+            
+            //send one package to many sessions, the payload is shared by all of them and written
+            //from where it is. the header is encoded once and only the target is patched per session.
+            //takes over the caller's reference to the payload
+            void broadcast(const std::vector<NetworkAgentBroadcastTarget>& targets, 
+                           unsigned int source_agent_id, NetworkAgentPayload* payload);
+            //same target agent on every session, the data is copied once
+            void broadcast(const std::vector<NetworkAgentClientSession*>& sessions, 
+                           unsigned int source_agent_id, unsigned int target_agent_id, 
+                           const char* data, size_t len);
+            
+            //non-blocking connect, name resolution runs off the caller's thread and every resolved
+            //address is tried in parallel, the first to complete wins and the others are dropped.
+            //done runs on the new session's context, after delegate got connected(), 
+            //or with ETIMEDOUT once timeout_ms (0 for none) passed without a connection
+            void connect_async(const char *hostname, const char* servname, 
+                               NetworkAgentClientDelegate* delegate, 
+                               NetworkAgentConnectHandler done, 
+                               unsigned int timeout_ms = 0) LIBGCDNET_THROWS(NetworkAgentException);
             
         protected:
-            void accept(int listen_sock) throw(NetworkAgentException);//accept a new client connection
-            NetworkAgentClientSession* create_client_session(int client_sock) throw(NetworkAgentException);
+            void start_listener(const struct addrinfo* aires, NetworkAgentShard* shard, const char* servname) LIBGCDNET_THROWS(NetworkAgentException);
+            //remove the listeners started from index first on
+            void stop_listeners(size_t first);
+            //clear a unix domain socket path for the bind, false if it is in use
+            static bool unlink_stale(const char* path, const struct addrinfo* aires);
+            void accept(int listen_sock, NetworkAgentShard* shard) LIBGCDNET_THROWS(NetworkAgentException);//accept all pending client connections
+            //@param downstream - a relay's connection to the next hop, it delivers nothing here
+            NetworkAgentClientSession* create_client_session(int client_sock, NetworkAgentShard* shard = NULL, 
+                                                             bool downstream = false) LIBGCDNET_THROWS(NetworkAgentException);
+            //blocking connect to the first address of hostname:servname that takes it
+            int dial(const char* hostname, const char* servname) LIBGCDNET_THROWS(NetworkAgentException);
+            NetworkAgentShard& shard_for(int client_sock);
+            
+            //addresses to try for hostname:servname, NULL with a getaddrinfo() error code set
+            //@param connecting - same host peers may be reached over their local socket
+            struct addrinfo* resolve(const char* hostname, const char* servname, int flags, bool connecting, int& error) const;
+            //unix domain socket of the same host transport for a port, empty if disabled
+            std::string local_socket(const char* servname) const;
+            static void close_client_session(NetworkAgentClientSession* req);
+            
+            //connection attempts of one connect_async(), owned by the context they run on
+            struct PendingConnect;
+            void connect_start(PendingConnect* op, struct addrinfo* aires0);
+            void connect_ready(PendingConnect* op, size_t attempt);
+            void connect_timeout(PendingConnect* op);
+            void connect_finish(PendingConnect* op, NetworkAgentClientSession* session, int error);
+            static void connect_release(PendingConnect* op);
             
             
         protected:
-            static void client_worker_queue_write(struct NetworkAgentClientSession* req) throw(NetworkAgentException);
-            static void client_worker_queue_read(struct NetworkAgentClientSession* req) throw(NetworkAgentException);
-            static void client_worker_queue_finalizer(char* count);
+            static void client_worker_queue_write(struct NetworkAgentClientSession* req) LIBGCDNET_THROWS(NetworkAgentException);
+            static bool client_worker_queue_read(struct NetworkAgentClientSession* req, size_t estimated) LIBGCDNET_THROWS(NetworkAgentException);
+            static void client_worker_queue_ingest(struct NetworkAgentClientSession* req, size_t received) LIBGCDNET_THROWS(NetworkAgentException);
+            static void client_worker_queue_direct(struct NetworkAgentClientSession* req, size_t received);
+            static void client_worker_queue_segments(struct NetworkAgentClientSession* req) LIBGCDNET_THROWS(NetworkAgentException);
+            static void relink(struct NetworkAgentClientSession* req, unsigned int target_agent_id);
+            static void capture_package(struct NetworkAgentClientSession* req, const NetworkAgentPackageHead& head, const char* payload);
+            static bool client_worker_queue_forward(struct NetworkAgentClientSession* req, const NetworkAgentPackageHead& head, NetworkAgentPayload* payload);
+            static void learn_route(struct NetworkAgentClientSession* req, unsigned int source_agent_id);
+            static bool client_worker_queue_splice_start(struct NetworkAgentClientSession* req, const NetworkAgentPackageHead& head);
+            static void client_worker_queue_splice(NetworkAgentRelaySplice* job);
+            static void client_worker_queue_spliced(void* job);
+            static void splice_release(NetworkAgentRelaySplice* job);
+            static void client_worker_queue_flushed(struct NetworkAgentClientSession* req);
+            static void client_worker_queue_sent(struct NetworkAgentClientSession* req, size_t n);
+            static void client_worker_queue_timer(void* req);
             
             
         private:
             
-            dispatch_queue_t _workqueue;//the worker queue
             Mode _mode; //sever/client mode
             //std::list<dispatch_source_t> _listeners;
             
              
             NetworkAgentDispatcherDelegate * _dispatcher; 
+            NetworkAgentOptions _options;
+            std::vector<NetworkAgentShard> _shards; //sessions are hashed onto these I/O contexts
+            NetworkAgentEngine* _engine;
+            NetworkAgentMetrics* _metrics;
+            NetworkAgentTimeouts* _timeouts; //NULL without timeouts
+            NetworkAgentCoalescer* _coalescer;
+            NetworkAgentCapture* _capture;
+            NetworkAgentRelay* _relay;
+            std::vector<int> _listen_socks; //handed to the engine, removed with the agent
+            std::vector<std::string> _local_paths; //unix domain sockets listened on, removed with the agent
+            std::atomic<unsigned int> _next_connect; //round robin of connect_async() over the shards
         };
 
 }
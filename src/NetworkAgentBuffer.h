@@ -0,0 +1,657 @@
+//
+//  NetworkAgentBuffer.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_BUFFER_H
+#define LIBGCDNET_ENGINE_NETWORK_BUFFER_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <new>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <atomic>
+#include <sys/uio.h> //struct iovec
+
+namespace libgcdnet{
+
+        /**
+         Receive Buffer Pool
+         slab of power of two blocks (4KB .. 1MB) shared by the session caches of an agent.
+         a cache leases its storage from here when it needs room and hands it back as
+         soon as it runs empty, so idle sessions hold no memory and busy ones cycle
+         through the same few blocks instead of the allocator. freed blocks are chained
+         through their own first bytes, the pool never allocates bookkeeping.
+         reference counted like the dispatch objects, every cache retains its pool
+         **/
+        class NetworkAgentBufferPool
+        {
+        public:
+            static const size_t MIN_BLOCK_SHIFT = 12; //4KB
+            static const size_t MAX_BLOCK_SHIFT = 20; //1MB
+            static const size_t CLASS_COUNT = MAX_BLOCK_SHIFT - MIN_BLOCK_SHIFT + 1;
+            static const size_t DEFAULT_MAX_FREE = 256; //cached blocks per size class
+
+            struct Stats
+            {
+                unsigned long long hits;      //served from a free list
+                unsigned long long misses;    //had to go to the allocator
+                unsigned long long oversize;  //larger than the biggest class, never pooled
+                unsigned long long released;  //blocks returned to the pool
+                unsigned long long trimmed;   //returned while the free list was full
+                size_t cached_bytes;          //memory currently sitting in free lists
+            };
+
+            explicit NetworkAgentBufferPool(size_t max_free = DEFAULT_MAX_FREE)
+            : _refcount(1), _max_free(max_free)
+            {
+                memset(&_stats, 0, sizeof(_stats));
+                for(size_t i=0; i<CLASS_COUNT; i++){
+                    _free[i] = NULL;
+                    _free_count[i] = 0;
+                }
+            }
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            //smallest block size serving n bytes
+            static size_t block_size(size_t n)
+            {
+                size_t size = (size_t)1 << MIN_BLOCK_SHIFT;
+                while(size < n)
+                    size <<= 1;
+                return size;
+            }
+
+            //@param size - a value returned by block_size()
+            char* acquire(size_t size)
+            {
+                int cls = size_class(size);
+                std::lock_guard<std::mutex> lock(_lock);
+                if(cls < 0){
+                    _stats.oversize++;
+                }
+                else if(_free[cls]){
+                    FreeBlock* b = _free[cls];
+                    _free[cls] = b->next;
+                    _free_count[cls]--;
+                    _stats.cached_bytes -= size;
+                    _stats.hits++;
+                    return (char*)b;
+                }
+                else
+                    _stats.misses++;
+
+                char* buf = (char*)malloc(size);
+                if(!buf)
+                    throw std::bad_alloc();
+                return buf;
+            }
+
+            void recycle(char* buf, size_t size)
+            {
+                if(!buf)
+                    return;
+                int cls = size_class(size);
+                {
+                    std::lock_guard<std::mutex> lock(_lock);
+                    _stats.released++;
+                    if(cls >= 0 && _free_count[cls] < _max_free){
+                        FreeBlock* b = (FreeBlock*)buf;
+                        b->next = _free[cls];
+                        _free[cls] = b;
+                        _free_count[cls]++;
+                        _stats.cached_bytes += size;
+                        return;
+                    }
+                    _stats.trimmed++;
+                }
+                free(buf);
+            }
+
+            Stats stats() const
+            {
+                std::lock_guard<std::mutex> lock(_lock);
+                return _stats;
+            }
+
+        private:
+            struct FreeBlock
+            {
+                FreeBlock* next;
+            };
+
+            ~NetworkAgentBufferPool()
+            {
+                for(size_t i=0; i<CLASS_COUNT; i++)
+                    while(_free[i]){
+                        FreeBlock* b = _free[i];
+                        _free[i] = b->next;
+                        free(b);
+                    }
+            }
+
+            NetworkAgentBufferPool(const NetworkAgentBufferPool&);
+            NetworkAgentBufferPool& operator=(const NetworkAgentBufferPool&);
+
+            static int size_class(size_t size)
+            {
+                for(size_t i=0; i<CLASS_COUNT; i++)
+                    if(size == ((size_t)1 << (MIN_BLOCK_SHIFT + i)))
+                        return (int)i;
+                return -1;
+            }
+
+            std::atomic<int> _refcount;
+            size_t _max_free;
+            mutable std::mutex _lock;
+            FreeBlock* _free[CLASS_COUNT];
+            size_t _free_count[CLASS_COUNT];
+            Stats _stats;
+        };
+
+        /**
+         Circular Bytes Cache
+         bytes are appended at the tail and consumed from the head. the storage
+         is kept across packages, so a session reading/writing steady traffic
+         does not touch the heap. socket I/O goes straight into and out of the
+         storage through the span / iovec accessors, no intermediate buffer.
+         the storage comes from a NetworkAgentBufferPool when one is attached.
+         not thread safe, meant to be used from within the session worker queue
+         **/
+        class NetworkAgentRingBuffer
+        {
+        public:
+            static const size_t DEFAULT_CAPACITY = 4096;
+
+            NetworkAgentRingBuffer() : _buf(NULL), _cap(0), _head(0), _size(0), _pool(NULL), _pinned(false){}
+            ~NetworkAgentRingBuffer()
+            {
+                if(_buf)
+                    dispose(_buf, _cap);
+                dispose_retired();
+                if(_pool)
+                    _pool->release();
+            }
+
+            //lease storage from the given pool from now on, the current storage goes back first
+            void set_pool(NetworkAgentBufferPool* pool)
+            {
+                if(pool)
+                    pool->retain();
+                if(_buf && _size == 0)
+                    release_storage();
+                else if(_buf && pool != _pool){
+                    //content has to survive the switch
+                    char* buf = pool ? pool->acquire(_cap) : (char*)malloc(_cap);
+                    if(!buf)
+                        throw std::bad_alloc();
+                    peek(buf, _size);
+                    dispose(_buf, _cap);
+                    _buf = buf;
+                    _head = 0;
+                }
+                if(_pool)
+                    _pool->release();
+                _pool = pool;
+            }
+
+            NetworkAgentBufferPool* pool() const { return _pool; }
+
+            //hand the storage back when there is nothing left in it
+            //returns true if the storage was released
+            bool shrink()
+            {
+                if(!_buf || _size != 0 || _pinned)
+                    return false;
+                release_storage();
+                return true;
+            }
+
+            //while pinned the storage stays where it is even if the ring grows,
+            //so that spans handed to asynchronous I/O remain valid until unpin()
+            void pin()
+            {
+                _pinned = true;
+            }
+
+            void unpin()
+            {
+                _pinned = false;
+                dispose_retired();
+            }
+
+            size_t size() const { return _size; }
+            size_t capacity() const { return _cap; }
+            size_t available() const { return _cap - _size; }
+            bool empty() const { return _size == 0; }
+
+            //drop all bytes but keep the storage for reuse
+            void clear()
+            {
+                _head = _size = 0;
+            }
+
+            //make sure at least n more bytes can be appended without reallocation
+            void reserve(size_t n)
+            {
+                if(available() < n)
+                    grow(_size + n);
+            }
+
+            //byte at offset i from the head
+            char at(size_t i) const
+            {
+                return _buf[(_head + i) & (_cap - 1)];
+            }
+
+            //contiguous readable region starting at the head
+            const char* read_span(size_t& len) const
+            {
+                len = _size;
+                if(_head + len > _cap)
+                    len = _cap - _head;
+                return _buf + _head;
+            }
+
+            //fill up to two iovecs covering n readable bytes starting at offset from the head
+            //returns the number of iovecs used
+            int read_iov(struct iovec* iov, size_t offset, size_t n) const
+            {
+                if(offset >= _size || n == 0)
+                    return 0;
+                if(n > _size - offset)
+                    n = _size - offset;
+
+                size_t start = (_head + offset) & (_cap - 1);
+                size_t first = _cap - start;
+                iov[0].iov_base = _buf + start;
+                if(n <= first){
+                    iov[0].iov_len = n;
+                    return 1;
+                }
+                iov[0].iov_len = first;
+                iov[1].iov_base = _buf;
+                iov[1].iov_len = n - first;
+                return 2;
+            }
+
+            //release n bytes from the head
+            void consume(size_t n)
+            {
+                if(n >= _size){
+                    clear();
+                    return;
+                }
+                _head = (_head + n) & (_cap - 1);
+                _size -= n;
+            }
+
+            //contiguous writable region at the tail
+            char* write_span(size_t& len)
+            {
+                if(_cap == 0){
+                    len = 0;
+                    return NULL;
+                }
+                size_t tail = (_head + _size) & (_cap - 1);
+                len = (tail >= _head && _size < _cap) ? _cap - tail : available();
+                return _buf + tail;
+            }
+
+            //fill up to two iovecs covering the free region at the tail
+            //returns the number of iovecs used
+            int write_iov(struct iovec* iov)
+            {
+                size_t free_bytes = available();
+                if(free_bytes == 0)
+                    return 0;
+
+                size_t tail = (_head + _size) & (_cap - 1);
+                size_t first = _cap - tail;
+                iov[0].iov_base = _buf + tail;
+                if(free_bytes <= first){
+                    iov[0].iov_len = free_bytes;
+                    return 1;
+                }
+                iov[0].iov_len = first;
+                iov[1].iov_base = _buf;
+                iov[1].iov_len = free_bytes - first;
+                return 2;
+            }
+
+            //mark n bytes written through write_span / write_iov as readable
+            void commit(size_t n)
+            {
+                _size += n;
+            }
+
+            void append(const void* data, size_t n)
+            {
+                reserve(n);
+                struct iovec iov[2];
+                int cnt = write_iov(iov);
+                const char* src = (const char*)data;
+                for(int i=0; i<cnt && n>0; i++)
+                {
+                    size_t len = iov[i].iov_len < n ? iov[i].iov_len : n;
+                    memcpy(iov[i].iov_base, src, len);
+                    src += len;
+                    n -= len;
+                    _size += len;
+                }
+            }
+
+            //copy n bytes starting at offset from the head into dst, without consuming them
+            void peek(void* dst, size_t n, size_t offset = 0) const
+            {
+                struct iovec iov[2];
+                int cnt = read_iov(iov, offset, n);
+                char* out = (char*)dst;
+                for(int i=0; i<cnt; i++)
+                {
+                    memcpy(out, iov[i].iov_base, iov[i].iov_len);
+                    out += iov[i].iov_len;
+                }
+            }
+
+            //move n bytes from the head into the string
+            void extract(std::string& out, size_t n)
+            {
+                if(n > _size)
+                    n = _size;
+                out.resize(n);
+                if(n)
+                    peek(&out[0], n);
+                consume(n);
+            }
+
+        private:
+            //non-copyable, the storage is owned by a single session
+            NetworkAgentRingBuffer(const NetworkAgentRingBuffer&);
+            NetworkAgentRingBuffer& operator=(const NetworkAgentRingBuffer&);
+
+            //reallocate into a power of two capacity, linearising the content at offset 0
+            void grow(size_t min_cap)
+            {
+                size_t cap = _cap ? _cap : DEFAULT_CAPACITY;
+                while(cap < min_cap)
+                    cap <<= 1;
+
+                char* buf = _pool ? _pool->acquire(cap) : (char*)malloc(cap);
+                if(!buf)
+                    throw std::bad_alloc();
+                peek(buf, _size);
+                if(_pinned && _buf)
+                    _retired.push_back(std::make_pair(_buf, _cap));
+                else
+                    dispose(_buf, _cap);
+                _buf = buf;
+                _cap = cap;
+                _head = 0;
+            }
+
+            void dispose(char* buf, size_t cap)
+            {
+                if(_pool)
+                    _pool->recycle(buf, cap);
+                else
+                    free(buf);
+            }
+
+            void release_storage()
+            {
+                dispose(_buf, _cap);
+                _buf = NULL;
+                _cap = _head = _size = 0;
+            }
+
+            void dispose_retired()
+            {
+                for(size_t i=0; i<_retired.size(); i++)
+                    dispose(_retired[i].first, _retired[i].second);
+                _retired.clear();
+            }
+
+            char* _buf;
+            size_t _cap; //always zero or a power of two
+            size_t _head;
+            size_t _size;
+            NetworkAgentBufferPool* _pool;
+            bool _pinned;
+            std::vector<std::pair<char*, size_t> > _retired; //outgrown storage still referenced by pending I/O
+        };
+
+        /**
+         Outbound Frame Queue
+         FIFO of frames waiting to be written to a session socket. each frame
+         keeps its serialized header inline, payload bytes of all queued frames
+         live back-to-back in a single ring. the socket writer gathers as many
+         headers and payloads as fit into one iovec array and reports back how
+         many bytes were accepted, partially written frames resume at the exact offset
+         **/
+        class NetworkAgentOutboundQueue
+        {
+        public:
+            static const size_t MAX_HEAD_SIZE = 32;
+            static const int MAX_IOV = 64; //well below IOV_MAX on every supported platform
+
+            NetworkAgentOutboundQueue() : _offset(0), _bytes(0){}
+
+            ~NetworkAgentOutboundQueue()
+            {
+                clear();
+            }
+
+            bool empty() const { return _frames.empty(); }
+            size_t frames() const { return _frames.size(); }
+            size_t bytes() const { return _bytes; } //pending bytes, headers included
+
+            void push(const void* head, size_t head_len, const void* payload, size_t payload_len)
+            {
+                Entry e;
+                if(head_len > MAX_HEAD_SIZE)
+                    head_len = MAX_HEAD_SIZE;
+                memcpy(e.head, head, head_len);
+                e.head_len = head_len;
+                e.payload_len = payload_len;
+                e.ext = NULL;
+                e.ext_release = NULL;
+                e.ext_owner = NULL;
+                e.spliced = 0;
+
+                _payload.append(payload, payload_len);
+                _frames.push_back(e);
+                _bytes += head_len + payload_len;
+            }
+
+            //same without copying the payload, it is written from where it is and
+            //release(owner) runs once the frame is out or dropped. the bytes must not change meanwhile
+            void push_external(const void* head, size_t head_len, const char* payload, size_t payload_len,
+                               void (*release)(void*), void* owner)
+            {
+                Entry e;
+                if(head_len > MAX_HEAD_SIZE)
+                    head_len = MAX_HEAD_SIZE;
+                memcpy(e.head, head, head_len);
+                e.head_len = head_len;
+                e.payload_len = payload_len;
+                e.ext = payload;
+                e.ext_release = release;
+                e.ext_owner = owner;
+                e.spliced = 0;
+
+                _frames.push_back(e);
+                _bytes += head_len + payload_len;
+            }
+
+            //same for a payload whose first copied_len bytes are here and whose rest is spliced
+            //into the socket by someone else. gather() stops in front of the spliced part, nothing
+            //queued later goes out before it. splicing() hands out the owner once it is due, the
+            //bytes spliced are reported with advance(). release(owner) runs once written or dropped
+            void push_spliced(const void* head, size_t head_len, const void* copied, size_t copied_len,
+                              size_t spliced_len, void (*release)(void*), void* owner)
+            {
+                push(head, head_len, copied, copied_len);
+                Entry& e = _frames.back();
+                e.payload_len += spliced_len;
+                e.ext_release = release;
+                e.ext_owner = owner;
+                e.spliced = spliced_len;
+                _bytes += spliced_len;
+            }
+
+            //owner of the spliced frame at the front once everything before its spliced part is written
+            void* splicing() const
+            {
+                if(_frames.empty() || !_frames.front().spliced)
+                    return NULL;
+                const Entry& e = _frames.front();
+                return _offset >= e.head_len + e.payload_len - e.spliced ? e.ext_owner : NULL;
+            }
+
+            //fill iov with the pending bytes in wire order, returns the number of iovecs used
+            int gather(struct iovec* iov, int max_iov) const
+            {
+                int cnt = 0;
+                size_t ring_offset = 0;
+                size_t offset = _offset;
+                for(std::deque<Entry>::const_iterator it = _frames.begin(); it != _frames.end() && cnt < max_iov; ++it)
+                {
+                    size_t payload_offset = 0;
+                    if(offset < it->head_len){
+                        iov[cnt].iov_base = (void*)(it->head + offset);
+                        iov[cnt].iov_len = it->head_len - offset;
+                        cnt++;
+                    }
+                    else
+                        payload_offset = offset - it->head_len; //already released from the ring
+
+                    size_t remaining = it->payload_len - payload_offset;
+                    if(it->spliced){
+                        size_t copied = it->payload_len - it->spliced;
+                        if(payload_offset < copied && cnt + 2 <= max_iov)
+                            cnt += _payload.read_iov(iov + cnt, ring_offset, copied - payload_offset);
+                        break; //the rest is not here
+                    }
+                    if(remaining && it->ext && cnt < max_iov){
+                        iov[cnt].iov_base = (void*)(it->ext + payload_offset);
+                        iov[cnt].iov_len = remaining;
+                        cnt++;
+                        offset = 0;
+                        continue;
+                    }
+                    if(remaining && !it->ext && cnt + 2 <= max_iov)
+                        cnt += _payload.read_iov(iov + cnt, ring_offset, remaining);
+                    else if(remaining)
+                        break; //no room for the payload, stop at a header boundary
+
+                    ring_offset += remaining;
+                    offset = 0;
+                }
+                return cnt;
+            }
+
+            //n bytes were accepted by the socket, returns the number of frames completed
+            size_t advance(size_t n)
+            {
+                size_t done = 0;
+                while(n > 0 && !_frames.empty())
+                {
+                    const Entry& e = _frames.front();
+                    size_t total = e.head_len + e.payload_len;
+                    size_t take = total - _offset < n ? total - _offset : n;
+
+                    size_t head_left = _offset < e.head_len ? e.head_len - _offset : 0;
+                    if(take > head_left && !e.ext){
+                        //the part of the payload taken that was copied in, a spliced tail never was
+                        size_t copied = e.payload_len - e.spliced;
+                        size_t from = _offset + head_left - e.head_len;
+                        size_t to = from + take - head_left;
+                        if(from < copied)
+                            _payload.consume((to < copied ? to : copied) - from);
+                    }
+
+                    _offset += take;
+                    _bytes -= take;
+                    n -= take;
+
+                    if(_offset == total){
+                        if(e.ext_release)
+                            e.ext_release(e.ext_owner);
+                        _frames.pop_front();
+                        _offset = 0;
+                        done++;
+                    }
+                }
+                return done;
+            }
+
+            void clear()
+            {
+                for(std::deque<Entry>::iterator it = _frames.begin(); it != _frames.end(); ++it)
+                    if(it->ext_release)
+                        it->ext_release(it->ext_owner);
+                _frames.clear();
+                _payload.clear();
+                _offset = _bytes = 0;
+            }
+
+            void set_pool(NetworkAgentBufferPool* pool)
+            {
+                _payload.set_pool(pool);
+            }
+
+            //give the payload storage back once everything is written
+            bool shrink()
+            {
+                return _payload.shrink();
+            }
+
+            //keep gathered iovecs valid across push() while a completion based send is pending
+            void pin()
+            {
+                _payload.pin();
+            }
+
+            void unpin()
+            {
+                _payload.unpin();
+            }
+
+        private:
+            struct Entry
+            {
+                unsigned char head[MAX_HEAD_SIZE];
+                size_t head_len;
+                size_t payload_len;
+                const char* ext; //payload outside the ring, NULL if it was copied in
+                void (*ext_release)(void*);
+                void* ext_owner;
+                size_t spliced; //tail of the payload written around the queue, 0 for none
+            };
+
+            NetworkAgentOutboundQueue(const NetworkAgentOutboundQueue&);
+            NetworkAgentOutboundQueue& operator=(const NetworkAgentOutboundQueue&);
+
+            std::deque<Entry> _frames;
+            NetworkAgentRingBuffer _payload;
+            size_t _offset; //bytes of the front frame already written
+            size_t _bytes;
+        };
+}
+#endif
@@ -0,0 +1,358 @@
+//
+//  NetworkAgentCapture.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_CAPTURE_H
+#define LIBGCDNET_ENGINE_NETWORK_CAPTURE_H
+
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "NetworkAgentFrame.h"
+#include "NetworkAgentTrace.h"
+
+namespace libgcdnet{
+
+        /**
+         Trace File Layout
+         a file header followed by one record per package received, in the order they were
+         captured. multi-byte fields in network byte order like the wire header
+         | 8 bytes "GCDTRACE" | u32 version | u32 record header size | u64 capture start, ns since the epoch |
+         | u64 time, ns since the start | u64 session | u8 protocol | u32 payload_size | u32 source_agent_id | u32 target_agent_id | payload |
+         session numbers tell the sessions of an agent apart and start at 1, stream packages are
+         recorded once reassembled, heartbeats and segments are not recorded. a trace whose capture
+         did not stop cleanly is followed by zeros up to the size the file had grown to
+         **/
+        struct NetworkAgentTraceHeader
+        {
+            static const size_t SIZE = 24;
+            static const size_t RECORD_SIZE = 29;
+            static const unsigned int VERSION = 1;
+
+            static const char* magic() { return "GCDTRACE"; }
+
+            static void put_u64(unsigned char* out, uint64_t v)
+            {
+                NetworkAgentWireHeader::put_u32(out, (unsigned int)(v >> 32));
+                NetworkAgentWireHeader::put_u32(out + 4, (unsigned int)v);
+            }
+
+            static uint64_t get_u64(const unsigned char* in)
+            {
+                return ((uint64_t)NetworkAgentWireHeader::get_u32(in) << 32) | NetworkAgentWireHeader::get_u32(in + 4);
+            }
+        };
+
+        //one package of a trace, the payload points into the mapped file
+        struct NetworkAgentTraceRecord
+        {
+            uint64_t time_ns;
+            uint64_t session;
+            NetworkAgentPackageHead head;
+            const char* payload;
+        };
+
+        /**
+         Package Capture of an Agent
+         appends the packages received by the agent's sessions to a memory mapped trace file,
+         doubled in size whenever it runs full and cut to what was written on stop(). the whole
+         address range the file may grow to is mapped once, growing only extends the file and
+         records never move. a record takes its space and writes its header under one lock,
+         the payload is copied in after the lock is dropped and stop() waits for those copies.
+         a single relaxed load while not capturing. reference counted, every session keeps it alive
+         **/
+        class NetworkAgentCapture
+        {
+        public:
+            static const size_t INITIAL_SIZE = 64 * 1024 * 1024;
+            //address space mapped for a trace, the capture stops when the file would grow beyond
+            static const size_t MAX_SIZE = (size_t)1 << (sizeof(void*) >= 8 ? 36 : 30);
+
+            NetworkAgentCapture() : _refcount(1), _active(false), _next_session(0), _copying(0),
+                                    _fd(-1), _map(NULL), _size(0), _used(0), _start(0){}
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            static uint64_t clock()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            bool active() const { return _active.load(std::memory_order_relaxed); }
+
+            //start a new trace file, replacing the one being written if any
+            //@return 0 or an errno value
+            int start(const char* path)
+            {
+                std::lock_guard<std::mutex> lock(_lock);
+                close_file();
+
+                _fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+                if(_fd < 0)
+                    return errno;
+                _used = 0;
+                void* m = MAP_FAILED;
+                if(ftruncate(_fd, INITIAL_SIZE) == 0)
+                    m = mmap(NULL, MAX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+                if(m == MAP_FAILED)
+                {
+                    int error = errno;
+                    ::close(_fd);
+                    _fd = -1;
+                    return error;
+                }
+                _map = (unsigned char*)m;
+                _size = INITIAL_SIZE;
+
+                unsigned char* h = _map;
+                memcpy(h, NetworkAgentTraceHeader::magic(), 8);
+                NetworkAgentWireHeader::put_u32(h + 8, NetworkAgentTraceHeader::VERSION);
+                NetworkAgentWireHeader::put_u32(h + 12, (unsigned int)NetworkAgentTraceHeader::RECORD_SIZE);
+                NetworkAgentTraceHeader::put_u64(h + 16, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count());
+                _used = NetworkAgentTraceHeader::SIZE;
+                _start = clock();
+                _active.store(true, std::memory_order_relaxed);
+                return 0;
+            }
+
+            void stop()
+            {
+                std::lock_guard<std::mutex> lock(_lock);
+                close_file();
+            }
+
+            //number of a session in the traces, assigned on its first package
+            uint64_t session_id(uint64_t& id)
+            {
+                if(!id)
+                    id = _next_session.fetch_add(1, std::memory_order_relaxed) + 1;
+                return id;
+            }
+
+            //record a package whose payload is in memory
+            void record(uint64_t& session, const NetworkAgentPackageHead& head, const char* payload)
+            {
+                unsigned char* p = reserve(session, head);
+                if(p)
+                {
+                    memcpy(p, payload, head.payload_size);
+                    _copying.fetch_sub(1, std::memory_order_release);
+                }
+            }
+
+            //same with the payload still in a session's stream, at offset
+            void record(uint64_t& session, const NetworkAgentPackageHead& head,
+                        const NetworkAgentRingBuffer& stream, size_t offset)
+            {
+                unsigned char* p = reserve(session, head);
+                if(p)
+                {
+                    stream.peek(p, head.payload_size, offset);
+                    _copying.fetch_sub(1, std::memory_order_release);
+                }
+            }
+
+        private:
+            ~NetworkAgentCapture()
+            {
+                close_file();
+            }
+
+            NetworkAgentCapture(const NetworkAgentCapture&);
+            NetworkAgentCapture& operator=(const NetworkAgentCapture&);
+
+            //room for one record, its header written, NULL if the capture is off or ran out of space.
+            //the caller copies the payload in and then leaves _copying
+            unsigned char* reserve(uint64_t& session, const NetworkAgentPackageHead& head)
+            {
+                std::lock_guard<std::mutex> lock(_lock);
+                if(!_map)
+                    return NULL;
+
+                size_t n = NetworkAgentTraceHeader::RECORD_SIZE + head.payload_size;
+                if(_used + n > _size)
+                {
+                    size_t size = _size;
+                    while(_used + n > size && size < MAX_SIZE)
+                        size *= 2;
+                    if(_used + n > size || ftruncate(_fd, size) < 0)
+                    {
+                        LIBGCDNET_TRACE("capture stopped, trace file cannot grow to %lu bytes, errno %d", (unsigned long)size, errno);
+                        close_file();
+                        return NULL;
+                    }
+                    _size = size;
+                }
+
+                unsigned char* p = _map + _used;
+                NetworkAgentTraceHeader::put_u64(p, clock() - _start);
+                NetworkAgentTraceHeader::put_u64(p + 8, session_id(session));
+                p[16] = head.protocol;
+                NetworkAgentWireHeader::put_u32(p + 17, head.payload_size);
+                NetworkAgentWireHeader::put_u32(p + 21, head.source_agent_id);
+                NetworkAgentWireHeader::put_u32(p + 25, head.target_agent_id);
+                _used += n;
+                _copying.fetch_add(1, std::memory_order_relaxed);
+                return p + NetworkAgentTraceHeader::RECORD_SIZE;
+            }
+
+            //unmap and cut the file to what was written, under the lock
+            void close_file()
+            {
+                _active.store(false, std::memory_order_relaxed);
+                //payloads reserved for are still being copied in
+                while(_copying.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                if(_map)
+                    munmap(_map, MAX_SIZE);
+                if(_fd >= 0)
+                {
+                    if(ftruncate(_fd, _used) < 0)
+                        LIBGCDNET_TRACE("capture: trace file not truncated, errno %d", errno);
+                    ::close(_fd);
+                }
+                _map = NULL;
+                _fd = -1;
+                _size = _used = 0;
+            }
+
+            std::atomic<int> _refcount;
+            std::atomic<bool> _active;
+            std::atomic<uint64_t> _next_session;
+            std::atomic<int> _copying; //records whose payload is copied in outside the lock
+
+            std::mutex _lock; //guards the file
+            int _fd;
+            unsigned char* _map;
+            size_t _size; //of the file
+            size_t _used; //written
+            uint64_t _start; //steady clock ns
+        };
+
+        /**
+         Trace File Reader
+         maps a trace read-only and walks its records. a capture that did not stop cleanly
+         leaves the file at its grown size, the trace ends at the first record that is
+         cut short or lies in the zero-filled tail (session 0 or not a package)
+         **/
+        class NetworkAgentTraceReader
+        {
+        public:
+            NetworkAgentTraceReader() : _fd(-1), _map(NULL), _size(0), _offset(0), _start(0){}
+
+            ~NetworkAgentTraceReader()
+            {
+                close();
+            }
+
+            //@return 0, an errno value or EINVAL if the file is no trace
+            int open(const char* path)
+            {
+                close();
+                _fd = ::open(path, O_RDONLY);
+                if(_fd < 0)
+                    return errno;
+
+                struct stat st;
+                if(fstat(_fd, &st) < 0 || (size_t)st.st_size < NetworkAgentTraceHeader::SIZE)
+                {
+                    close();
+                    return EINVAL;
+                }
+                void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+                if(m == MAP_FAILED)
+                {
+                    int error = errno;
+                    close();
+                    return error;
+                }
+                _map = (const unsigned char*)m;
+                _size = st.st_size;
+
+                if(memcmp(_map, NetworkAgentTraceHeader::magic(), 8) != 0 ||
+                   NetworkAgentWireHeader::get_u32(_map + 8) != NetworkAgentTraceHeader::VERSION ||
+                   NetworkAgentWireHeader::get_u32(_map + 12) != NetworkAgentTraceHeader::RECORD_SIZE)
+                {
+                    close();
+                    return EINVAL;
+                }
+                _start = NetworkAgentTraceHeader::get_u64(_map + 16);
+                _offset = NetworkAgentTraceHeader::SIZE;
+                return 0;
+            }
+
+            void close()
+            {
+                if(_map)
+                    munmap((void*)_map, _size);
+                if(_fd >= 0)
+                    ::close(_fd);
+                _map = NULL;
+                _fd = -1;
+                _size = _offset = 0;
+            }
+
+            //capture start, ns since the epoch
+            uint64_t start_time() const { return _start; }
+
+            bool next(NetworkAgentTraceRecord& r)
+            {
+                if(_size - _offset < NetworkAgentTraceHeader::RECORD_SIZE)
+                    return false;
+                const unsigned char* p = _map + _offset;
+                if(NetworkAgentTraceHeader::get_u64(p + 8) == 0 || p[16] != NetworkAgentWireHeader::PROTOCOL)
+                    return false;
+                size_t len = NetworkAgentWireHeader::get_u32(p + 17);
+                if(_size - _offset - NetworkAgentTraceHeader::RECORD_SIZE < len)
+                    return false;
+
+                r.time_ns = NetworkAgentTraceHeader::get_u64(p);
+                r.session = NetworkAgentTraceHeader::get_u64(p + 8);
+                r.head.protocol = p[16];
+                r.head.payload_size = len;
+                r.head.source_agent_id = NetworkAgentWireHeader::get_u32(p + 21);
+                r.head.target_agent_id = NetworkAgentWireHeader::get_u32(p + 25);
+                r.payload = (const char*)p + NetworkAgentTraceHeader::RECORD_SIZE;
+                _offset += NetworkAgentTraceHeader::RECORD_SIZE + len;
+                return true;
+            }
+
+            //back to the first record
+            void rewind()
+            {
+                if(_map)
+                    _offset = NetworkAgentTraceHeader::SIZE;
+            }
+
+        private:
+            NetworkAgentTraceReader(const NetworkAgentTraceReader&);
+            NetworkAgentTraceReader& operator=(const NetworkAgentTraceReader&);
+
+            int _fd;
+            const unsigned char* _map;
+            size_t _size;
+            size_t _offset;
+            uint64_t _start;
+        };
+}
+#endif
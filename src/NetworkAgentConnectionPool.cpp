@@ -0,0 +1,235 @@
+//
+//  NetworkAgentConnectionPool.cpp
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+
+#include "NetworkAgentConnectionPool.h"
+#include <errno.h>
+
+namespace libgcdnet {
+
+        NetworkAgentConnectionPool::NetworkAgentConnectionPool(NetworkAgent* agent, unsigned int min_idle, 
+                                                               unsigned int max_idle, unsigned int timeout_ms)
+        : _agent(agent), _min_idle(min_idle), _max_idle(max_idle < min_idle ? min_idle : max_idle), 
+          _timeout_ms(timeout_ms), _pending(0), _closing(false)
+        {
+        }
+
+        NetworkAgentConnectionPool::~NetworkAgentConnectionPool()
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            _closing = true;
+
+            //connects in flight call back into the pool, they end within the timeout
+            while(_pending)
+                _drained.wait(guard);
+
+            for(std::map<std::string, Host>::iterator it = _hosts.begin(); it != _hosts.end(); ++it)
+            {
+                std::list<Idle>& idle = it->second.idle;
+                for(std::list<Idle>::iterator i = idle.begin(); i != idle.end(); ++i)
+                {
+                    i->session->setDelegate(NULL);
+                    i->session->close();
+                }
+                idle.clear();
+            }
+            _idle_keys.clear();
+        }
+
+        std::string NetworkAgentConnectionPool::key(const char* hostname, const char* servname)
+        {
+            return std::string(hostname ? hostname : "") + ":" + servname;
+        }
+
+        NetworkAgentConnectionPool::Host& NetworkAgentConnectionPool::host(const std::string& k, const char* hostname, const char* servname)
+        {
+            std::map<std::string, Host>::iterator it = _hosts.find(k);
+            if(it != _hosts.end())
+                return it->second;
+
+            Host& h = _hosts[k];
+            h.hostname = hostname ? hostname : "";
+            h.servname = servname;
+            h.connecting = 0;
+            return h;
+        }
+
+        void NetworkAgentConnectionPool::acquire(const char* hostname, const char* servname, 
+                                                 NetworkAgentClientDelegate* delegate, NetworkAgentConnectHandler done) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            Host* h = &host(key(hostname, servname), hostname, servname);
+
+            if(!h->idle.empty())
+            {
+                Idle idle = h->idle.front();
+                h->idle.pop_front();
+                _idle_keys.erase(idle.session);
+                _pending++;
+
+                //posted under the lock, a close of the session waits for it in session_closed()
+                //and the deletion comes after this task on the session's context
+                idle.session->engine->async(idle.session, ^{
+                    hand_out(h, idle, delegate, done);
+                });
+                replenish(*h);
+                return;
+            }
+
+            replenish(*h);
+            _pending++;
+            guard.unlock();
+
+            try{
+                _agent->connect_async(hostname, servname, delegate, ^(NetworkAgentClientSession* s, int error){
+                    done(s, error);
+                    done_pending();
+                }, _timeout_ms);
+            }catch(NetworkAgentException e)
+            {
+                done_pending();
+                throw e;
+            }
+        }
+
+        void NetworkAgentConnectionPool::hand_out(Host* h, const Idle& idle, NetworkAgentClientDelegate* delegate, 
+                                                  NetworkAgentConnectHandler done)
+        {
+            NetworkAgentClientSession* s = idle.session;
+            if(s->closed)
+            {
+                //lost while on its way, try the next one
+                try{
+                    acquire(h->hostname.empty() ? NULL : h->hostname.c_str(), h->servname.c_str(), delegate, done);
+                }catch(NetworkAgentException e)
+                {
+                    done(NULL, EIO);
+                }
+            }
+            else
+            {
+                s->dispatcher = idle.dispatcher;
+                s->delegate = delegate;
+                if(delegate)
+                    delegate->connected(s);
+                done(s, 0);
+            }
+            done_pending();
+        }
+
+        void NetworkAgentConnectionPool::release(const char* hostname, const char* servname, NetworkAgentClientSession* session)
+        {
+            std::string k = key(hostname, servname);
+            Host* h;
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                h = &host(k, hostname, servname);
+                _pending++;
+            }
+
+            session->submit(^{
+                if(!session->closed)
+                    adopt(h, session);
+                done_pending();
+            });
+        }
+
+        void NetworkAgentConnectionPool::prewarm(const char* hostname, const char* servname)
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            replenish(host(key(hostname, servname), hostname, servname));
+        }
+
+        size_t NetworkAgentConnectionPool::idle(const char* hostname, const char* servname) const
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            std::map<std::string, Host>::const_iterator it = _hosts.find(key(hostname, servname));
+            return it == _hosts.end() ? 0 : it->second.idle.size();
+        }
+
+        void NetworkAgentConnectionPool::replenish(Host& h)
+        {
+            Host* hp = &h;
+            while(!_closing && h.idle.size() + h.connecting < _min_idle)
+            {
+                h.connecting++;
+                _pending++;
+                try{
+                    _agent->connect_async(h.hostname.empty() ? NULL : h.hostname.c_str(), h.servname.c_str(), NULL, 
+                                          ^(NetworkAgentClientSession* s, int error){
+                        {
+                            std::lock_guard<std::mutex> guard(_lock);
+                            hp->connecting--;
+                        }
+                        if(s)
+                            adopt(hp, s);
+                        done_pending();
+                    }, _timeout_ms);
+                }catch(NetworkAgentException e)
+                {
+                    h.connecting--;
+                    _pending--;
+                    break;
+                }
+            }
+        }
+
+        void NetworkAgentConnectionPool::adopt(Host* h, NetworkAgentClientSession* s)
+        {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                if(!_closing && h->idle.size() < _max_idle)
+                {
+                    //no dispatcher, data on an idle session must not relink it away from the pool
+                    Idle idle;
+                    idle.session = s;
+                    idle.dispatcher = s->dispatcher;
+                    h->idle.push_back(idle);
+                    _idle_keys[s] = key(h->hostname.empty() ? NULL : h->hostname.c_str(), h->servname.c_str());
+                    s->dispatcher = NULL;
+                    s->delegate = this;
+                    return;
+                }
+            }
+
+            s->delegate = NULL;
+            s->close();
+        }
+
+        void NetworkAgentConnectionPool::done_pending()
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            if(--_pending == 0)
+                _drained.notify_all();
+        }
+
+        void NetworkAgentConnectionPool::session_data_received(NetworkAgentClientSession* session)
+        {
+            //nobody asked for it, drop it
+            std::string data;
+            session->read_data(data);
+        }
+
+        void NetworkAgentConnectionPool::session_closed(NetworkAgentClientSession* session)
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            std::map<NetworkAgentClientSession*, std::string>::iterator it = _idle_keys.find(session);
+            if(it == _idle_keys.end())
+                return;
+
+            Host& h = _hosts[it->second];
+            _idle_keys.erase(it);
+            for(std::list<Idle>::iterator i = h.idle.begin(); i != h.idle.end(); ++i)
+            {
+                if(i->session == session)
+                {
+                    h.idle.erase(i);
+                    break;
+                }
+            }
+            replenish(h);
+        }
+
+}
@@ -0,0 +1,95 @@
+//
+//  NetworkAgentConnectionPool.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_CONNECTION_POOL_H
+#define LIBGCDNET_ENGINE_NETWORK_CONNECTION_POOL_H
+
+#include <map>
+#include <list>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include "NetworkAgent.h"
+
+namespace libgcdnet{
+
+        /**
+         Client Connection Pool
+         keeps connected sessions of a CLIENT agent per host:port and hands them out
+         warm, so a short request does not pay for a connect. at least min_idle sessions
+         are kept connected per host once it was asked for, idle sessions beyond max_idle
+         are closed when given back. the pool is the delegate of its idle sessions.
+         not to be destroyed from within an I/O context, it waits for its pending connects
+         **/
+        class NetworkAgentConnectionPool : public NetworkAgentClientDelegate
+        {
+        public:
+            NetworkAgentConnectionPool(NetworkAgent* agent, unsigned int min_idle = 1, 
+                                       unsigned int max_idle = 8, unsigned int timeout_ms = 3000);
+            ~NetworkAgentConnectionPool();
+
+            //a connected session to hostname:servname, idle if there is one. done runs on the session's
+            //context with delegate installed and told connected(), or with NULL and an errno value
+            void acquire(const char* hostname, const char* servname, 
+                         NetworkAgentClientDelegate* delegate, NetworkAgentConnectHandler done) LIBGCDNET_THROWS(NetworkAgentException);
+
+            //give a session acquired for hostname:servname back, the caller must not touch it afterwards.
+            //sessions closed in the meantime are simply dropped
+            void release(const char* hostname, const char* servname, NetworkAgentClientSession* session);
+
+            //connect until min_idle sessions are idle
+            void prewarm(const char* hostname, const char* servname);
+
+            size_t idle(const char* hostname, const char* servname) const;
+
+            //delegate of the idle sessions
+            unsigned int agent_id() const { return 0; }
+            void closed(){}
+            void connected(NetworkAgentClientSession* request){}
+            void data_received(){}
+            void data_sent(){}
+            void session_data_received(NetworkAgentClientSession* session);
+            void session_closed(NetworkAgentClientSession* session);
+
+        private:
+            struct Idle
+            {
+                NetworkAgentClientSession* session;
+                NetworkAgentDispatcherDelegate* dispatcher; //put back when handed out
+            };
+
+            struct Host
+            {
+                std::string hostname;
+                std::string servname;
+                std::list<Idle> idle;
+                unsigned int connecting; //prewarming connects in flight
+            };
+
+            static std::string key(const char* hostname, const char* servname);
+            Host& host(const std::string& k, const char* hostname, const char* servname); //under _lock
+            void replenish(Host& h); //under _lock
+            void adopt(Host* h, NetworkAgentClientSession* s); //on the session's context
+            void hand_out(Host* h, const Idle& idle, NetworkAgentClientDelegate* delegate, 
+                          NetworkAgentConnectHandler done); //on the session's context
+            void done_pending();
+
+            NetworkAgentConnectionPool(const NetworkAgentConnectionPool&);
+            NetworkAgentConnectionPool& operator=(const NetworkAgentConnectionPool&);
+
+            NetworkAgent* _agent;
+            unsigned int _min_idle;
+            unsigned int _max_idle;
+            unsigned int _timeout_ms;
+
+            mutable std::mutex _lock;
+            std::condition_variable _drained;
+            std::map<std::string, Host> _hosts;
+            std::map<NetworkAgentClientSession*, std::string> _idle_keys; //host of every idle session
+            unsigned int _pending; //connects and hand outs still to call back into the pool
+            bool _closing;
+        };
+}
+#endif
@@ -0,0 +1,267 @@
+//
+//  NetworkAgentCoroutine.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_COROUTINE_H
+#define LIBGCDNET_ENGINE_NETWORK_COROUTINE_H
+
+#if __cplusplus < 202002L
+#error "NetworkAgentCoroutine.h needs C++20 coroutines, build with -std=c++20"
+#endif
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <coroutine>
+#include "NetworkAgent.h"
+
+namespace libgcdnet{
+
+        /**
+         Detached Coroutine
+         return type of coroutines driving sessions. runs right away on the caller's thread
+         up to its first suspension and frees its frame once it returns. an exception escaping
+         the coroutine terminates the process, like one escaping a thread
+         **/
+        struct NetworkAgentCoroutine
+        {
+            struct promise_type
+            {
+                NetworkAgentCoroutine get_return_object() { return NetworkAgentCoroutine(); }
+                std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+                std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+                void return_void(){}
+                void unhandled_exception() { std::terminate(); }
+            };
+        };
+
+        //a package read by a coroutine, the reader owns the reference to the payload.
+        //payload is NULL once the session closed and everything received was read
+        struct NetworkAgentCoFrame
+        {
+            NetworkAgentPackageHead head;
+            NetworkAgentPayload* payload;
+        };
+
+        /**
+         Coroutine Access to a Session
+         becomes the session's delegate and lets a coroutine read and write packages with
+         co_await. reads and writes are awaited on the session's context, co_await schedule()
+         gets there once. from then on the session's own handlers resume the coroutine: a
+         package arriving runs a waiting reader inline, the write queue draining below its low
+         watermark a waiting writer, no task is posted in between. one reader and one writer
+         at a time. reference counted, the session keeps it alive until closed
+         **/
+        class NetworkAgentCoSession final : public NetworkAgentClientDelegate
+        {
+        public:
+            struct ScheduleAwaiter
+            {
+                NetworkAgentCoSession* co;
+
+                bool await_ready() const noexcept { return false; }
+
+                //posted under the lock like the RPC client's calls, the session outlives the task
+                bool await_suspend(std::coroutine_handle<> h)
+                {
+                    std::lock_guard<std::mutex> guard(co->_lock);
+                    NetworkAgentClientSession* s = co->_session;
+                    if(!s)
+                        return false; //closed, carry on where we are
+                    s->engine->async(s, ^{
+                        h.resume();
+                    });
+                    return true;
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+            struct ReadAwaiter
+            {
+                NetworkAgentCoSession* co;
+
+                bool await_ready() const noexcept { return !co->_frames.empty() || co->_closed; }
+                void await_suspend(std::coroutine_handle<> h) noexcept { co->_reader = h; }
+
+                NetworkAgentCoFrame await_resume() noexcept
+                {
+                    NetworkAgentCoFrame f;
+                    if(co->_frames.empty())
+                    {
+                        memset(&f.head, 0, sizeof(f.head));
+                        f.payload = NULL;
+                        return f;
+                    }
+                    f = co->_frames.front();
+                    co->_frames.pop_front();
+                    return f;
+                }
+            };
+
+            struct WriteAwaiter
+            {
+                NetworkAgentCoSession* co;
+                bool queued;
+
+                bool await_ready() const noexcept { return !queued || co->_closed || co->_session->writable(); }
+                void await_suspend(std::coroutine_handle<> h) noexcept { co->_writer = h; }
+
+                //false if the package was dropped or the session closed since
+                bool await_resume() const noexcept { return queued && !co->_closed; }
+            };
+
+            //from any thread, blocks until the session's context took the delegate over
+            NetworkAgentCoSession(NetworkAgentClientSession* session, unsigned int agent_id)
+            : _refcount(1), _agent_id(agent_id), _session(session), _closed(false)
+            {
+                //the session's reference, dropped in session_closed()
+                retain();
+                session->engine->sync(session, ^{
+                    if(session->closed)
+                    {
+                        _closed = true;
+                        _session = NULL;
+                        release();
+                        return;
+                    }
+                    session->delegate = this;
+                });
+            }
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            //resume on the session's context, right where it is once closed
+            ScheduleAwaiter schedule()
+            {
+                ScheduleAwaiter a = {this};
+                return a;
+            }
+
+            //the oldest package not read yet, on the session's context
+            ReadAwaiter read_frame()
+            {
+                ReadAwaiter a = {this};
+                return a;
+            }
+
+            //queue a package right away, taking over the reference to the payload, on the session's
+            //context. awaiting it waits while the session is past its write watermark
+            WriteAwaiter write(unsigned int source_agent_id, unsigned int target_agent_id, NetworkAgentPayload* payload)
+            {
+                WriteAwaiter a = {this, false};
+                if(_closed)
+                {
+                    payload->release();
+                    return a;
+                }
+                NetworkAgentPackageHead header;
+                header.protocol = NetworkAgentWireHeader::PROTOCOL;
+                header.payload_size = payload->size();
+                header.source_agent_id = source_agent_id;
+                header.target_agent_id = target_agent_id;
+                NetworkAgentWireHead head;
+                NetworkAgentWireHeader::encode(header, head.bytes);
+                _session->enqueue(head, payload);
+                a.queued = true;
+                return a;
+            }
+
+            //same, the data is copied
+            WriteAwaiter write(unsigned int source_agent_id, unsigned int target_agent_id, const char* data, size_t len)
+            {
+                WriteAwaiter a = {this, false};
+                if(_closed)
+                    return a;
+                _session->enqueue(source_agent_id, target_agent_id, data, len);
+                a.queued = true;
+                return a;
+            }
+
+            //close the session from any thread, a waiting reader gets a NULL payload
+            void close()
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                if(_session)
+                    _session->close();
+            }
+
+            //delegate of the session, on its context
+            unsigned int agent_id() const { return _agent_id; }
+            void closed(){}
+            void connected(NetworkAgentClientSession* request){}
+            void data_received(){}
+            void data_sent(){}
+            bool accepts_payloads() const { return true; }
+
+            void payload_received(NetworkAgentClientSession* session, const NetworkAgentPackageHead& head,
+                                  NetworkAgentPayload* payload)
+            {
+                NetworkAgentCoFrame f;
+                f.head = head;
+                f.payload = payload;
+                _frames.push_back(f);
+                resume(_reader);
+            }
+
+            void write_resumed(NetworkAgentClientSession* session)
+            {
+                resume(_writer);
+            }
+
+            void session_closed(NetworkAgentClientSession* session)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _session = NULL;
+                }
+                _closed = true;
+                resume(_reader);
+                resume(_writer);
+                release();
+            }
+
+        private:
+            ~NetworkAgentCoSession()
+            {
+                for(size_t i=0; i<_frames.size(); i++)
+                    _frames[i].payload->release();
+            }
+
+            static void resume(std::coroutine_handle<>& waiting)
+            {
+                if(!waiting)
+                    return;
+                std::coroutine_handle<> h = waiting;
+                waiting = std::coroutine_handle<>();
+                h.resume();
+            }
+
+            NetworkAgentCoSession(const NetworkAgentCoSession&);
+            NetworkAgentCoSession& operator=(const NetworkAgentCoSession&);
+
+            std::atomic<int> _refcount;
+            unsigned int _agent_id;
+            std::mutex _lock; //guards _session against the close
+            NetworkAgentClientSession* _session; //NULL once closed
+
+            //on the session's context
+            bool _closed;
+            std::deque<NetworkAgentCoFrame> _frames; //received, not read yet
+            std::coroutine_handle<> _reader;
+            std::coroutine_handle<> _writer;
+        };
+}
+#endif
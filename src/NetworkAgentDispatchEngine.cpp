@@ -0,0 +1,263 @@
+//
+//  NetworkAgentDispatchEngine.cpp
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+
+#include "NetworkAgentDispatchEngine.h"
+#include <sstream>
+#include <unistd.h> //close()
+
+namespace libgcdnet {
+
+        //queue specific key, tags each shard queue with itself
+        static char shard_queue_key;
+
+        NetworkAgentDispatchEngine::NetworkAgentDispatchEngine(const std::vector<NetworkAgentShard>& shards)
+        {
+            for(size_t i=0; i<shards.size(); i++)
+            {
+                std::ostringstream label;
+                label << "libgcdnet.engine.network.shard." << shards[i].index;
+                dispatch_queue_t q = dispatch_queue_create(label.str().c_str(), NULL);
+                dispatch_queue_set_specific(q, &shard_queue_key, q, NULL);
+                _queues.push_back(q);
+            }
+
+            _listener_queue = dispatch_queue_create("libgcdnet.engine.NetworkAgent", NULL);
+            dispatch_queue_set_specific(_listener_queue, &shard_queue_key, _listener_queue, NULL);
+        }
+
+        NetworkAgentDispatchEngine::~NetworkAgentDispatchEngine()
+        {
+            //cancel handlers close the listening sockets
+            for(size_t i=0; i<_listeners.size(); i++)
+            {
+                dispatch_source_cancel(_listeners[i].source);
+                dispatch_release(_listeners[i].source);
+            }
+
+            //queued blocks keep their queue alive until they are done
+            dispatch_release(_listener_queue);
+            for(size_t i=0; i<_queues.size(); i++)
+                dispatch_release(_queues[i]);
+        }
+
+        /**
+         1. Create a read/write dispatch source over the socket on the session's shard queue
+         2. Read source is active right away
+         3. Write source is suspended until a write request comes from agents
+         **/
+        void NetworkAgentDispatchEngine::attach(NetworkAgentClientSession* s) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            dispatch_queue_t q = _queues[s->context];
+
+            s->r_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, s->sock, 0, q);
+            if(!s->r_source)
+                throw NetworkAgentException("failed to create read source");
+
+            s->w_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, s->sock, 0, q);
+            if(!s->w_source)
+            {
+                dispatch_release(s->r_source);
+                s->r_source = NULL;
+                throw NetworkAgentException("failed to create write source");
+            }
+
+            //read handler, the source data estimates the bytes pending on the socket
+            dispatch_source_t r_source = s->r_source;
+            dispatch_source_set_event_handler(s->r_source, ^{
+                handle_read(s, dispatch_source_get_data(r_source));
+            });
+
+            //write handler
+            dispatch_source_set_event_handler(s->w_source, ^{
+                handle_write(s);
+            });
+
+            //the socket is only closed after both sources are cancelled
+            s->sources_alive = 2;
+            dispatch_source_set_cancel_handler(s->r_source, ^{
+                source_cancelled(s);
+            });
+            dispatch_source_set_cancel_handler(s->w_source, ^{
+                source_cancelled(s);
+            });
+
+            //activate the read source, the write source stays suspended
+            dispatch_resume(s->r_source);
+            s->w_source_suspended = true;
+        }
+
+        void NetworkAgentDispatchEngine::source_cancelled(NetworkAgentClientSession* s)
+        {
+            if(--s->sources_alive > 0)
+                return;
+
+            close(s->sock);
+            dispatch_release(s->r_source);
+            dispatch_release(s->w_source);
+
+            //both cancel handlers run on the shard queue after whatever was submitted
+            //before the cancellation, no handler block can touch the session anymore
+            NetworkAgentClientSession::dispose(s);
+        }
+
+        void NetworkAgentDispatchEngine::detach(NetworkAgentClientSession* s)
+        {
+            //a suspended source never delivers its cancel handler
+            if(s->w_source_suspended)
+            {
+                dispatch_resume(s->w_source);
+                s->w_source_suspended = false;
+            }
+            if(s->r_source_suspended)
+            {
+                dispatch_resume(s->r_source);
+                s->r_source_suspended = false;
+            }
+            dispatch_source_cancel(s->r_source);
+            dispatch_source_cancel(s->w_source);
+        }
+
+        void NetworkAgentDispatchEngine::want_write(NetworkAgentClientSession* s, bool on)
+        {
+            if(on && s->w_source_suspended)
+            {
+                dispatch_resume(s->w_source);
+                s->w_source_suspended = false;
+            }
+            else if(!on && !s->w_source_suspended)
+            {
+                dispatch_suspend(s->w_source);
+                s->w_source_suspended = true;
+            }
+        }
+
+        void NetworkAgentDispatchEngine::want_read(NetworkAgentClientSession* s, bool on)
+        {
+            //a resumed read source fires again right away if bytes are still pending
+            if(on && s->r_source_suspended)
+            {
+                dispatch_resume(s->r_source);
+                s->r_source_suspended = false;
+            }
+            else if(!on && !s->r_source_suspended)
+            {
+                dispatch_suspend(s->r_source);
+                s->r_source_suspended = true;
+            }
+        }
+
+        void NetworkAgentDispatchEngine::async(NetworkAgentClientSession* s, NetworkAgentTask task)
+        {
+            dispatch_async(_queues[s->context], task);
+        }
+
+        void NetworkAgentDispatchEngine::sync(NetworkAgentClientSession* s, NetworkAgentTask task)
+        {
+            //a delegate reading from within data_received() is already on the queue
+            dispatch_queue_t q = _queues[s->context];
+            if(dispatch_get_specific(&shard_queue_key) == q)
+                task();
+            else
+                dispatch_sync(q, task);
+        }
+
+        void NetworkAgentDispatchEngine::add_listener(int listen_sock, int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            dispatch_queue_t q = context < 0 ? _listener_queue : _queues[context];
+            dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, listen_sock, 0, q);
+            if(!source)
+            {
+                close(listen_sock);
+                throw NetworkAgentException("failed to create listener source");
+            }
+
+            dispatch_source_set_event_handler(source, on_ready);
+            dispatch_source_set_cancel_handler(source, ^{
+                close(listen_sock);
+            });
+            dispatch_resume(source);
+
+            Listener l = {listen_sock, source, q};
+            std::lock_guard<std::mutex> guard(_listeners_lock);
+            _listeners.push_back(l);
+        }
+
+        void NetworkAgentDispatchEngine::remove_listener(int listen_sock)
+        {
+            std::unique_lock<std::mutex> guard(_listeners_lock);
+            for(size_t i=0; i<_listeners.size(); i++)
+            {
+                if(_listeners[i].sock != listen_sock)
+                    continue;
+                Listener l = _listeners[i];
+                _listeners.erase(_listeners.begin() + i);
+                guard.unlock();
+
+                //no event handler starts after the cancel, the cancel handler closes the socket.
+                //one running on its queue right now is waited for, unless that is us
+                dispatch_source_cancel(l.source);
+                if(dispatch_get_specific(&shard_queue_key) != l.queue)
+                    dispatch_sync(l.queue, ^{});
+                dispatch_release(l.source);
+                return;
+            }
+        }
+
+        void NetworkAgentDispatchEngine::pause_listener(int listen_sock, uint64_t delay_ns)
+        {
+            Listener l = {-1, NULL, NULL};
+            {
+                std::lock_guard<std::mutex> guard(_listeners_lock);
+                for(size_t i=0; i<_listeners.size() && !l.source; i++)
+                    if(_listeners[i].sock == listen_sock)
+                        l = _listeners[i];
+            }
+            if(!l.source)
+                return;
+
+            //a suspended source must not lose its last reference, the resume holds one
+            dispatch_retain(l.source);
+            dispatch_suspend(l.source);
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay_ns), l.queue, ^{
+                dispatch_resume(l.source);
+                dispatch_release(l.source);
+            });
+        }
+
+        void NetworkAgentDispatchEngine::post(unsigned int context, NetworkAgentTask task)
+        {
+            dispatch_async(_queues[context], task);
+        }
+
+        void NetworkAgentDispatchEngine::after(unsigned int context, uint64_t delay_ns, NetworkAgentTask task)
+        {
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay_ns), _queues[context], task);
+        }
+
+        void* NetworkAgentDispatchEngine::watch_writable(int sock, unsigned int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, sock, 0, _queues[context]);
+            if(!source)
+                throw NetworkAgentException("failed to create write source");
+
+            //no cancel handler, the socket is not the source's to close
+            dispatch_source_set_event_handler(source, ^{
+                dispatch_source_cancel(source);
+                dispatch_release(source);
+                on_ready();
+            });
+            dispatch_resume(source);
+            return source;
+        }
+
+        void NetworkAgentDispatchEngine::unwatch(void* watch)
+        {
+            dispatch_source_t source = (dispatch_source_t)watch;
+            dispatch_source_cancel(source);
+            dispatch_release(source);
+        }
+
+}
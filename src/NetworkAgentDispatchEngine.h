@@ -0,0 +1,67 @@
+//
+//  NetworkAgentDispatchEngine.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_DISPATCH_ENGINE_H
+#define LIBGCDNET_ENGINE_NETWORK_DISPATCH_ENGINE_H
+
+#include <vector>
+#include <mutex>
+#include <dispatch/dispatch.h>
+#include "NetworkAgent.h"
+
+namespace libgcdnet{
+
+        /**
+         GCD I/O Engine
+         one serial dispatch queue per shard, every session gets a read and a write
+         dispatch source targeting the queue of its shard. listeners without a shard
+         share the engine's own listener queue
+         **/
+        class NetworkAgentDispatchEngine : public NetworkAgentEngine
+        {
+        public:
+            NetworkAgentDispatchEngine(const std::vector<NetworkAgentShard>& shards);
+
+            Kind kind() const { return DISPATCH; }
+            unsigned int contexts() const { return _queues.size(); }
+
+            void attach(NetworkAgentClientSession* s) LIBGCDNET_THROWS(NetworkAgentException);
+            void detach(NetworkAgentClientSession* s);
+            void want_write(NetworkAgentClientSession* s, bool on);
+            void want_read(NetworkAgentClientSession* s, bool on);
+
+            void async(NetworkAgentClientSession* s, NetworkAgentTask task);
+            void sync(NetworkAgentClientSession* s, NetworkAgentTask task);
+
+            void add_listener(int listen_sock, int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException);
+            void remove_listener(int listen_sock);
+            void pause_listener(int listen_sock, uint64_t delay_ns);
+
+            void post(unsigned int context, NetworkAgentTask task);
+            void after(unsigned int context, uint64_t delay_ns, NetworkAgentTask task);
+            void* watch_writable(int sock, unsigned int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException);
+            void unwatch(void* watch);
+
+        protected:
+            ~NetworkAgentDispatchEngine();
+
+        private:
+            struct Listener
+            {
+                int sock;
+                dispatch_source_t source;
+                dispatch_queue_t queue;
+            };
+
+            //session gone once both its sources went through their cancel handler
+            static void source_cancelled(NetworkAgentClientSession* s);
+
+            std::vector<dispatch_queue_t> _queues; //serial queue per shard
+            dispatch_queue_t _listener_queue; //accept sources of listeners without a shard
+            std::mutex _listeners_lock; //pause_listener() looks them up on the listener's context
+            std::vector<Listener> _listeners;
+        };
+}
+#endif
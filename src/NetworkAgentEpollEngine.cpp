@@ -0,0 +1,393 @@
+//
+//  NetworkAgentEpollEngine.cpp
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+
+#include "NetworkAgentEpollEngine.h"
+
+#ifdef __linux__
+
+#include <Block.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h> //close()
+
+namespace libgcdnet {
+
+        __thread NetworkAgentEpollEngine::Worker* NetworkAgentEpollEngine::_current = NULL;
+
+        //session sockets are always watched for input, edge triggered
+        static const unsigned int SESSION_EVENTS = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        //reading paused by flow control, a hangup is still worth a wakeup
+        static const unsigned int PAUSED_EVENTS = EPOLLRDHUP | EPOLLET;
+
+        NetworkAgentEpollEngine::NetworkAgentEpollEngine(const std::vector<NetworkAgentShard>& shards) LIBGCDNET_THROWS(NetworkAgentException)
+        : _stop(false)
+        {
+            for(size_t i=0; i<shards.size(); i++)
+            {
+                Worker* w = new Worker;
+                w->engine = this;
+                w->cpu = shards[i].cpu;
+                w->epfd = epoll_create1(EPOLL_CLOEXEC);
+                _workers.push_back(w);
+
+                if(w->epfd < 0 || !w->tasks.valid())
+                {
+                    //no thread started yet, only descriptors to give back
+                    for(size_t j=0; j<_workers.size(); j++)
+                    {
+                        if(_workers[j]->epfd >= 0)
+                            close(_workers[j]->epfd);
+                        delete _workers[j];
+                    }
+                    throw NetworkAgentException("failed to create epoll set");
+                }
+
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.ptr = NULL;
+                epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->tasks.fd(), &ev);
+            }
+
+            for(size_t i=0; i<_workers.size(); i++)
+                _workers[i]->thread = std::thread(&NetworkAgentEpollEngine::run, this, _workers[i]);
+        }
+
+        NetworkAgentEpollEngine::~NetworkAgentEpollEngine()
+        {
+            _stop.store(true, std::memory_order_release);
+
+            for(size_t i=0; i<_workers.size(); i++)
+            {
+                Worker* w = _workers[i];
+                if(w->thread.joinable())
+                {
+                    w->tasks.wake();
+                    w->thread.join();
+                }
+
+                for(size_t j=0; j<w->listeners.size(); j++)
+                {
+                    close(w->listeners[j]->sock);
+                    Block_release(w->listeners[j]->on_ready);
+                    delete w->listeners[j];
+                }
+
+                if(w->epfd >= 0)
+                    close(w->epfd);
+                delete w;
+            }
+            _workers.clear();
+        }
+
+        void NetworkAgentEpollEngine::destroy()
+        {
+            if(_current && _current->engine == this)
+                std::thread([this]{ delete this; }).detach();
+            else
+                delete this;
+        }
+
+        //event loop of one shard
+        void NetworkAgentEpollEngine::run(Worker* w)
+        {
+            _current = w;
+
+            if(w->cpu >= 0)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(w->cpu, &set);
+                pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            }
+
+            struct epoll_event events[MAX_EVENTS];
+            while(!_stop.load(std::memory_order_acquire))
+            {
+                int n = epoll_wait(w->epfd, events, MAX_EVENTS, w->timers.timeout_ms());
+                if(n < 0)
+                {
+                    if(errno == EINTR)
+                        continue;
+                    //the epoll set is unusable, leaving the loop would hang the shard for good
+                    fprintf(stderr, "libgcdnet: epoll_wait failed on a shard worker: %s\n", strerror(errno));
+                    abort();
+                }
+
+                for(int i=0; i<n; i++)
+                {
+                    void* tag = events[i].data.ptr;
+                    unsigned int ev = events[i].events;
+
+                    //wakeup for posted tasks, they run after the batch
+                    if(!tag)
+                    {
+                        w->tasks.ack();
+                        continue;
+                    }
+
+                    //listening socket, tagged with the low bit
+                    if((uintptr_t)tag & 1)
+                    {
+                        Listener* l = (Listener*)((uintptr_t)tag & ~(uintptr_t)1);
+                        if(!l->removed)
+                            l->on_ready();
+                        continue;
+                    }
+
+                    //writable watch, tagged with the second bit
+                    if((uintptr_t)tag & 2)
+                    {
+                        Watch* watch = (Watch*)((uintptr_t)tag & ~(uintptr_t)2);
+                        if(!watch->done)
+                        {
+                            retire(w, watch);
+                            watch->on_ready();
+                        }
+                        continue;
+                    }
+
+                    //a session closed earlier in this batch is only deleted by drain()
+                    NetworkAgentClientSession* s = (NetworkAgentClientSession*)tag;
+                    if(ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    {
+                        //a short read ends the loop, a hangup that came along with the data
+                        //gets no edge of its own, read on until the end of the stream is seen
+                        bool hangup = ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+                        while(handle_read(s, 0) || (hangup && !s->closed && s->reading()));
+                    }
+                    if((ev & EPOLLOUT) && !s->closed && s->w_active)
+                        handle_write(s);
+                }
+
+                w->tasks.drain();
+                w->timers.run_expired();
+            }
+
+            w->tasks.drain();
+        }
+
+        void NetworkAgentEpollEngine::attach(NetworkAgentClientSession* s) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            struct epoll_event ev;
+            ev.events = SESSION_EVENTS;
+            ev.data.ptr = s;
+            s->io_events = SESSION_EVENTS;
+            if(epoll_ctl(_workers[s->context]->epfd, EPOLL_CTL_ADD, s->sock, &ev) < 0)
+                throw NetworkAgentException("failed to register socket with epoll");
+        }
+
+        void NetworkAgentEpollEngine::detach(NetworkAgentClientSession* s)
+        {
+            Worker* w = _workers[s->context];
+            epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->sock, NULL);
+            close(s->sock);
+
+            //events of the current batch and tasks posted before still see a valid
+            //(closed) session, the deletion runs after them
+            w->tasks.post(^{
+                NetworkAgentClientSession::dispose(s);
+            });
+        }
+
+        void NetworkAgentEpollEngine::want_write(NetworkAgentClientSession* s, bool on)
+        {
+            modify(s, (s->reading() ? SESSION_EVENTS : PAUSED_EVENTS) | (on ? EPOLLOUT : 0));
+        }
+
+        void NetworkAgentEpollEngine::want_read(NetworkAgentClientSession* s, bool on)
+        {
+            modify(s, (on ? SESSION_EVENTS : PAUSED_EVENTS) | (s->w_active ? EPOLLOUT : 0));
+        }
+
+        void NetworkAgentEpollEngine::modify(NetworkAgentClientSession* s, unsigned int events)
+        {
+            if(events == s->io_events)
+                return;
+
+            //re-arming reports a socket that is already readable/writable right away
+            struct epoll_event ev;
+            ev.events = events;
+            ev.data.ptr = s;
+            if(epoll_ctl(_workers[s->context]->epfd, EPOLL_CTL_MOD, s->sock, &ev) == 0)
+                s->io_events = events;
+        }
+
+        void NetworkAgentEpollEngine::async(NetworkAgentClientSession* s, NetworkAgentTask task)
+        {
+            _workers[s->context]->tasks.post(task);
+        }
+
+        void NetworkAgentEpollEngine::sync(NetworkAgentClientSession* s, NetworkAgentTask task)
+        {
+            Worker* w = _workers[s->context];
+            if(_current == w)
+            {
+                task();
+                return;
+            }
+
+            w->tasks.post_and_wait(task);
+        }
+
+        void NetworkAgentEpollEngine::add_listener(int listen_sock, int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            Worker* w = _workers[context < 0 ? 0 : context];
+
+            Listener* l = new Listener;
+            l->sock = listen_sock;
+            l->removed = false;
+            l->on_ready = Block_copy(on_ready);
+
+            //level triggered, a backlog the accept loop could not drain fires again
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = (void*)((uintptr_t)l | 1);
+            if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, listen_sock, &ev) < 0)
+            {
+                close(listen_sock);
+                Block_release(l->on_ready);
+                delete l;
+                throw NetworkAgentException("failed to register listening socket with epoll");
+            }
+
+            std::lock_guard<std::mutex> guard(w->lock);
+            w->listeners.push_back(l);
+        }
+
+        void NetworkAgentEpollEngine::remove_listener(int listen_sock)
+        {
+            for(size_t i=0; i<_workers.size(); i++)
+            {
+                Worker* w = _workers[i];
+                Listener* l = NULL;
+                {
+                    std::lock_guard<std::mutex> guard(w->lock);
+                    for(size_t j=0; j<w->listeners.size() && !l; j++)
+                        if(w->listeners[j]->sock == listen_sock)
+                        {
+                            l = w->listeners[j];
+                            w->listeners.erase(w->listeners.begin() + j);
+                        }
+                }
+                if(!l)
+                    continue;
+
+                //on the worker, so that no on_ready is running meanwhile
+                NetworkAgentTask drop = ^{
+                    l->removed = true;
+                    epoll_ctl(w->epfd, EPOLL_CTL_DEL, l->sock, NULL);
+                    close(l->sock);
+
+                    //an event of the current batch may still point at it
+                    w->tasks.post(^{
+                        Block_release(l->on_ready);
+                        delete l;
+                    });
+                };
+                if(_current == w)
+                    drop();
+                else
+                    w->tasks.post_and_wait(drop);
+                return;
+            }
+        }
+
+        void NetworkAgentEpollEngine::pause_listener(int listen_sock, uint64_t delay_ns)
+        {
+            Worker* w = _current;
+            Listener* l = NULL;
+            {
+                std::lock_guard<std::mutex> guard(w->lock);
+                for(size_t j=0; j<w->listeners.size() && !l; j++)
+                    if(w->listeners[j]->sock == listen_sock)
+                        l = w->listeners[j];
+            }
+            if(!l)
+                return;
+
+            //registered with no events, level triggered it fires again once re-armed
+            struct epoll_event ev;
+            ev.events = 0;
+            ev.data.ptr = (void*)((uintptr_t)l | 1);
+            epoll_ctl(w->epfd, EPOLL_CTL_MOD, listen_sock, &ev);
+
+            w->timers.schedule(delay_ns, ^{
+                //removed meanwhile, it is no longer listed
+                std::lock_guard<std::mutex> guard(w->lock);
+                for(size_t j=0; j<w->listeners.size(); j++)
+                    if(w->listeners[j] == l)
+                    {
+                        struct epoll_event ev;
+                        ev.events = EPOLLIN;
+                        ev.data.ptr = (void*)((uintptr_t)l | 1);
+                        epoll_ctl(w->epfd, EPOLL_CTL_MOD, l->sock, &ev);
+                    }
+            });
+        }
+
+        void NetworkAgentEpollEngine::post(unsigned int context, NetworkAgentTask task)
+        {
+            _workers[context]->tasks.post(task);
+        }
+
+        void NetworkAgentEpollEngine::after(unsigned int context, uint64_t delay_ns, NetworkAgentTask task)
+        {
+            //the timer queue belongs to its worker
+            Worker* w = _workers[context];
+            if(_current == w)
+                w->timers.schedule(delay_ns, task);
+            else
+                w->tasks.post(^{
+                    w->timers.schedule(delay_ns, task);
+                });
+        }
+
+        void* NetworkAgentEpollEngine::watch_writable(int sock, unsigned int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            Watch* watch = new Watch;
+            watch->sock = sock;
+            watch->epfd = _workers[context]->epfd;
+            watch->done = false;
+            watch->on_ready = Block_copy(on_ready);
+
+            struct epoll_event ev;
+            ev.events = EPOLLOUT | EPOLLONESHOT;
+            ev.data.ptr = (void*)((uintptr_t)watch | 2);
+            if(epoll_ctl(watch->epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+            {
+                Block_release(watch->on_ready);
+                delete watch;
+                throw NetworkAgentException("failed to register socket with epoll");
+            }
+            return watch;
+        }
+
+        void NetworkAgentEpollEngine::unwatch(void* watch)
+        {
+            retire(_current, (Watch*)watch);
+        }
+
+        void NetworkAgentEpollEngine::retire(Worker* w, Watch* watch)
+        {
+            watch->done = true;
+            epoll_ctl(watch->epfd, EPOLL_CTL_DEL, watch->sock, NULL);
+
+            //an event of the current batch may still point at it
+            w->tasks.post(^{
+                Block_release(watch->on_ready);
+                delete watch;
+            });
+        }
+
+}
+
+#endif
@@ -0,0 +1,106 @@
+//
+//  NetworkAgentEpollEngine.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_EPOLL_ENGINE_H
+#define LIBGCDNET_ENGINE_NETWORK_EPOLL_ENGINE_H
+
+#ifdef __linux__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "NetworkAgent.h"
+#include "NetworkAgentTaskQueue.h"
+#include "NetworkAgentTimerQueue.h"
+
+namespace libgcdnet{
+
+        /**
+         Native epoll I/O Engine
+         one worker thread per shard, each blocking in epoll_wait on its own epoll set.
+         session sockets are registered edge triggered and read until a short read, or to
+         the end of the stream once the peer hung up, so a readable socket costs a single
+         wakeup no matter how much data is pending.
+         tasks submitted to a shard are queued and run by its worker after each batch
+         of events, an eventfd wakes the worker up when it is idle
+         **/
+        class NetworkAgentEpollEngine : public NetworkAgentEngine
+        {
+        public:
+            static const int MAX_EVENTS = 256; //events taken per epoll_wait
+
+            NetworkAgentEpollEngine(const std::vector<NetworkAgentShard>& shards) LIBGCDNET_THROWS(NetworkAgentException);
+
+            Kind kind() const { return EPOLL; }
+            unsigned int contexts() const { return _workers.size(); }
+
+            void attach(NetworkAgentClientSession* s) LIBGCDNET_THROWS(NetworkAgentException);
+            void detach(NetworkAgentClientSession* s);
+            void want_write(NetworkAgentClientSession* s, bool on);
+            void want_read(NetworkAgentClientSession* s, bool on);
+
+            void async(NetworkAgentClientSession* s, NetworkAgentTask task);
+            void sync(NetworkAgentClientSession* s, NetworkAgentTask task);
+
+            void add_listener(int listen_sock, int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException);
+            void remove_listener(int listen_sock);
+            void pause_listener(int listen_sock, uint64_t delay_ns);
+
+            void post(unsigned int context, NetworkAgentTask task);
+            void after(unsigned int context, uint64_t delay_ns, NetworkAgentTask task);
+            void* watch_writable(int sock, unsigned int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException);
+            void unwatch(void* watch);
+
+        protected:
+            ~NetworkAgentEpollEngine();
+
+            //the last session may go away on a worker thread, which cannot join itself
+            void destroy();
+
+        private:
+            struct Listener
+            {
+                int sock;
+                bool removed; //deleted after the current batch
+                NetworkAgentTask on_ready;
+            };
+
+            //one shot writable watch, tagged with the second lowest bit
+            struct Watch
+            {
+                int sock;
+                int epfd;
+                bool done; //fired or dropped, deleted after the current batch
+                NetworkAgentTask on_ready;
+            };
+
+            struct Worker
+            {
+                NetworkAgentEpollEngine* engine;
+                int epfd;
+                int cpu; //core to pin the thread to, -1 if unbound
+                std::thread thread;
+                NetworkAgentTaskQueue tasks; //its eventfd is registered with a NULL tag
+                NetworkAgentTimerQueue timers; //worker thread only
+                std::mutex lock; //guards listeners
+                std::vector<Listener*> listeners;
+            };
+
+            void run(Worker* w);
+            //re-register the session's socket for the given events, on its worker
+            void modify(NetworkAgentClientSession* s, unsigned int events);
+            //stop a watch and free it once events of the current batch are through
+            static void retire(Worker* w, Watch* watch);
+
+            std::vector<Worker*> _workers;
+            std::atomic<bool> _stop;
+
+            static __thread Worker* _current; //worker running on this thread, NULL elsewhere
+        };
+}
+
+#endif
+#endif
@@ -0,0 +1,452 @@
+//
+//  NetworkAgentFrame.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_FRAME_H
+#define LIBGCDNET_ENGINE_NETWORK_FRAME_H
+
+#include <string>
+#include "NetworkAgentBuffer.h"
+#include "NetworkAgentPayload.h"
+
+namespace libgcdnet{
+
+        struct NetworkAgentPackageHead
+        {
+            unsigned char protocol; //u8: 0xbb, 0xbc for a heartbeat, 0xbd for a stream segment
+            unsigned int payload_size; //u32
+            unsigned int source_agent_id; //u32
+            unsigned int target_agent_id; //u32
+        };
+
+        /**
+         Wire Layout of the Package Header
+         13 bytes, no padding, multi-byte fields in network byte order
+         | u8 protocol | u32 payload_size | u32 source_agent_id | u32 target_agent_id |
+         a heartbeat is a header alone, with HEARTBEAT as protocol and payload_size 0. its
+         source_agent_id carries the sender's capability flags, OFFER_COMPACT, and is 0 from
+         a sender offering nothing; decoders ignore it. target_agent_id is 0.
+         a stream segment has SEGMENT as protocol, see NetworkAgentSegmentHeader
+         **/
+        struct NetworkAgentWireHeader
+        {
+            static const size_t SIZE = 13;
+            static const unsigned char PROTOCOL = 0xbb;
+            static const unsigned char HEARTBEAT = 0xbc;
+            static const unsigned char SEGMENT = 0xbd;
+            static const unsigned int OFFER_COMPACT = 0x1; //heartbeat flag, the sender reads compact headers
+
+            static void put_u32(unsigned char* out, unsigned int v)
+            {
+                out[0] = (unsigned char)(v >> 24);
+                out[1] = (unsigned char)(v >> 16);
+                out[2] = (unsigned char)(v >> 8);
+                out[3] = (unsigned char)v;
+            }
+
+            static unsigned int get_u32(const unsigned char* in)
+            {
+                return ((unsigned int)in[0] << 24) | ((unsigned int)in[1] << 16) |
+                       ((unsigned int)in[2] << 8) | (unsigned int)in[3];
+            }
+
+            static void encode(const NetworkAgentPackageHead& head, unsigned char* out)
+            {
+                out[0] = head.protocol;
+                put_u32(out + 1, head.payload_size);
+                put_u32(out + 5, head.source_agent_id);
+                put_u32(out + 9, head.target_agent_id);
+            }
+
+            //point an encoded header at another target, the rest stays as it is
+            static void patch_target(unsigned char* out, unsigned int target_agent_id)
+            {
+                put_u32(out + 9, target_agent_id);
+            }
+
+            static void decode(const unsigned char* in, NetworkAgentPackageHead& head)
+            {
+                head.protocol = in[0];
+                head.payload_size = get_u32(in + 1);
+                head.source_agent_id = get_u32(in + 5);
+                head.target_agent_id = get_u32(in + 9);
+            }
+        };
+
+        //the fixed layout above, as a codec layout
+        struct NetworkAgentFixedLayout
+        {
+            static const size_t MIN_SIZE = NetworkAgentWireHeader::SIZE;
+            static const size_t MAX_SIZE = NetworkAgentWireHeader::SIZE;
+
+            static constexpr size_t size(const NetworkAgentPackageHead&)
+            {
+                return NetworkAgentWireHeader::SIZE;
+            }
+
+            static size_t encode(const NetworkAgentPackageHead& head, unsigned char* out)
+            {
+                NetworkAgentWireHeader::encode(head, out);
+                return NetworkAgentWireHeader::SIZE;
+            }
+
+            static size_t decode(const unsigned char* in, size_t len, NetworkAgentPackageHead& head)
+            {
+                if(len < NetworkAgentWireHeader::SIZE)
+                    return 0;
+                NetworkAgentWireHeader::decode(in, head);
+                return NetworkAgentWireHeader::SIZE;
+            }
+        };
+
+        /**
+         Compact Wire Layout of the Package Header
+         for small packages the fixed header is most of the bytes sent. a compact header starts
+         with MARKER, which no fixed header starts with, followed by the protocol and the three
+         fields as LEB128 varints, 7 bits a byte, least significant first
+         | u8 MARKER | u8 protocol | varint payload_size | varint source_agent_id | varint target_agent_id |
+         5 bytes for a package under 128 bytes between agent ids below 128, 17 at most.
+         packages and heartbeats only, segments always travel with the fixed header.
+         a peer is sent compact headers only once it offered them in a heartbeat
+         **/
+        struct NetworkAgentVarintLayout
+        {
+            static const unsigned char MARKER = 0xbe;
+            static const size_t MIN_SIZE = 5;
+            static const size_t MAX_SIZE = 17;
+
+            static constexpr size_t varint_size(unsigned int v)
+            {
+                return v < 0x80 ? 1 : 1 + varint_size(v >> 7);
+            }
+
+            static constexpr size_t size(const NetworkAgentPackageHead& head)
+            {
+                return 2 + varint_size(head.payload_size) + varint_size(head.source_agent_id) + varint_size(head.target_agent_id);
+            }
+
+            static unsigned char* put_varint(unsigned char* out, unsigned int v)
+            {
+                while(v >= 0x80)
+                {
+                    *out++ = (unsigned char)(v | 0x80);
+                    v >>= 7;
+                }
+                *out++ = (unsigned char)v;
+                return out;
+            }
+
+            static size_t encode(const NetworkAgentPackageHead& head, unsigned char* out)
+            {
+                unsigned char* p = out;
+                *p++ = MARKER;
+                *p++ = head.protocol;
+                p = put_varint(p, head.payload_size);
+                p = put_varint(p, head.source_agent_id);
+                p = put_varint(p, head.target_agent_id);
+                return p - out;
+            }
+
+            //a varint running past 32 bits decodes with protocol 0, which no frame has
+            static size_t decode(const unsigned char* in, size_t len, NetworkAgentPackageHead& head)
+            {
+                if(len < MIN_SIZE)
+                    return 0;
+                unsigned int* fields[3] = {&head.payload_size, &head.source_agent_id, &head.target_agent_id};
+                head.protocol = in[1];
+                size_t at = 2;
+                for(int f=0; f<3; f++)
+                {
+                    unsigned int v = 0;
+                    for(unsigned int shift = 0;; shift += 7)
+                    {
+                        if(at == len)
+                            return 0;
+                        unsigned char b = in[at++];
+                        if(shift == 28 && (b & 0xf0))
+                        {
+                            head.protocol = 0;
+                            return at;
+                        }
+                        v |= (unsigned int)(b & 0x7f) << shift;
+                        if(!(b & 0x80))
+                            break;
+                    }
+                    *fields[f] = v;
+                }
+                return at;
+            }
+        };
+
+        /**
+         Package Header Codec
+         the header handling of one wire layout, picked at compile time. a layout provides
+         MIN_SIZE and MAX_SIZE, a constexpr size() of an encoded header, encode() returning
+         the bytes written and decode() returning the bytes taken, 0 while incomplete
+         **/
+        template<class Layout>
+        struct NetworkAgentWireCodec
+        {
+            static const size_t MIN_SIZE = Layout::MIN_SIZE;
+            static const size_t MAX_SIZE = Layout::MAX_SIZE;
+
+            static constexpr size_t size(const NetworkAgentPackageHead& head)
+            {
+                return Layout::size(head);
+            }
+
+            static size_t encode(const NetworkAgentPackageHead& head, unsigned char* out)
+            {
+                return Layout::encode(head, out);
+            }
+
+            static size_t decode(const unsigned char* in, size_t len, NetworkAgentPackageHead& head)
+            {
+                return Layout::decode(in, len, head);
+            }
+
+            //decode the header at offset of a stream, 0 while incomplete
+            static size_t peek(const NetworkAgentRingBuffer& stream, size_t offset, NetworkAgentPackageHead& head)
+            {
+                size_t len = stream.size() - offset;
+                if(len < MIN_SIZE)
+                    return 0;
+                if(len > MAX_SIZE)
+                    len = MAX_SIZE;
+                unsigned char raw[MAX_SIZE];
+                stream.peek(raw, len, offset);
+                return Layout::decode(raw, len, head);
+            }
+        };
+
+        typedef NetworkAgentWireCodec<NetworkAgentFixedLayout> NetworkAgentFixedCodec;
+        typedef NetworkAgentWireCodec<NetworkAgentVarintLayout> NetworkAgentCompactCodec;
+
+        //an encoded header by value, blocks cannot capture plain arrays
+        struct NetworkAgentWireHead
+        {
+            unsigned char bytes[NetworkAgentWireHeader::SIZE];
+        };
+
+        /**
+         Incremental Package Decoder
+         frames packages out of a session's inbound byte stream. the stream may hold
+         any number of complete packages followed by a partial one, split anywhere
+         (header included). framed packages stay in the stream, in order, until popped;
+         the bytes after the last complete package are carried over to the next read.
+         heartbeats are framed like packages and skipped when popping. fixed and compact
+         headers are told apart by their first byte and may be mixed freely.
+         the decoder itself never allocates
+         **/
+        class NetworkAgentFrameDecoder
+        {
+        public:
+            static const size_t DEFAULT_MAX_PAYLOAD = 16 * 1024 * 1024;
+
+            enum Status{
+                NEED_MORE, //no complete package past the cursor yet
+                FRAME,     //one more package framed
+                CORRUPT    //stream cannot be framed, the session should be dropped
+            };
+
+            explicit NetworkAgentFrameDecoder(size_t max_payload = DEFAULT_MAX_PAYLOAD)
+            : _max_payload(max_payload), _compact(false)
+            {
+                reset();
+            }
+
+            void reset()
+            {
+                _cursor = 0;
+                _framed = 0;
+                _head_ready = false;
+                _head_size = 0;
+            }
+
+            //number of complete packages waiting at the front of the stream, heartbeats included
+            size_t framed() const { return _framed; }
+
+            //bytes of the stream covered by complete packages
+            size_t framed_bytes() const { return _cursor; }
+
+            //a heartbeat offering compact headers or a compact header came in, the peer understands them
+            bool compact() const { return _compact; }
+
+            //protocol of the oldest framed package, heartbeats ahead of it skipped
+            bool front(NetworkAgentRingBuffer& stream, unsigned char& protocol)
+            {
+                skip_heartbeats(stream);
+                if(_framed == 0)
+                    return false;
+                NetworkAgentPackageHead head;
+                peek_head(stream, 0, head);
+                protocol = head.protocol;
+                return true;
+            }
+
+            //try to frame the next package after the ones already framed
+            Status next(const NetworkAgentRingBuffer& stream, NetworkAgentPackageHead& head)
+            {
+                size_t pending = stream.size() - _cursor;
+                if(!_head_ready)
+                {
+                    if(pending == 0)
+                        return NEED_MORE;
+
+                    bool compact;
+                    _head_size = peek_head(stream, _cursor, _head, &compact);
+                    if(_head_size == 0)
+                        return NEED_MORE;
+                    if(!valid(_head, compact))
+                        return CORRUPT;
+                    _compact = _compact || compact || (_head.protocol == NetworkAgentWireHeader::HEARTBEAT &&
+                                                       (_head.source_agent_id & NetworkAgentWireHeader::OFFER_COMPACT));
+                    _head_ready = true;
+                }
+
+                size_t frame_size = _head_size + _head.payload_size;
+                if(pending < frame_size)
+                    return NEED_MORE;
+
+                head = _head;
+                _cursor += frame_size;
+                _framed++;
+                _head_ready = false;
+                return FRAME;
+            }
+
+            //remove the oldest framed package from the stream
+            //the payload is moved into *payload if given, dropped otherwise
+            bool pop(NetworkAgentRingBuffer& stream, NetworkAgentPackageHead& head, std::string* payload)
+            {
+                skip_heartbeats(stream);
+                if(_framed == 0)
+                    return false;
+
+                size_t head_size = peek_head(stream, 0, head);
+                stream.consume(head_size);
+
+                if(payload)
+                    stream.extract(*payload, head.payload_size);
+                else
+                    stream.consume(head.payload_size);
+
+                _cursor -= head_size + head.payload_size;
+                _framed--;
+                return true;
+            }
+
+            //same, the payload is moved into a new NetworkAgentPayload owned by the caller
+            //@param pool - where the payload storage is leased from, NULL for malloc
+            bool pop(NetworkAgentRingBuffer& stream, NetworkAgentPackageHead& head, NetworkAgentPayload** payload, NetworkAgentBufferPool* pool)
+            {
+                skip_heartbeats(stream);
+                if(_framed == 0)
+                    return false;
+
+                size_t head_size = peek_head(stream, 0, head);
+
+                NetworkAgentPayload* p = NetworkAgentPayload::create(head.payload_size, pool);
+                stream.consume(head_size);
+                stream.peek(p->mutable_data(), head.payload_size);
+                stream.consume(head.payload_size);
+
+                _cursor -= head_size + head.payload_size;
+                _framed--;
+                *payload = p;
+                return true;
+            }
+
+            //forget the oldest framed package, its header and payload stay at the front of the
+            //stream for the caller to consume, exactly NetworkAgentWireHeader::SIZE + payload_size bytes.
+            //segments only, they always come with the fixed header
+            bool unframe(NetworkAgentRingBuffer& stream, NetworkAgentPackageHead& head)
+            {
+                skip_heartbeats(stream);
+                if(_framed == 0)
+                    return false;
+
+                size_t head_size = peek_head(stream, 0, head);
+                _cursor -= head_size + head.payload_size;
+                _framed--;
+                return true;
+            }
+
+            //header of the package past the framed ones, if it has arrived already
+            bool pending(NetworkAgentPackageHead& head) const
+            {
+                if(!_head_ready)
+                    return false;
+                head = _head;
+                return true;
+            }
+
+            //take the pending package out of the stream so that the rest of its payload can be
+            //read straight into its final place. only valid with a pending header and no framed
+            //package waiting. the payload bytes received so far are moved to out
+            //@return number of payload bytes moved
+            size_t take_pending(NetworkAgentRingBuffer& stream, char* out)
+            {
+                stream.consume(_head_size);
+                size_t received = stream.size();
+                stream.peek(out, received);
+                stream.clear();
+                reset();
+                return received;
+            }
+
+        private:
+            //header at offset of the stream in whichever layout it comes, 0 while incomplete
+            static size_t peek_head(const NetworkAgentRingBuffer& stream, size_t offset, NetworkAgentPackageHead& head,
+                                    bool* compact = NULL)
+            {
+                unsigned char first;
+                stream.peek(&first, 1, offset);
+                bool varint = first == NetworkAgentVarintLayout::MARKER;
+                if(compact)
+                    *compact = varint;
+                return varint ? NetworkAgentCompactCodec::peek(stream, offset, head)
+                              : NetworkAgentFixedCodec::peek(stream, offset, head);
+            }
+
+            bool valid(const NetworkAgentPackageHead& head, bool compact) const
+            {
+                switch(head.protocol)
+                {
+                    case NetworkAgentWireHeader::PROTOCOL:
+                        return head.payload_size <= _max_payload;
+                    case NetworkAgentWireHeader::HEARTBEAT:
+                        return head.payload_size == 0;
+                    case NetworkAgentWireHeader::SEGMENT:
+                        return !compact && head.payload_size >= 8 && head.payload_size <= _max_payload; //prefix included
+                    default:
+                        return false;
+                }
+            }
+
+            //drop the heartbeats framed ahead of the oldest package
+            void skip_heartbeats(NetworkAgentRingBuffer& stream)
+            {
+                while(_framed)
+                {
+                    NetworkAgentPackageHead head;
+                    size_t head_size = peek_head(stream, 0, head);
+                    if(head.protocol != NetworkAgentWireHeader::HEARTBEAT)
+                        return;
+                    stream.consume(head_size);
+                    _cursor -= head_size;
+                    _framed--;
+                }
+            }
+
+            size_t _max_payload;
+            size_t _cursor; //stream offset where the first unframed byte starts
+            size_t _framed;
+            bool _head_ready; //_head holds the decoded header at the cursor
+            size_t _head_size; //encoded size of _head
+            NetworkAgentPackageHead _head;
+            bool _compact;
+        };
+}
+#endif
@@ -0,0 +1,275 @@
+//
+//  NetworkAgentMetrics.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_METRICS_H
+#define LIBGCDNET_ENGINE_NETWORK_METRICS_H
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+namespace libgcdnet{
+
+        /**
+         Hot Path Counter
+         written from a single I/O context only, so add() is a plain relaxed
+         load/store with no locked instruction. any thread may read it.
+         add_shared() is for the few counters bumped from more than one context
+         **/
+        class NetworkAgentCounter
+        {
+        public:
+            NetworkAgentCounter() : _v(0){}
+
+            void add(uint64_t n)
+            {
+                _v.store(_v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+
+            void sub(uint64_t n)
+            {
+                _v.store(_v.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+            }
+
+            void add_shared(uint64_t n)
+            {
+                _v.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            void sub_shared(uint64_t n)
+            {
+                _v.fetch_sub(n, std::memory_order_relaxed);
+            }
+
+            uint64_t get() const
+            {
+                return _v.load(std::memory_order_relaxed);
+            }
+
+            void clear()
+            {
+                _v.store(0, std::memory_order_relaxed);
+            }
+
+        private:
+            NetworkAgentCounter(const NetworkAgentCounter&);
+            NetworkAgentCounter& operator=(const NetworkAgentCounter&);
+
+            std::atomic<uint64_t> _v;
+        };
+
+        //plain copy of the I/O counters of a session, or their sum over an agent
+        struct NetworkAgentStats
+        {
+            uint64_t bytes_in;
+            uint64_t bytes_out;
+            uint64_t frames_in;
+            uint64_t frames_out;
+            uint64_t reads; //read syscalls, or receive completions on completion engines
+            uint64_t writes; //write syscalls, or send completions
+            uint64_t eagain; //reads and writes that found the socket not ready
+            uint64_t partial_writes; //writes that took less than was gathered
+            uint64_t errors;
+            uint64_t queued_bytes; //outbound bytes waiting right now
+            uint64_t queued_frames;
+        };
+
+        //log2 buckets of handler run times, bucket b holds durations below 2^b ns
+        struct NetworkAgentHistogram
+        {
+            static const int BUCKETS = 40;
+
+            uint64_t buckets[BUCKETS];
+
+            uint64_t count() const
+            {
+                uint64_t n = 0;
+                for(int b=0; b<BUCKETS; b++)
+                    n += buckets[b];
+                return n;
+            }
+
+            //upper bound in ns of the bucket holding the p-th fraction of samples
+            uint64_t percentile(double p) const
+            {
+                uint64_t total = count();
+                if(total == 0)
+                    return 0;
+                uint64_t rank = (uint64_t)(p * (total - 1)) + 1, seen = 0;
+                for(int b=0; b<BUCKETS; b++)
+                {
+                    seen += buckets[b];
+                    if(seen >= rank)
+                        return (uint64_t)1 << b;
+                }
+                return (uint64_t)1 << (BUCKETS - 1);
+            }
+        };
+
+        class NetworkAgentLatencyHistogram
+        {
+        public:
+            void record(uint64_t ns)
+            {
+                int b = 0;
+                while(b < NetworkAgentHistogram::BUCKETS - 1 && ns >= ((uint64_t)1 << b))
+                    b++;
+                _buckets[b].add(1);
+            }
+
+            void collect(NetworkAgentHistogram& out) const
+            {
+                for(int b=0; b<NetworkAgentHistogram::BUCKETS; b++)
+                    out.buckets[b] += _buckets[b].get();
+            }
+
+            void clear()
+            {
+                for(int b=0; b<NetworkAgentHistogram::BUCKETS; b++)
+                    _buckets[b].clear();
+            }
+
+        private:
+            NetworkAgentCounter _buckets[NetworkAgentHistogram::BUCKETS];
+        };
+
+        class NetworkAgentSessionCounters
+        {
+        public:
+            typedef NetworkAgentCounter NetworkAgentSessionCounters::* Field;
+            typedef NetworkAgentLatencyHistogram NetworkAgentSessionCounters::* Timer;
+
+            NetworkAgentCounter bytes_in;
+            NetworkAgentCounter bytes_out;
+            NetworkAgentCounter frames_in;
+            NetworkAgentCounter frames_out;
+            NetworkAgentCounter reads;
+            NetworkAgentCounter writes;
+            NetworkAgentCounter eagain;
+            NetworkAgentCounter partial_writes;
+            NetworkAgentCounter errors;
+            NetworkAgentCounter queued_bytes;
+            NetworkAgentCounter queued_frames;
+            NetworkAgentLatencyHistogram read_handler; //time spent per read event
+            NetworkAgentLatencyHistogram write_handler; //time spent per write event
+
+            //add the current values into out
+            void collect(NetworkAgentStats& out) const
+            {
+                out.bytes_in += bytes_in.get();
+                out.bytes_out += bytes_out.get();
+                out.frames_in += frames_in.get();
+                out.frames_out += frames_out.get();
+                out.reads += reads.get();
+                out.writes += writes.get();
+                out.eagain += eagain.get();
+                out.partial_writes += partial_writes.get();
+                out.errors += errors.get();
+                out.queued_bytes += queued_bytes.get();
+                out.queued_frames += queued_frames.get();
+            }
+
+            //back to zero for a recycled session
+            void clear()
+            {
+                bytes_in.clear();
+                bytes_out.clear();
+                frames_in.clear();
+                frames_out.clear();
+                reads.clear();
+                writes.clear();
+                eagain.clear();
+                partial_writes.clear();
+                errors.clear();
+                queued_bytes.clear();
+                queued_frames.clear();
+                read_handler.clear();
+                write_handler.clear();
+            }
+        };
+
+        /**
+         Metrics of one NetworkAgent
+         one slot per I/O shard, each written only from its own shard so the
+         counters never bounce between cores. sessions add to their own counters
+         and to their shard's slot, the agent snapshot sums the slots.
+         reference counted like the buffer pools, sessions outliving their agent keep it alive
+         **/
+        class NetworkAgentMetrics
+        {
+        public:
+            struct Snapshot
+            {
+                NetworkAgentStats totals;
+                uint64_t sessions_opened;
+                uint64_t sessions_closed;
+                NetworkAgentHistogram read_handler; //time spent per read event
+                NetworkAgentHistogram write_handler; //time spent per write event
+            };
+
+            struct Shard
+            {
+                NetworkAgentSessionCounters counters;
+                NetworkAgentCounter sessions_opened; //shared, bumped by whoever accepts
+                NetworkAgentCounter sessions_closed;
+                char pad[64]; //keep neighbouring shards off each other's cache lines
+            };
+
+            explicit NetworkAgentMetrics(unsigned int shards) : _refcount(1)
+            {
+                for(unsigned int i=0; i<shards; i++)
+                    _shards.push_back(new Shard);
+            }
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            Shard& shard(unsigned int i) { return *_shards[i]; }
+
+            //outbound bytes queued over all sessions, shared by every shard,
+            //only kept up to date while an agent wide write watermark is set
+            NetworkAgentCounter write_backlog;
+
+            Snapshot snapshot() const
+            {
+                Snapshot s;
+                memset(&s, 0, sizeof(s));
+                for(size_t i=0; i<_shards.size(); i++)
+                {
+                    const Shard& sh = *_shards[i];
+                    sh.counters.collect(s.totals);
+                    sh.counters.read_handler.collect(s.read_handler);
+                    sh.counters.write_handler.collect(s.write_handler);
+                    s.sessions_opened += sh.sessions_opened.get();
+                    s.sessions_closed += sh.sessions_closed.get();
+                }
+                return s;
+            }
+
+        private:
+            ~NetworkAgentMetrics()
+            {
+                for(size_t i=0; i<_shards.size(); i++)
+                    delete _shards[i];
+            }
+
+            NetworkAgentMetrics(const NetworkAgentMetrics&);
+            NetworkAgentMetrics& operator=(const NetworkAgentMetrics&);
+
+            std::atomic<int> _refcount;
+            std::vector<Shard*> _shards;
+        };
+}
+#endif
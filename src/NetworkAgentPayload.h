@@ -0,0 +1,97 @@
+//
+//  NetworkAgentPayload.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_PAYLOAD_H
+#define LIBGCDNET_ENGINE_NETWORK_PAYLOAD_H
+
+#include <new>
+#include <atomic>
+#include "NetworkAgentBuffer.h"
+
+namespace libgcdnet{
+
+        /**
+         Package Payload Handed to Delegates
+         a read-only, reference counted byte block. the bytes follow the object in
+         the same allocation, leased from the session's buffer pool when large enough
+         to be worth it. whoever gets a payload from the library owns one reference and
+         calls release() when done, from any thread; retain() to share it further
+         **/
+        class NetworkAgentPayload
+        {
+        public:
+            static const size_t MIN_POOLED = 2048; //smaller payloads come from malloc
+
+            //@param pool - lease the storage from here, NULL for malloc
+            static NetworkAgentPayload* create(size_t size, NetworkAgentBufferPool* pool = NULL)
+            {
+                size_t total = sizeof(NetworkAgentPayload) + size;
+                size_t block = total;
+                char* mem;
+                if(pool && total >= MIN_POOLED)
+                {
+                    block = NetworkAgentBufferPool::block_size(total);
+                    mem = pool->acquire(block);
+                    pool->retain();
+                }
+                else
+                {
+                    pool = NULL;
+                    mem = (char*)malloc(total);
+                    if(!mem)
+                        throw std::bad_alloc();
+                }
+                return new (mem) NetworkAgentPayload(size, block, pool);
+            }
+
+            const char* data() const { return (const char*)(this + 1); }
+            size_t size() const { return _size; }
+
+            //writable only while the creator holds the sole reference
+            char* mutable_data() { return (char*)(this + 1); }
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            //release() for callbacks taking a void*
+            static void release_fn(void* payload)
+            {
+                ((NetworkAgentPayload*)payload)->release();
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    return;
+
+                NetworkAgentBufferPool* pool = _pool;
+                size_t block = _block;
+                this->~NetworkAgentPayload();
+                if(pool)
+                {
+                    pool->recycle((char*)this, block);
+                    pool->release();
+                }
+                else
+                    free(this);
+            }
+
+        private:
+            NetworkAgentPayload(size_t size, size_t block, NetworkAgentBufferPool* pool)
+            : _refcount(1), _size(size), _block(block), _pool(pool){}
+            ~NetworkAgentPayload(){}
+
+            NetworkAgentPayload(const NetworkAgentPayload&);
+            NetworkAgentPayload& operator=(const NetworkAgentPayload&);
+
+            std::atomic<int> _refcount;
+            size_t _size;
+            size_t _block; //size of the allocation, the pool block size when pooled
+            NetworkAgentBufferPool* _pool;
+        };
+}
+#endif
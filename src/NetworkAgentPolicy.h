@@ -0,0 +1,181 @@
+//
+//  NetworkAgentPolicy.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_POLICY_H
+#define LIBGCDNET_ENGINE_NETWORK_POLICY_H
+
+#include <cstddef>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+namespace libgcdnet{
+
+        /**
+         Socket I/O Policy of a Session
+         how a session trades latency against throughput. options the platform or the
+         socket family does not support are skipped, e.g. TCP options on unix domain sockets
+         **/
+        struct NetworkAgentIOPolicy
+        {
+            bool nodelay; //TCP_NODELAY, small writes go out without waiting for acks
+            bool cork; //TCP_CORK (TCP_NOPUSH on BSD), only full segments leave. the tail of each coalesced
+                       //batch is pushed once written, without coalesce_us the kernel holds it (200ms on linux)
+            unsigned int coalesce_us; //hold new writes back up to this long to batch them, 0 writes right away
+            size_t coalesce_bytes; //stop holding back once this much is queued, 0 for no limit
+            int send_buffer; //SO_SNDBUF, 0 keeps the system default
+            int receive_buffer; //SO_RCVBUF
+            unsigned int busy_poll_us; //SO_BUSY_POLL (linux), spin on the device queue instead of sleeping, 0 off
+
+            NetworkAgentIOPolicy() : nodelay(false), cork(false), coalesce_us(0), coalesce_bytes(0),
+                                     send_buffer(0), receive_buffer(0), busy_poll_us(0){}
+
+            //every write leaves at once
+            static NetworkAgentIOPolicy latency()
+            {
+                NetworkAgentIOPolicy p;
+                p.nodelay = true;
+                return p;
+            }
+
+            //full segments, writes batched for up to 200us or 64KB, large socket buffers
+            static NetworkAgentIOPolicy throughput()
+            {
+                NetworkAgentIOPolicy p;
+                p.cork = true;
+                p.coalesce_us = 200;
+                p.coalesce_bytes = 64 * 1024;
+                p.send_buffer = p.receive_buffer = 4 * 1024 * 1024;
+                return p;
+            }
+        };
+
+        //a session holding back its writes, linked into its shard's hold list
+        struct NetworkAgentHold
+        {
+            NetworkAgentHold* prev;
+            NetworkAgentHold* next;
+            uint64_t due; //steady clock ns
+            void (*fire)(void* owner);
+            void* owner;
+
+            NetworkAgentHold() : prev(NULL), next(NULL), due(0), fire(NULL), owner(NULL){}
+
+            bool held() const { return prev != NULL; }
+        };
+
+        /**
+         Write Coalescing Deadlines of an Agent
+         per I/O shard, the sessions holding back their writes and the deadline the shard's
+         next flush run is scheduled for. sessions join in the order they start holding, so
+         with one policy the first one is the first due; a run fires everything due and is
+         followed by another one only while sessions are left. touched on the shard's context
+         only, reference counted like the timeouts, sessions and scheduled runs keep it alive
+         **/
+        class NetworkAgentCoalescer
+        {
+        public:
+            static const uint64_t NONE = ~(uint64_t)0;
+
+            explicit NetworkAgentCoalescer(unsigned int shards) : _refcount(1), _shards(shards)
+            {
+                for(size_t i=0; i<_shards.size(); i++)
+                {
+                    _shards[i].head.prev = _shards[i].head.next = &_shards[i].head;
+                    _shards[i].scheduled = NONE;
+                }
+            }
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            static uint64_t clock()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            void hold(unsigned int shard, NetworkAgentHold* h, uint64_t due)
+            {
+                NetworkAgentHold* head = &_shards[shard].head;
+                h->due = due;
+                h->next = head;
+                h->prev = head->prev;
+                head->prev->next = h;
+                head->prev = h;
+            }
+
+            void drop(NetworkAgentHold* h)
+            {
+                if(!h->held())
+                    return;
+                h->prev->next = h->next;
+                h->next->prev = h->prev;
+                h->prev = h->next = NULL;
+            }
+
+            //a flush run is needed for the deadline unless one comes earlier already
+            bool claim(unsigned int shard, uint64_t due)
+            {
+                if(due >= _shards[shard].scheduled)
+                    return false;
+                _shards[shard].scheduled = due;
+                return true;
+            }
+
+            //the run scheduled for due started
+            void ran(unsigned int shard, uint64_t due)
+            {
+                if(_shards[shard].scheduled == due)
+                    _shards[shard].scheduled = NONE;
+            }
+
+            //fire every hold due by now
+            //@return the earliest deadline left, NONE without any
+            uint64_t expire(unsigned int shard, uint64_t now)
+            {
+                NetworkAgentHold* head = &_shards[shard].head;
+                uint64_t next = NONE;
+                for(NetworkAgentHold* h = head->next; h != head;)
+                {
+                    NetworkAgentHold* following = h->next;
+                    if(h->due <= now)
+                    {
+                        drop(h);
+                        h->fire(h->owner);
+                    }
+                    else if(h->due < next)
+                        next = h->due;
+                    h = following;
+                }
+                return next;
+            }
+
+        private:
+            struct Shard
+            {
+                NetworkAgentHold head; //list head
+                uint64_t scheduled; //deadline of the earliest flush run pending, NONE if none
+            };
+
+            ~NetworkAgentCoalescer(){}
+
+            NetworkAgentCoalescer(const NetworkAgentCoalescer&);
+            NetworkAgentCoalescer& operator=(const NetworkAgentCoalescer&);
+
+            std::atomic<int> _refcount;
+            std::vector<Shard> _shards;
+        };
+}
+#endif
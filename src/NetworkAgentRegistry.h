@@ -0,0 +1,263 @@
+//
+//  NetworkAgentRegistry.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_REGISTRY_H
+#define LIBGCDNET_ENGINE_NETWORK_REGISTRY_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include "NetworkAgent.h"
+
+namespace libgcdnet{
+
+        /**
+         Agent Registry
+         a ready made dispatcher delegate mapping agent ids onto their delegates.
+         lookups take no lock, they probe an open addressing table that writers update
+         in place under a mutex and replace as a whole only when it has to grow.
+         unregistering or replacing an agent moves the epoch on, sessions keep their
+         last lookup per target until then and do not search at all in between.
+         a table replaced while lookups may still run on it is freed by a later write
+         once no lookup is in progress. every thread counts its lookups in a slot of
+         its own cache line, so lookups on different cores never write to shared memory
+         **/
+        class NetworkAgentRegistry : public NetworkAgentDispatcherDelegate
+        {
+        public:
+            explicit NetworkAgentRegistry(size_t capacity = 64) : _epoch(0), _live(0)
+            {
+                for(int i=0; i<READER_SLOTS; i++)
+                    _readers[i].count.store(0, std::memory_order_relaxed);
+                _table.store(create(slots_for(capacity)));
+            }
+
+            ~NetworkAgentRegistry()
+            {
+                destroy(_table.load());
+                for(size_t i=0; i<_retired.size(); i++)
+                    destroy(_retired[i]);
+            }
+
+            //link agent_id to the delegate, replacing whatever was registered under it
+            void register_agent(unsigned int agent_id, NetworkAgentClientDelegate* delegate)
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                Table* t = _table.load(std::memory_order_relaxed);
+                Slot* s = probe(t, agent_id);
+                if(s->key.load(std::memory_order_relaxed) == key(agent_id))
+                {
+                    NetworkAgentClientDelegate* prev = s->delegate.load(std::memory_order_relaxed);
+                    s->delegate.store(delegate, std::memory_order_release);
+                    if(!prev)
+                        _live++;
+                    else if(prev != delegate)
+                        _epoch.fetch_add(1, std::memory_order_release);
+                }
+                else
+                {
+                    //a new key takes an empty slot for good, grow before running out of them
+                    if((t->used + 1) * 4 > (t->mask + 1) * 3)
+                    {
+                        t = rebuild(t);
+                        s = probe(t, agent_id);
+                    }
+                    s->delegate.store(delegate, std::memory_order_relaxed);
+                    s->key.store(key(agent_id), std::memory_order_release);
+                    t->used++;
+                    _live++;
+                }
+                reclaim();
+            }
+
+            void register_agent(NetworkAgentClientDelegate* delegate)
+            {
+                register_agent(delegate->agent_id(), delegate);
+            }
+
+            //sessions stop routing to the delegate from their next package on.
+            //lookups already in progress may still return it
+            bool unregister_agent(unsigned int agent_id)
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                Slot* s = probe(_table.load(std::memory_order_relaxed), agent_id);
+                if(s->key.load(std::memory_order_relaxed) != key(agent_id) ||
+                   !s->delegate.load(std::memory_order_relaxed))
+                    return false;
+
+                //the key stays behind, probes keep walking past it
+                s->delegate.store(NULL, std::memory_order_release);
+                _live--;
+                _epoch.fetch_add(1, std::memory_order_release);
+                reclaim();
+                return true;
+            }
+
+            NetworkAgentClientDelegate* search(unsigned int target_agent_id) const
+            {
+                //announce the lookup before picking the table, see reclaim()
+                std::atomic<long>& readers = _readers[reader_slot()].count;
+                readers.fetch_add(1, std::memory_order_seq_cst);
+                Table* t = _table.load(std::memory_order_seq_cst);
+                NetworkAgentClientDelegate* d = NULL;
+                uint64_t k = key(target_agent_id);
+                for(size_t i = hash(target_agent_id) & t->mask, n = 0; n <= t->mask; i = (i + 1) & t->mask, n++)
+                {
+                    uint64_t found = t->slots[i].key.load(std::memory_order_acquire);
+                    if(found == k)
+                    {
+                        d = t->slots[i].delegate.load(std::memory_order_acquire);
+                        break;
+                    }
+                    if(!found)
+                        break;
+                }
+                readers.fetch_sub(1, std::memory_order_release);
+                return d;
+            }
+
+            uint64_t epoch() const
+            {
+                return _epoch.load(std::memory_order_acquire);
+            }
+
+            size_t size() const
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                return _live;
+            }
+
+        private:
+            static const int READER_SLOTS = 64; //a power of two
+
+            //lookups in progress on the threads owning the slot
+            struct ReaderSlot
+            {
+                std::atomic<long> count;
+                char pad[64]; //keep neighbouring slots off each other's cache lines
+            };
+
+            struct Slot
+            {
+                std::atomic<uint64_t> key; //agent id + 1, 0 while empty
+                std::atomic<NetworkAgentClientDelegate*> delegate; //NULL once unregistered
+            };
+
+            struct Table
+            {
+                size_t mask; //slot count - 1, a power of two
+                size_t used; //slots with a key, written under the lock only
+                Slot* slots;
+            };
+
+            static uint64_t key(unsigned int agent_id) { return (uint64_t)agent_id + 1; }
+
+            static size_t hash(unsigned int agent_id)
+            {
+                //agent ids tend to be sequential, spread them over the table
+                return (size_t)(((uint64_t)agent_id * 0x9E3779B97F4A7C15ull) >> 32);
+            }
+
+            //at most half full right after creation
+            static size_t slots_for(size_t entries)
+            {
+                size_t n = 16;
+                while(n < entries * 2)
+                    n <<= 1;
+                return n;
+            }
+
+            static Table* create(size_t slots)
+            {
+                Table* t = new Table;
+                t->mask = slots - 1;
+                t->used = 0;
+                t->slots = new Slot[slots];
+                for(size_t i=0; i<slots; i++)
+                {
+                    t->slots[i].key.store(0, std::memory_order_relaxed);
+                    t->slots[i].delegate.store(NULL, std::memory_order_relaxed);
+                }
+                return t;
+            }
+
+            static void destroy(Table* t)
+            {
+                delete [] t->slots;
+                delete t;
+            }
+
+            //threads take slots round robin, only the threads beyond READER_SLOTS share one
+            static int reader_slot()
+            {
+                static std::atomic<unsigned int> next(0);
+                static __thread int slot = -1;
+                if(slot < 0)
+                    slot = next.fetch_add(1, std::memory_order_relaxed) & (READER_SLOTS - 1);
+                return slot;
+            }
+
+            //slot holding the key, or the empty slot ending its probe sequence
+            static Slot* probe(Table* t, unsigned int agent_id)
+            {
+                uint64_t k = key(agent_id);
+                size_t i = hash(agent_id) & t->mask;
+                for(;;)
+                {
+                    uint64_t found = t->slots[i].key.load(std::memory_order_relaxed);
+                    if(found == k || !found)
+                        return &t->slots[i];
+                    i = (i + 1) & t->mask;
+                }
+            }
+
+            //copy the live entries into a fresh table, dropping the keys left by unregistered agents
+            Table* rebuild(Table* t)
+            {
+                Table* n = create(slots_for(_live + 1));
+                for(size_t i=0; i<=t->mask; i++)
+                {
+                    NetworkAgentClientDelegate* d = t->slots[i].delegate.load(std::memory_order_relaxed);
+                    if(!d)
+                        continue;
+                    uint64_t k = t->slots[i].key.load(std::memory_order_relaxed);
+                    Slot* s = probe(n, (unsigned int)(k - 1));
+                    s->delegate.store(d, std::memory_order_relaxed);
+                    s->key.store(k, std::memory_order_relaxed);
+                    n->used++;
+                }
+
+                _table.store(n, std::memory_order_seq_cst);
+                _retired.push_back(t);
+                return n;
+            }
+
+            //a lookup announced after a table was replaced can only see its successor,
+            //so with no lookup in progress in any slot every replaced table is unreachable
+            void reclaim()
+            {
+                if(_retired.empty())
+                    return;
+                for(int i=0; i<READER_SLOTS; i++)
+                    if(_readers[i].count.load(std::memory_order_seq_cst))
+                        return;
+                for(size_t i=0; i<_retired.size(); i++)
+                    destroy(_retired[i]);
+                _retired.clear();
+            }
+
+            NetworkAgentRegistry(const NetworkAgentRegistry&);
+            NetworkAgentRegistry& operator=(const NetworkAgentRegistry&);
+
+            std::atomic<Table*> _table;
+            std::atomic<uint64_t> _epoch;
+            mutable ReaderSlot _readers[READER_SLOTS];
+            size_t _live; //registered agents, under the lock
+            mutable std::mutex _lock; //serializes writers
+            std::vector<Table*> _retired; //replaced tables not yet freed
+        };
+}
+#endif
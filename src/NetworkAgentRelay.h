@@ -0,0 +1,342 @@
+//
+//  NetworkAgentRelay.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_RELAY_H
+#define LIBGCDNET_ENGINE_NETWORK_RELAY_H
+
+#include <map>
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "NetworkAgentMetrics.h"
+
+namespace libgcdnet{
+
+        /**
+         Splice Pipe
+         the kernel moves bytes from a socket into the pipe and from the pipe into another
+         socket, they never come up to user space. linux only, available() is false elsewhere
+         **/
+        class NetworkAgentPipe
+        {
+        public:
+            static const int SIZE = 1024 * 1024; //asked for, capped by /proc/sys/fs/pipe-max-size
+
+            NetworkAgentPipe()
+            {
+                _fds[0] = _fds[1] = -1;
+            }
+
+            static bool available()
+            {
+#ifdef __linux__
+                return true;
+#else
+                return false;
+#endif
+            }
+
+            //non-blocking on both ends, errno set on failure
+            bool open()
+            {
+#ifdef __linux__
+                if(pipe2(_fds, O_NONBLOCK | O_CLOEXEC) < 0)
+                    return false;
+#ifdef F_SETPIPE_SZ
+                fcntl(_fds[1], F_SETPIPE_SZ, SIZE); //the default 64KB if refused
+#endif
+                return true;
+#else
+                errno = ENOSYS;
+                return false;
+#endif
+            }
+
+            void close()
+            {
+                if(_fds[0] >= 0)
+                    ::close(_fds[0]);
+                if(_fds[1] >= 0)
+                    ::close(_fds[1]);
+                _fds[0] = _fds[1] = -1;
+            }
+
+            //up to n bytes from the socket into the pipe, like splice(): 0 on EOF, -1 with errno set.
+            //EAGAIN if the socket has nothing or the pipe is full
+            ssize_t fill(int sock, size_t n)
+            {
+#ifdef __linux__
+                return splice(sock, NULL, _fds[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+                errno = ENOSYS;
+                return -1;
+#endif
+            }
+
+            //up to n bytes out of the pipe into the socket
+            //@param more - more of the same package follows, the socket may wait for it
+            ssize_t drain(int sock, size_t n, bool more)
+            {
+#ifdef __linux__
+                return splice(_fds[0], NULL, sock, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (more ? SPLICE_F_MORE : 0));
+#else
+                errno = ENOSYS;
+                return -1;
+#endif
+            }
+
+        private:
+            int _fds[2];
+        };
+
+        class NetworkAgentClientSession;
+        class NetworkAgentRelay;
+
+        //one relayed payload on its way from the upstream socket through the pipe into the downstream
+        //socket, both sessions share the context it runs on
+        struct NetworkAgentRelaySplice
+        {
+            NetworkAgentRelay* relay;
+            unsigned int context;
+            NetworkAgentClientSession* upstream; //reading it, NULL once all of it is in the pipe or the session closed
+            NetworkAgentClientSession* downstream; //writing it, NULL once written or dropped with its queue
+            NetworkAgentPipe pipe;
+            size_t unread; //payload bytes still in the upstream socket
+            size_t buffered; //in the pipe
+            int refs; //upstream, downstream and a pump running
+        };
+
+        /**
+         Relay Routing Table
+         packages whose target agent has a route are not delivered here but sent on to the next
+         hop, packages coming back on a route's connection go to the client their target last
+         sent from. the agents of this node are never learned that way and a shard learns at most
+         MAX_LEARNED clients. every shard has its own connection per route, so that a package never
+         leaves the context it came in on. a large payload coming back on a route's connection is
+         spliced from socket to socket where available (linux with a readiness engine), so that a
+         client going away in the middle of its payload never takes a route's connection down
+         with it. everything else is forwarded from memory by reference.
+         tables are per shard and touched on its context only. reference counted, every session
+         and every splice keeps it alive
+         **/
+        class NetworkAgentRelay
+        {
+        public:
+            static const size_t MAX_IDLE_PIPES = 16; //per shard
+            static const size_t MAX_LEARNED = 4096; //clients replies find their way back to, per shard
+
+            struct Stats
+            {
+                unsigned long long relayed; //packages sent on
+                unsigned long long bytes; //their payload bytes
+                unsigned long long spliced; //payload bytes moved socket to socket without a copy
+                unsigned long long dropped; //packages for a route whose connection closed
+            };
+
+            NetworkAgentRelay(unsigned int shards, bool splice)
+            : _refcount(1), _routing(false), _splice(splice && NetworkAgentPipe::available())
+            {
+                for(unsigned int i=0; i<shards; i++)
+                    _shards.push_back(new Shard);
+            }
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            //a route was ever added, a single relaxed load on every package until then
+            bool routing() const { return _routing.load(std::memory_order_relaxed); }
+            void enable() { _routing.store(true, std::memory_order_relaxed); }
+
+            bool splices() const { return _splice; }
+
+            //next hop of a package for target_agent_id, a route added by hand before one learned.
+            //@param known - false if the package is for this node, a known route may have no session left
+            //@param hop - the package came in on a route's connection, only replies follow learned routes
+            NetworkAgentClientSession* route(unsigned int context, unsigned int target_agent_id, bool& known, bool hop) const
+            {
+                const Shard& sh = *_shards[context];
+                Routes::const_iterator it = sh.routes.find(target_agent_id);
+                if(it == sh.routes.end())
+                {
+                    it = hop ? sh.learned.find(target_agent_id) : sh.learned.end();
+                    if(it == sh.learned.end())
+                    {
+                        known = false;
+                        return NULL;
+                    }
+                }
+                known = true;
+                return it->second;
+            }
+
+            //a package from session for target_agent_id is sent on
+            bool forwards(unsigned int context, unsigned int target_agent_id, const NetworkAgentClientSession* session, bool hop) const
+            {
+                bool known = false;
+                NetworkAgentClientSession* next = route(context, target_agent_id, known, hop);
+                return known && next != session;
+            }
+
+            //the client replies to source_agent_id go back to, NULL if none
+            NetworkAgentClientSession* learned(unsigned int context, unsigned int source_agent_id) const
+            {
+                const Routes& learned = _shards[context]->learned;
+                Routes::const_iterator it = learned.find(source_agent_id);
+                return it == learned.end() ? NULL : it->second;
+            }
+
+            //replies to source_agent_id go back to the client it sent from.
+            //a full table makes room by dropping the entry next to the new one
+            void learn(unsigned int context, unsigned int source_agent_id, NetworkAgentClientSession* session)
+            {
+                Routes& learned = _shards[context]->learned;
+                if(learned.size() >= MAX_LEARNED && learned.find(source_agent_id) == learned.end())
+                {
+                    Routes::iterator victim = learned.upper_bound(source_agent_id);
+                    learned.erase(victim == learned.end() ? learned.begin() : victim);
+                }
+                learned[source_agent_id] = session;
+            }
+
+            //the connection of a route on the context, returns the one it replaces
+            NetworkAgentClientSession* install(unsigned int context, unsigned int target_agent_id, NetworkAgentClientSession* session)
+            {
+                NetworkAgentClientSession*& slot = _shards[context]->routes[target_agent_id];
+                NetworkAgentClientSession* old = slot;
+                slot = session;
+                return old;
+            }
+
+            //drop a route on the context, returns its connection
+            NetworkAgentClientSession* uninstall(unsigned int context, unsigned int target_agent_id)
+            {
+                Routes& routes = _shards[context]->routes;
+                Routes::iterator it = routes.find(target_agent_id);
+                if(it == routes.end())
+                    return NULL;
+                NetworkAgentClientSession* session = it->second;
+                routes.erase(it);
+                return session;
+            }
+
+            //the session closed, learned routes to it are gone and routes added by hand drop their packages
+            void forget(unsigned int context, const NetworkAgentClientSession* session)
+            {
+                Shard& sh = *_shards[context];
+                for(Routes::iterator it = sh.routes.begin(); it != sh.routes.end(); ++it)
+                    if(it->second == session)
+                        it->second = NULL;
+                for(Routes::iterator it = sh.learned.begin(); it != sh.learned.end(); )
+                {
+                    if(it->second == session)
+                        sh.learned.erase(it++);
+                    else
+                        ++it;
+                }
+            }
+
+            //a pipe for a splice, reused from the context's idle ones
+            bool take_pipe(unsigned int context, NetworkAgentPipe& pipe)
+            {
+                std::vector<NetworkAgentPipe>& idle = _shards[context]->pipes;
+                if(idle.empty())
+                    return pipe.open();
+                pipe = idle.back();
+                idle.pop_back();
+                return true;
+            }
+
+            //a pipe that still holds bytes is closed, an empty one kept for the next splice
+            void give_pipe(unsigned int context, NetworkAgentPipe& pipe, bool empty)
+            {
+                std::vector<NetworkAgentPipe>& idle = _shards[context]->pipes;
+                if(empty && idle.size() < MAX_IDLE_PIPES)
+                    idle.push_back(pipe);
+                else
+                    pipe.close();
+                pipe = NetworkAgentPipe();
+            }
+
+            //a package of bytes payload was sent on
+            void relayed(unsigned int context, size_t bytes)
+            {
+                Shard& sh = *_shards[context];
+                sh.relayed.add(1);
+                sh.bytes.add(bytes);
+            }
+            
+            //n bytes of a payload went from socket to socket
+            void spliced(unsigned int context, size_t n)
+            {
+                _shards[context]->spliced.add(n);
+            }
+
+            void dropped(unsigned int context)
+            {
+                _shards[context]->dropped.add(1);
+            }
+
+            Stats stats() const
+            {
+                Stats st;
+                memset(&st, 0, sizeof(st));
+                for(size_t i=0; i<_shards.size(); i++)
+                {
+                    const Shard& sh = *_shards[i];
+                    st.relayed += sh.relayed.get();
+                    st.bytes += sh.bytes.get();
+                    st.spliced += sh.spliced.get();
+                    st.dropped += sh.dropped.get();
+                }
+                return st;
+            }
+
+        private:
+            ~NetworkAgentRelay()
+            {
+                for(size_t i=0; i<_shards.size(); i++)
+                {
+                    for(size_t p=0; p<_shards[i]->pipes.size(); p++)
+                        _shards[i]->pipes[p].close();
+                    delete _shards[i];
+                }
+            }
+
+            NetworkAgentRelay(const NetworkAgentRelay&);
+            NetworkAgentRelay& operator=(const NetworkAgentRelay&);
+
+            typedef std::map<unsigned int, NetworkAgentClientSession*> Routes;
+
+            struct Shard
+            {
+                Routes routes; //added by hand, NULL once their connection closed
+                Routes learned; //source agent of relayed packages to the client it came from, up to MAX_LEARNED
+                std::vector<NetworkAgentPipe> pipes; //idle, empty
+                NetworkAgentCounter relayed;
+                NetworkAgentCounter bytes;
+                NetworkAgentCounter spliced;
+                NetworkAgentCounter dropped;
+                char pad[64]; //keep neighbouring shards off each other's cache lines
+            };
+
+            std::atomic<int> _refcount;
+            std::atomic<bool> _routing;
+            bool _splice;
+            std::vector<Shard*> _shards;
+        };
+}
+#endif
@@ -0,0 +1,364 @@
+//
+//  NetworkAgentRpc.cpp
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+
+#include "NetworkAgentRpc.h"
+#include <sstream>
+#include <Block.h>
+#include <errno.h>
+#include <cstring>
+
+namespace libgcdnet {
+
+        NetworkAgentRpcClient::NetworkAgentRpcClient(NetworkAgentClientSession* session, unsigned int agent_id)
+        : _refcount(1), _agent_id(agent_id), _session(session), _outstanding(0)
+        {
+            //the session's reference, dropped in session_gone()
+            retain();
+            session->submit(^{
+                if(session->closed)
+                {
+                    session_gone();
+                    return;
+                }
+                session->delegate = this;
+                session->watch_close(^{
+                    session_gone();
+                });
+            });
+        }
+
+        NetworkAgentRpcClient::~NetworkAgentRpcClient()
+        {
+        }
+
+        void NetworkAgentRpcClient::call(unsigned int target_agent_id, const char* body, size_t len,
+                                         NetworkAgentRpcHandler done, unsigned int deadline_ms)
+        {
+            //the correlation id is filled in on the context, the payload is ours alone until then
+            NetworkAgentPayload* request = NetworkAgentPayload::create(NetworkAgentRpcHeader::SIZE + len);
+            memcpy(request->mutable_data() + NetworkAgentRpcHeader::SIZE, body, len);
+
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                NetworkAgentClientSession* s = _session;
+                if(s)
+                {
+                    //submitted under the lock, a close of the session waits for it in session_gone()
+                    //and the session is not given back before this task ran
+                    retain();
+                    s->submit(^{
+                        start(s, target_agent_id, request, done, deadline_ms);
+                        release();
+                    });
+                    return;
+                }
+            }
+            request->release();
+            done(ECONNRESET, NULL, 0);
+        }
+
+        std::future<std::string> NetworkAgentRpcClient::call(unsigned int target_agent_id, const std::string& body,
+                                                             unsigned int deadline_ms)
+        {
+            std::shared_ptr<std::promise<std::string> > promise(new std::promise<std::string>);
+            std::future<std::string> result = promise->get_future();
+            call(target_agent_id, body.data(), body.size(), ^(int error, const char* response, size_t len){
+                if(error)
+                {
+                    std::ostringstream msg;
+                    msg << "rpc call failed, error " << error;
+                    promise->set_exception(std::make_exception_ptr(NetworkAgentException(msg.str())));
+                }
+                else
+                    promise->set_value(std::string(response, len));
+            }, deadline_ms);
+            return result;
+        }
+
+        void NetworkAgentRpcClient::start(NetworkAgentClientSession* s, unsigned int target_agent_id, NetworkAgentPayload* request,
+                                          NetworkAgentRpcHandler done, unsigned int deadline_ms)
+        {
+            if(s->closed)
+            {
+                request->release();
+                done(ECONNRESET, NULL, 0);
+                return;
+            }
+
+            unsigned int index;
+            if(!_free.empty())
+            {
+                index = _free.back();
+                _free.pop_back();
+            }
+            else if(_slots.size() < MAX_OUTSTANDING)
+            {
+                index = _slots.size();
+                Slot fresh;
+                fresh.correlation_id = 0;
+                fresh.uses = 0;
+                fresh.busy = false;
+                fresh.done = NULL;
+                _slots.push_back(fresh);
+            }
+            else
+            {
+                request->release();
+                done(EAGAIN, NULL, 0);
+                return;
+            }
+
+            Slot& slot = _slots[index];
+            slot.uses = (slot.uses + 1) & ((1u << (32 - SLOT_BITS)) - 1);
+            slot.correlation_id = (slot.uses << SLOT_BITS) | index;
+            slot.busy = true;
+            slot.done = Block_copy(done);
+            _outstanding.fetch_add(1, std::memory_order_relaxed);
+            unsigned int correlation_id = slot.correlation_id;
+
+            NetworkAgentRpcHeader::encode(NetworkAgentRpcHeader::REQUEST, correlation_id, (unsigned char*)request->mutable_data());
+            NetworkAgentPackageHead header;
+            header.protocol = NetworkAgentWireHeader::PROTOCOL;
+            header.payload_size = request->size();
+            header.source_agent_id = _agent_id;
+            header.target_agent_id = target_agent_id;
+            NetworkAgentWireHead head;
+            NetworkAgentWireHeader::encode(header, head.bytes);
+            s->enqueue(head, request);
+
+            if(deadline_ms)
+            {
+                retain();
+                s->engine->after(s->context, (uint64_t)deadline_ms * 1000000, ^{
+                    complete(correlation_id, ETIMEDOUT, NULL, 0);
+                    release();
+                });
+            }
+        }
+
+        void NetworkAgentRpcClient::complete(unsigned int correlation_id, int error, const char* body, size_t len)
+        {
+            //a late response or deadline finds the slot reused or free
+            unsigned int index = correlation_id & ((1u << SLOT_BITS) - 1);
+            if(index >= _slots.size() || !_slots[index].busy || _slots[index].correlation_id != correlation_id)
+                return;
+
+            Slot& slot = _slots[index];
+            NetworkAgentRpcHandler done = slot.done;
+            slot.busy = false;
+            slot.done = NULL;
+            _free.push_back(index);
+            _outstanding.fetch_sub(1, std::memory_order_relaxed);
+
+            done(error, body, len);
+            Block_release(done);
+        }
+
+        void NetworkAgentRpcClient::deliver(unsigned char kind, unsigned int correlation_id, const char* body, size_t len)
+        {
+            if(kind == NetworkAgentRpcHeader::RESPONSE)
+                complete(correlation_id, 0, body, len);
+            else if(kind == NetworkAgentRpcHeader::FAILURE)
+            {
+                int error = len >= 4 ? (int)NetworkAgentWireHeader::get_u32((const unsigned char*)body) : 0;
+                complete(correlation_id, error ? error : EIO, NULL, 0);
+            }
+        }
+
+        void NetworkAgentRpcClient::payload_received(NetworkAgentClientSession* session, const NetworkAgentPackageHead& head,
+                                                     NetworkAgentPayload* payload)
+        {
+            const unsigned char* p = (const unsigned char*)payload->data();
+            size_t size = payload->size();
+            if(size >= NetworkAgentRpcHeader::SIZE)
+            {
+                unsigned int id = NetworkAgentWireHeader::get_u32(p + 1);
+                if(p[0] != NetworkAgentRpcHeader::BATCH)
+                    deliver(p[0], id, (const char*)p + NetworkAgentRpcHeader::SIZE, size - NetworkAgentRpcHeader::SIZE);
+                else
+                {
+                    //the id field counts the entries of a batch, a truncated entry ends it
+                    size_t at = NetworkAgentRpcHeader::SIZE;
+                    for(unsigned int i=0; i<id && size - at >= NetworkAgentRpcHeader::ENTRY_SIZE; i++)
+                    {
+                        size_t len = NetworkAgentWireHeader::get_u32(p + at + 5);
+                        if(size - at - NetworkAgentRpcHeader::ENTRY_SIZE < len)
+                            break;
+                        deliver(p[at], NetworkAgentWireHeader::get_u32(p + at + 1),
+                                (const char*)p + at + NetworkAgentRpcHeader::ENTRY_SIZE, len);
+                        at += NetworkAgentRpcHeader::ENTRY_SIZE + len;
+                    }
+                }
+            }
+            payload->release();
+        }
+
+        void NetworkAgentRpcClient::fail_all(int error)
+        {
+            for(size_t i=0; i<_slots.size(); i++)
+                if(_slots[i].busy)
+                    complete(_slots[i].correlation_id, error, NULL, 0);
+        }
+
+        void NetworkAgentRpcClient::session_gone()
+        {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _session = NULL;
+            }
+            fail_all(ECONNRESET);
+            release();
+        }
+
+
+        NetworkAgentRpcServer::NetworkAgentRpcServer(unsigned int agent_id, NetworkAgentRpcServeHandler handler)
+        : _agent_id(agent_id), _handler(Block_copy(handler))
+        {
+        }
+
+        NetworkAgentRpcServer::~NetworkAgentRpcServer()
+        {
+            Block_release(_handler);
+        }
+
+        void NetworkAgentRpcServer::payload_received(NetworkAgentClientSession* session, const NetworkAgentPackageHead& head,
+                                                     NetworkAgentPayload* payload)
+        {
+            const unsigned char* p = (const unsigned char*)payload->data();
+            if(payload->size() < NetworkAgentRpcHeader::SIZE || p[0] != NetworkAgentRpcHeader::REQUEST)
+            {
+                payload->release();
+                return;
+            }
+
+            NetworkAgentRpcCall call;
+            call.session = session;
+            call.serial = session->serial;
+            call.caller_agent_id = head.source_agent_id;
+            call.correlation_id = NetworkAgentWireHeader::get_u32(p + 1);
+            bool first = false;
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                if(_peers.find(call.serial) == _peers.end())
+                {
+                    Peer& peer = _peers[call.serial];
+                    peer.session = session;
+                    peer.flushing = false;
+                    first = true;
+                }
+            }
+            
+            //the peer goes with the session, even once another delegate took it over
+            if(first)
+            {
+                uint64_t serial = call.serial;
+                session->watch_close(^{
+                    drop(serial);
+                });
+            }
+
+            _handler(call, (const char*)p + NetworkAgentRpcHeader::SIZE, payload->size() - NetworkAgentRpcHeader::SIZE);
+            payload->release();
+        }
+
+        void NetworkAgentRpcServer::respond(const NetworkAgentRpcCall& call, const char* body, size_t len)
+        {
+            queue(call, NetworkAgentRpcHeader::RESPONSE, body, len);
+        }
+
+        void NetworkAgentRpcServer::fail(const NetworkAgentRpcCall& call, unsigned int error)
+        {
+            unsigned char code[4];
+            NetworkAgentWireHeader::put_u32(code, error);
+            queue(call, NetworkAgentRpcHeader::FAILURE, (const char*)code, sizeof(code));
+        }
+
+        void NetworkAgentRpcServer::queue(const NetworkAgentRpcCall& call, unsigned char kind, const char* body, size_t len)
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            std::map<uint64_t, Peer>::iterator it = _peers.find(call.serial);
+            if(it == _peers.end())
+                return;
+
+            Peer& peer = it->second;
+            Batch& batch = peer.batches[call.caller_agent_id];
+            if(batch.entries.empty())
+            {
+                batch.count = 0;
+                batch.kind = kind;
+                batch.correlation_id = call.correlation_id;
+            }
+            unsigned char entry[NetworkAgentRpcHeader::ENTRY_SIZE];
+            NetworkAgentRpcHeader::encode(kind, call.correlation_id, entry);
+            NetworkAgentWireHeader::put_u32(entry + NetworkAgentRpcHeader::SIZE, (unsigned int)len);
+            batch.entries.append((const char*)entry, sizeof(entry));
+            batch.entries.append(body, len);
+            batch.count++;
+
+            //everything responded until the flush runs leaves with it
+            //submitted under the lock, the close drops the peer before the session can go away
+            if(!peer.flushing)
+            {
+                peer.flushing = true;
+                NetworkAgentClientSession* s = peer.session;
+                uint64_t serial = call.serial;
+                s->submit(^{
+                    flush(s, serial);
+                });
+            }
+        }
+
+        void NetworkAgentRpcServer::flush(NetworkAgentClientSession* session, uint64_t serial)
+        {
+            std::map<unsigned int, Batch> batches;
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                std::map<uint64_t, Peer>::iterator it = _peers.find(serial);
+                if(it == _peers.end())
+                    return;
+                batches.swap(it->second.batches);
+                it->second.flushing = false;
+            }
+            if(session->closed)
+                return;
+
+            for(std::map<unsigned int, Batch>::iterator it = batches.begin(); it != batches.end(); ++it)
+            {
+                const Batch& batch = it->second;
+                NetworkAgentPayload* payload;
+                if(batch.count == 1)
+                {
+                    //a single response goes out plain
+                    size_t len = batch.entries.size() - NetworkAgentRpcHeader::ENTRY_SIZE;
+                    payload = NetworkAgentPayload::create(NetworkAgentRpcHeader::SIZE + len, session->r_buffer.pool());
+                    NetworkAgentRpcHeader::encode(batch.kind, batch.correlation_id, (unsigned char*)payload->mutable_data());
+                    memcpy(payload->mutable_data() + NetworkAgentRpcHeader::SIZE,
+                           batch.entries.data() + NetworkAgentRpcHeader::ENTRY_SIZE, len);
+                }
+                else
+                {
+                    payload = NetworkAgentPayload::create(NetworkAgentRpcHeader::SIZE + batch.entries.size(), session->r_buffer.pool());
+                    NetworkAgentRpcHeader::encode(NetworkAgentRpcHeader::BATCH, batch.count, (unsigned char*)payload->mutable_data());
+                    memcpy(payload->mutable_data() + NetworkAgentRpcHeader::SIZE, batch.entries.data(), batch.entries.size());
+                }
+
+                NetworkAgentPackageHead header;
+                header.protocol = NetworkAgentWireHeader::PROTOCOL;
+                header.payload_size = payload->size();
+                header.source_agent_id = _agent_id;
+                header.target_agent_id = it->first;
+                NetworkAgentWireHead head;
+                NetworkAgentWireHeader::encode(header, head.bytes);
+                session->enqueue(head, payload);
+            }
+        }
+
+        void NetworkAgentRpcServer::drop(uint64_t serial)
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _peers.erase(serial);
+        }
+}
@@ -0,0 +1,209 @@
+//
+//  NetworkAgentRpc.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_RPC_H
+#define LIBGCDNET_ENGINE_NETWORK_RPC_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <atomic>
+#include "NetworkAgent.h"
+
+namespace libgcdnet{
+
+        /**
+         Wire Layout of RPC Messages
+         carried as the payload of ordinary packages between a caller and a callee agent,
+         the response goes back to the source_agent_id of the request.
+         | u8 kind | u32 correlation_id | body |
+         a FAILURE body is a u32 error code. a BATCH carries several responses in one package
+         | u8 BATCH | u32 count | count x (| u8 kind | u32 correlation_id | u32 body_size | body |)
+         **/
+        struct NetworkAgentRpcHeader
+        {
+            static const size_t SIZE = 5;
+            static const size_t ENTRY_SIZE = 9; //one response of a batch, before its body
+
+            enum Kind{
+                REQUEST = 1,
+                RESPONSE = 2,
+                FAILURE = 3,
+                BATCH = 4
+            };
+
+            static void encode(unsigned char kind, unsigned int correlation_id, unsigned char* out)
+            {
+                out[0] = kind;
+                NetworkAgentWireHeader::put_u32(out + 1, correlation_id);
+            }
+        };
+
+        //outcome of a call, error is 0 on success, an errno value for local failures
+        //(ETIMEDOUT, ECONNRESET, EAGAIN) or the callee's error code. the body is only valid during the call
+        typedef void (^NetworkAgentRpcHandler)(int error, const char* body, size_t len);
+
+        /**
+         RPC Client of a Session
+         any number of calls in flight over one session, answered in whatever order the
+         callee gets to them. outstanding calls live in a slot table reused from call to call,
+         the correlation id names the slot and how often it was used so a late response to a
+         call that timed out cannot complete the next one. becomes the session's delegate,
+         calls still outstanding fail when the session closes even if the delegate was swapped
+         since. reference counted, the session keeps it alive until closed
+         **/
+        class NetworkAgentRpcClient final : public NetworkAgentClientDelegate
+        {
+        public:
+            static const size_t MAX_OUTSTANDING = 65536;
+
+            //@param agent_id - source of the requests, responses come back to it
+            NetworkAgentRpcClient(NetworkAgentClientSession* session, unsigned int agent_id);
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            //call the target agent from any thread, done runs on the session's context once the
+            //response arrived, deadline_ms (0 for none) passed or the session closed
+            void call(unsigned int target_agent_id, const char* body, size_t len,
+                      NetworkAgentRpcHandler done, unsigned int deadline_ms = 0);
+
+            //same with a future, failures throw NetworkAgentException from get()
+            std::future<std::string> call(unsigned int target_agent_id, const std::string& body,
+                                          unsigned int deadline_ms = 0);
+
+            size_t outstanding() const { return _outstanding.load(std::memory_order_relaxed); }
+
+            //delegate of the session
+            unsigned int agent_id() const { return _agent_id; }
+            void closed(){}
+            void connected(NetworkAgentClientSession* request){}
+            void data_received(){}
+            void data_sent(){}
+            bool accepts_payloads() const { return true; }
+            void payload_received(NetworkAgentClientSession* session, const NetworkAgentPackageHead& head,
+                                  NetworkAgentPayload* payload);
+            void session_closed(NetworkAgentClientSession* session){} //see session_gone()
+
+        private:
+            static const unsigned int SLOT_BITS = 16;
+
+            struct Slot
+            {
+                unsigned int correlation_id; //of the call in it
+                unsigned int uses; //upper half of the correlation id
+                bool busy;
+                NetworkAgentRpcHandler done;
+            };
+
+            ~NetworkAgentRpcClient();
+
+            //on the session's context
+            void start(NetworkAgentClientSession* s, unsigned int target_agent_id, NetworkAgentPayload* request,
+                       NetworkAgentRpcHandler done, unsigned int deadline_ms);
+            void deliver(unsigned char kind, unsigned int correlation_id, const char* body, size_t len);
+            void complete(unsigned int correlation_id, int error, const char* body, size_t len);
+            void fail_all(int error);
+            void session_gone(); //on the close of the session, whoever its delegate is
+
+            NetworkAgentRpcClient(const NetworkAgentRpcClient&);
+            NetworkAgentRpcClient& operator=(const NetworkAgentRpcClient&);
+
+            std::atomic<int> _refcount;
+            unsigned int _agent_id;
+            std::mutex _lock; //guards _session against the close
+            NetworkAgentClientSession* _session; //NULL once closed
+            std::atomic<size_t> _outstanding;
+
+            //on the session's context
+            std::vector<Slot> _slots;
+            std::vector<unsigned int> _free; //slot indices
+        };
+
+        //a request being served, respond to it exactly once
+        struct NetworkAgentRpcCall
+        {
+            NetworkAgentClientSession* session;
+            uint64_t serial; //of the session's connection, tells it apart from a later one reusing the session
+            unsigned int caller_agent_id;
+            unsigned int correlation_id;
+        };
+
+        //serve one request, the body is only valid during the call
+        typedef void (^NetworkAgentRpcServeHandler)(NetworkAgentRpcCall call, const char* body, size_t len);
+
+        /**
+         RPC Server
+         a delegate serving requests from any number of sessions, routed to it by agent id
+         like any other delegate, it has to outlive the sessions it served requests from.
+         the state kept per session goes with the session's close, whether the server is
+         still its delegate or not. the handler runs on the session's context, responses
+         may come from any thread later on. responses given before the session's context
+         gets around to writing the earlier ones are coalesced into one package per caller,
+         the batch leaves once the context is through with what it is doing, e.g. the rest
+         of the read
+         **/
+        class NetworkAgentRpcServer : public NetworkAgentClientDelegate
+        {
+        public:
+            NetworkAgentRpcServer(unsigned int agent_id, NetworkAgentRpcServeHandler handler);
+            ~NetworkAgentRpcServer();
+
+            //answer a call from any thread, dropped if its session is gone
+            void respond(const NetworkAgentRpcCall& call, const char* body, size_t len);
+            void fail(const NetworkAgentRpcCall& call, unsigned int error);
+
+            //delegate of the sessions
+            unsigned int agent_id() const { return _agent_id; }
+            void closed(){}
+            void connected(NetworkAgentClientSession* request){}
+            void data_received(){}
+            void data_sent(){}
+            bool accepts_payloads() const { return true; }
+            void payload_received(NetworkAgentClientSession* session, const NetworkAgentPackageHead& head,
+                                  NetworkAgentPayload* payload);
+            void session_closed(NetworkAgentClientSession* session){} //see drop()
+
+        private:
+            struct Batch
+            {
+                std::string entries; //encoded responses, ENTRY_SIZE + body each
+                unsigned int count;
+                unsigned char kind; //of the only entry
+                unsigned int correlation_id;
+            };
+
+            struct Peer
+            {
+                NetworkAgentClientSession* session;
+                bool flushing; //a flush is posted to the session's context
+                std::map<unsigned int, Batch> batches; //by caller agent
+            };
+
+            void queue(const NetworkAgentRpcCall& call, unsigned char kind, const char* body, size_t len);
+            void flush(NetworkAgentClientSession* session, uint64_t serial); //on the session's context
+            void drop(uint64_t serial); //on the close of the session, whoever its delegate is
+
+            NetworkAgentRpcServer(const NetworkAgentRpcServer&);
+            NetworkAgentRpcServer& operator=(const NetworkAgentRpcServer&);
+
+            unsigned int _agent_id;
+            NetworkAgentRpcServeHandler _handler;
+            std::mutex _lock;
+            std::map<uint64_t, Peer> _peers; //by serial, sessions requests came in on until they closed
+        };
+}
+#endif
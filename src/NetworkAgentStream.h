@@ -0,0 +1,305 @@
+//
+//  NetworkAgentStream.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_STREAM_H
+#define LIBGCDNET_ENGINE_NETWORK_STREAM_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <stdint.h>
+#include "NetworkAgentFrame.h"
+#include "NetworkAgentPayload.h"
+
+namespace libgcdnet{
+
+        /**
+         Wire Layout of a Stream Segment
+         a package of a logical stream travels as one or more segments, each a frame of
+         its own with SEGMENT as protocol. the segment payload starts with a prefix
+         | u32 stream_id | u32 message_size |
+         followed by the next bytes of the package. segments of one stream arrive in order
+         and a stream carries one package at a time, segments of different streams interleave
+         **/
+        struct NetworkAgentSegmentHeader
+        {
+            static const size_t PREFIX = 8;
+            static const size_t SIZE = NetworkAgentWireHeader::SIZE + PREFIX; //header and prefix
+
+            static void encode(unsigned int source_agent_id, unsigned int target_agent_id,
+                               unsigned int stream_id, size_t message_size, size_t segment_size,
+                               unsigned char* out)
+            {
+                NetworkAgentPackageHead head;
+                head.protocol = NetworkAgentWireHeader::SEGMENT;
+                head.payload_size = PREFIX + segment_size;
+                head.source_agent_id = source_agent_id;
+                head.target_agent_id = target_agent_id;
+                NetworkAgentWireHeader::encode(head, out);
+                NetworkAgentWireHeader::put_u32(out + NetworkAgentWireHeader::SIZE, stream_id);
+                NetworkAgentWireHeader::put_u32(out + NetworkAgentWireHeader::SIZE + 4, (unsigned int)message_size);
+            }
+        };
+
+        //one segment picked by the scheduler, the slice stays inside the payload
+        struct NetworkAgentSegment
+        {
+            unsigned char head[NetworkAgentSegmentHeader::SIZE];
+            const char* data;
+            size_t len;
+            NetworkAgentPayload* payload; //one reference for the slice, released once written
+            bool last; //the package is complete with this segment
+        };
+
+        /**
+         Outbound Stream Scheduler
+         packages written to streams wait here and are cut into segments of at most
+         segment_size bytes when the session is ready to queue more. the stream picked
+         next is the one with the least weighted service so far (stride scheduling), so a
+         stream of weight 2w gets twice the bytes of one of weight w while both have data,
+         and a small package on an idle stream goes out after at most one segment of
+         every busy stream. runs on the session's context only
+         **/
+        class NetworkAgentStreamScheduler
+        {
+        public:
+            static const unsigned int DEFAULT_WEIGHT = 16;
+            static const unsigned int MAX_WEIGHT = 256;
+            static const size_t DEFAULT_SEGMENT_SIZE = 16 * 1024;
+
+            explicit NetworkAgentStreamScheduler(size_t segment_size = DEFAULT_SEGMENT_SIZE)
+            : _segment_size(segment_size ? segment_size : DEFAULT_SEGMENT_SIZE), _vtime(0), _bytes(0){}
+
+            ~NetworkAgentStreamScheduler()
+            {
+                clear();
+            }
+
+            void set_segment_size(size_t segment_size)
+            {
+                if(segment_size)
+                    _segment_size = segment_size;
+            }
+
+            size_t segment_size() const { return _segment_size; }
+
+            //share of the stream, 1 to MAX_WEIGHT, kept for as long as the scheduler lives
+            void set_weight(unsigned int stream_id, unsigned int weight)
+            {
+                Stream& s = _streams[stream_id];
+                s.weight = weight < 1 ? 1 : (weight > MAX_WEIGHT ? MAX_WEIGHT : weight);
+                s.pinned = true;
+            }
+
+            //queue a package on a stream, taking over the reference to its payload
+            void push(unsigned int stream_id, unsigned int source_agent_id, unsigned int target_agent_id,
+                      NetworkAgentPayload* payload)
+            {
+                Stream& s = _streams[stream_id];
+                if(s.queue.empty())
+                {
+                    //an idle stream gets no credit for the time it had nothing to send
+                    if(s.pass < _vtime)
+                        s.pass = _vtime;
+                    s.id = stream_id;
+                    _active.push_back(&s);
+                }
+
+                Message m;
+                m.payload = payload;
+                m.source_agent_id = source_agent_id;
+                m.target_agent_id = target_agent_id;
+                m.offset = 0;
+                s.queue.push_back(m);
+                _bytes += payload->size();
+            }
+
+            bool empty() const { return _active.empty(); }
+
+            //payload bytes not yet handed out as segments
+            size_t bytes() const { return _bytes; }
+
+            //cut the next segment off the stream due next
+            bool next(NetworkAgentSegment& out)
+            {
+                if(_active.empty())
+                    return false;
+
+                size_t pick = 0;
+                for(size_t i=1; i<_active.size(); i++)
+                    if(_active[i]->pass < _active[pick]->pass)
+                        pick = i;
+                Stream& s = *_active[pick];
+                Message& m = s.queue.front();
+
+                size_t size = m.payload->size();
+                size_t len = size - m.offset < _segment_size ? size - m.offset : _segment_size;
+                NetworkAgentSegmentHeader::encode(m.source_agent_id, m.target_agent_id, s.id, size, len, out.head);
+                out.data = m.payload->data() + m.offset;
+                out.len = len;
+                out.payload = m.payload;
+                m.offset += len;
+                out.last = m.offset == size;
+                _bytes -= len;
+
+                //charge the stream for what it sent, the header too so empty packages cost something
+                _vtime = s.pass;
+                s.pass += ((uint64_t)(len + NetworkAgentSegmentHeader::SIZE) * MAX_WEIGHT) / s.weight;
+
+                if(out.last)
+                    s.queue.pop_front(); //the segment takes over the queue's reference
+                else
+                    m.payload->retain();
+
+                if(s.queue.empty())
+                {
+                    _active[pick] = _active.back();
+                    _active.pop_back();
+                    if(!s.pinned)
+                        _streams.erase(s.id);
+                }
+                return true;
+            }
+
+            //drop everything not yet handed out
+            void clear()
+            {
+                for(std::map<unsigned int, Stream>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+                {
+                    std::deque<Message>& q = it->second.queue;
+                    for(size_t i=0; i<q.size(); i++)
+                        q[i].payload->release();
+                    q.clear();
+                }
+                _active.clear();
+                _bytes = 0;
+            }
+
+            //same, and forget the stream weights
+            void reset()
+            {
+                clear();
+                _streams.clear();
+                _vtime = 0;
+            }
+
+        private:
+            struct Message
+            {
+                NetworkAgentPayload* payload;
+                unsigned int source_agent_id;
+                unsigned int target_agent_id;
+                size_t offset; //bytes already cut into segments
+            };
+
+            struct Stream
+            {
+                unsigned int id;
+                unsigned int weight;
+                bool pinned; //weight set by hand, keep it while idle
+                uint64_t pass; //weighted service so far
+                std::deque<Message> queue;
+
+                Stream() : id(0), weight(DEFAULT_WEIGHT), pinned(false), pass(0){}
+            };
+
+            NetworkAgentStreamScheduler(const NetworkAgentStreamScheduler&);
+            NetworkAgentStreamScheduler& operator=(const NetworkAgentStreamScheduler&);
+
+            size_t _segment_size;
+            uint64_t _vtime; //pass of the stream served last
+            size_t _bytes;
+            std::map<unsigned int, Stream> _streams; //node based, _active points into it
+            std::vector<Stream*> _active; //streams with packages queued
+        };
+
+        /**
+         Inbound Stream Reassembly
+         collects the segments of every stream into the payload of its package,
+         copying each segment once, straight into place. runs on the session's context only
+         **/
+        class NetworkAgentStreamAssembler
+        {
+        public:
+            static const size_t MAX_STREAMS = 1024; //packages in progress at once
+
+            enum Status{
+                PARTIAL,  //more segments to come
+                COMPLETE, //package handed out
+                CORRUPT   //segment does not fit the package in progress
+            };
+
+            explicit NetworkAgentStreamAssembler(size_t max_payload = NetworkAgentFrameDecoder::DEFAULT_MAX_PAYLOAD)
+            : _max_payload(max_payload){}
+
+            ~NetworkAgentStreamAssembler()
+            {
+                clear();
+            }
+
+            //drop the packages in progress
+            void clear()
+            {
+                for(std::map<unsigned int, Partial>::iterator it = _partial.begin(); it != _partial.end(); ++it)
+                    it->second.payload->release();
+                _partial.clear();
+            }
+
+            //take the segment at the front of the stream out of it
+            //@param head - the segment's frame header, the package header on COMPLETE
+            //@param payload - the package on COMPLETE, owned by the caller
+            //@see NetworkAgentFrameDecoder::unframe()
+            Status take(NetworkAgentRingBuffer& stream, NetworkAgentPackageHead& head,
+                        NetworkAgentPayload** payload, NetworkAgentBufferPool* pool)
+            {
+                unsigned char raw[NetworkAgentSegmentHeader::SIZE];
+                stream.peek(raw, sizeof(raw));
+                unsigned int stream_id = NetworkAgentWireHeader::get_u32(raw + NetworkAgentWireHeader::SIZE);
+                size_t message_size = NetworkAgentWireHeader::get_u32(raw + NetworkAgentWireHeader::SIZE + 4);
+                size_t len = head.payload_size - NetworkAgentSegmentHeader::PREFIX;
+
+                std::map<unsigned int, Partial>::iterator it = _partial.find(stream_id);
+                if(it == _partial.end())
+                {
+                    if(message_size > _max_payload || _partial.size() >= MAX_STREAMS)
+                        return CORRUPT;
+                    Partial p;
+                    p.payload = NetworkAgentPayload::create(message_size, pool);
+                    p.filled = 0;
+                    it = _partial.insert(std::make_pair(stream_id, p)).first;
+                }
+                Partial& p = it->second;
+                if(p.payload->size() != message_size || p.filled + len > message_size)
+                    return CORRUPT;
+
+                stream.consume(sizeof(raw));
+                stream.peek(p.payload->mutable_data() + p.filled, len);
+                stream.consume(len);
+                p.filled += len;
+                if(p.filled < message_size)
+                    return PARTIAL;
+
+                head.protocol = NetworkAgentWireHeader::PROTOCOL;
+                head.payload_size = message_size;
+                *payload = p.payload;
+                _partial.erase(it);
+                return COMPLETE;
+            }
+
+        private:
+            struct Partial
+            {
+                NetworkAgentPayload* payload;
+                size_t filled;
+            };
+
+            NetworkAgentStreamAssembler(const NetworkAgentStreamAssembler&);
+            NetworkAgentStreamAssembler& operator=(const NetworkAgentStreamAssembler&);
+
+            size_t _max_payload;
+            std::map<unsigned int, Partial> _partial;
+        };
+}
+#endif
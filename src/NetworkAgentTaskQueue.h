@@ -0,0 +1,123 @@
+//
+//  NetworkAgentTaskQueue.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_TASK_QUEUE_H
+#define LIBGCDNET_ENGINE_NETWORK_TASK_QUEUE_H
+
+#ifdef __linux__
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <Block.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "NetworkAgent.h"
+
+namespace libgcdnet{
+
+        /**
+         Task Queue of an Engine Worker Thread
+         blocks submitted from any thread are copied and queued, the worker runs
+         them in order with drain(). the eventfd becomes readable once the queue
+         turns non-empty, workers watch it next to their sockets
+         **/
+        class NetworkAgentTaskQueue
+        {
+        public:
+            NetworkAgentTaskQueue()
+            {
+                _fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            }
+
+            ~NetworkAgentTaskQueue()
+            {
+                for(size_t i=0; i<_tasks.size(); i++)
+                    Block_release(_tasks[i]);
+                if(_fd >= 0)
+                    close(_fd);
+            }
+
+            bool valid() const { return _fd >= 0; }
+            int fd() const { return _fd; }
+
+            void post(NetworkAgentTask task)
+            {
+                bool idle;
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    idle = _tasks.empty();
+                    _tasks.push_back(Block_copy(task));
+                }
+
+                //one wakeup covers every task posted before the worker drains
+                if(idle)
+                    wake();
+            }
+
+            //post and block the calling thread until the worker ran the task
+            void post_and_wait(NetworkAgentTask task)
+            {
+                std::mutex m;
+                std::condition_variable cv;
+                __block bool done = false;
+                std::mutex* mp = &m;
+                std::condition_variable* cvp = &cv;
+                post(^{
+                    task();
+                    std::lock_guard<std::mutex> guard(*mp);
+                    done = true;
+                    cvp->notify_one();
+                });
+
+                std::unique_lock<std::mutex> lock(m);
+                while(!done)
+                    cv.wait(lock);
+            }
+
+            //run whatever was posted so far, called on the worker thread
+            void drain()
+            {
+                std::vector<NetworkAgentTask> tasks;
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    tasks.swap(_tasks);
+                }
+
+                for(size_t i=0; i<tasks.size(); i++)
+                {
+                    tasks[i]();
+                    Block_release(tasks[i]);
+                }
+            }
+
+            void wake()
+            {
+                uint64_t one = 1;
+                ssize_t rc = write(_fd, &one, sizeof(one));
+                (void)rc;
+            }
+
+            //reset the eventfd after a wakeup
+            void ack()
+            {
+                uint64_t count;
+                ssize_t rc = read(_fd, &count, sizeof(count));
+                (void)rc;
+            }
+
+        private:
+            NetworkAgentTaskQueue(const NetworkAgentTaskQueue&);
+            NetworkAgentTaskQueue& operator=(const NetworkAgentTaskQueue&);
+
+            int _fd;
+            std::mutex _lock;
+            std::vector<NetworkAgentTask> _tasks; //copied blocks, released once run
+        };
+}
+
+#endif
+#endif
@@ -0,0 +1,102 @@
+//
+//  NetworkAgentTimerQueue.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_TIMER_QUEUE_H
+#define LIBGCDNET_ENGINE_NETWORK_TIMER_QUEUE_H
+
+#ifdef __linux__
+
+#include <map>
+#include <vector>
+#include <chrono>
+#include <Block.h>
+#include <stdint.h>
+#include "NetworkAgent.h"
+
+namespace libgcdnet{
+
+        /**
+         Timers of an Engine Worker Thread
+         delayed tasks ordered by deadline, only touched by the worker. the worker
+         sleeps no longer than timeout_ns() and runs whatever is due with run_expired()
+         **/
+        class NetworkAgentTimerQueue
+        {
+        public:
+            static const uint64_t NONE = ~(uint64_t)0;
+
+            NetworkAgentTimerQueue(){}
+
+            ~NetworkAgentTimerQueue()
+            {
+                for(Timers::iterator it = _timers.begin(); it != _timers.end(); ++it)
+                    Block_release(it->second);
+            }
+
+            static uint64_t now()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            bool empty() const { return _timers.empty(); }
+
+            void schedule(uint64_t delay_ns, NetworkAgentTask task)
+            {
+                _timers.insert(std::make_pair(now() + delay_ns, Block_copy(task)));
+            }
+
+            //time until the earliest deadline, NONE without timers
+            uint64_t timeout_ns() const
+            {
+                if(_timers.empty())
+                    return NONE;
+                uint64_t t = now(), deadline = _timers.begin()->first;
+                return deadline > t ? deadline - t : 0;
+            }
+
+            //same rounded up to epoll_wait() milliseconds, -1 without timers
+            int timeout_ms() const
+            {
+                uint64_t ns = timeout_ns();
+                if(ns == NONE)
+                    return -1;
+                uint64_t ms = (ns + 999999) / 1000000;
+                return ms > 0x7fffffff ? 0x7fffffff : (int)ms;
+            }
+
+            void run_expired()
+            {
+                if(_timers.empty())
+                    return;
+
+                //timers scheduled by the tasks wait for the next round
+                std::vector<NetworkAgentTask> due;
+                uint64_t t = now();
+                Timers::iterator it = _timers.begin();
+                while(it != _timers.end() && it->first <= t)
+                {
+                    due.push_back(it->second);
+                    _timers.erase(it++);
+                }
+
+                for(size_t i=0; i<due.size(); i++)
+                {
+                    due[i]();
+                    Block_release(due[i]);
+                }
+            }
+
+        private:
+            NetworkAgentTimerQueue(const NetworkAgentTimerQueue&);
+            NetworkAgentTimerQueue& operator=(const NetworkAgentTimerQueue&);
+
+            typedef std::multimap<uint64_t, NetworkAgentTask> Timers;
+            Timers _timers; //deadline in steady clock ns, copied blocks
+        };
+}
+
+#endif
+#endif
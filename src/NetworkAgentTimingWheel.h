@@ -0,0 +1,240 @@
+//
+//  NetworkAgentTimingWheel.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_TIMING_WHEEL_H
+#define LIBGCDNET_ENGINE_NETWORK_TIMING_WHEEL_H
+
+#include <cstddef>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+namespace libgcdnet{
+
+        //a timer living inside its owner, linked into at most one wheel slot
+        struct NetworkAgentWheelTimer
+        {
+            NetworkAgentWheelTimer* prev;
+            NetworkAgentWheelTimer* next;
+            uint64_t expires; //tick
+            void (*fire)(void* owner);
+            void* owner;
+
+            NetworkAgentWheelTimer() : prev(NULL), next(NULL), expires(0), fire(NULL), owner(NULL){}
+
+            bool armed() const { return prev != NULL; }
+        };
+
+        /**
+         Hierarchical Timing Wheel
+         four levels of 64 slots, each level ticking 64 times slower than the one below.
+         arm, rearm and cancel are O(1) list operations on the timer itself, advancing
+         touches one slot per tick plus a cascade from the level above every 64 ticks.
+         timers further out than 2^24 ticks fire at that horizon.
+         not thread safe, a wheel belongs to one I/O context
+         **/
+        class NetworkAgentTimingWheel
+        {
+        public:
+            static const int LEVELS = 4;
+            static const int SLOT_BITS = 6;
+            static const int SLOTS = 1 << SLOT_BITS;
+            static const uint64_t HORIZON = ((uint64_t)1 << (LEVELS * SLOT_BITS)) - 1;
+
+            NetworkAgentTimingWheel() : _now(0), _armed(0)
+            {
+                for(int l=0; l<LEVELS; l++)
+                    for(int i=0; i<SLOTS; i++)
+                        _slots[l][i].prev = _slots[l][i].next = &_slots[l][i];
+            }
+
+            uint64_t now() const { return _now; }
+            size_t armed() const { return _armed; }
+
+            //(re)arm to fire at the given tick, ticks already passed fire on the next one
+            void arm(NetworkAgentWheelTimer* t, uint64_t expires)
+            {
+                if(t->armed())
+                    unlink(t);
+                if(expires <= _now)
+                    expires = _now + 1;
+                if(expires - _now > HORIZON)
+                    expires = _now + HORIZON;
+                t->expires = expires;
+                link(t);
+            }
+
+            void cancel(NetworkAgentWheelTimer* t)
+            {
+                if(t->armed())
+                    unlink(t);
+            }
+
+            //move the wheel up to the tick, firing everything due on the way
+            void advance(uint64_t tick)
+            {
+                while(_now < tick)
+                {
+                    _now++;
+
+                    //timers of the next block of the level above drop down first
+                    for(int l=LEVELS-1; l>0; l--)
+                        if((_now & (((uint64_t)1 << (l * SLOT_BITS)) - 1)) == 0)
+                            cascade(l, (_now >> (l * SLOT_BITS)) & (SLOTS - 1));
+
+                    //detach the slot, callbacks may arm timers again
+                    NetworkAgentWheelTimer* head = &_slots[0][_now & (SLOTS - 1)];
+                    NetworkAgentWheelTimer due;
+                    take(head, &due);
+                    while(due.next != &due)
+                    {
+                        NetworkAgentWheelTimer* t = due.next;
+                        unlink(t);
+                        t->fire(t->owner);
+                    }
+                }
+            }
+
+        private:
+            void link(NetworkAgentWheelTimer* t)
+            {
+                uint64_t delta = t->expires - _now;
+                int level = 0;
+                while(level < LEVELS - 1 && delta >= ((uint64_t)1 << ((level + 1) * SLOT_BITS)))
+                    level++;
+                NetworkAgentWheelTimer* head = &_slots[level][(t->expires >> (level * SLOT_BITS)) & (SLOTS - 1)];
+                t->next = head;
+                t->prev = head->prev;
+                head->prev->next = t;
+                head->prev = t;
+                _armed++;
+            }
+
+            void unlink(NetworkAgentWheelTimer* t)
+            {
+                t->prev->next = t->next;
+                t->next->prev = t->prev;
+                t->prev = t->next = NULL;
+                _armed--;
+            }
+
+            //move the whole list of a slot onto an empty list head
+            static void take(NetworkAgentWheelTimer* from, NetworkAgentWheelTimer* to)
+            {
+                if(from->next == from)
+                {
+                    to->prev = to->next = to;
+                    return;
+                }
+                to->next = from->next;
+                to->prev = from->prev;
+                to->next->prev = to;
+                to->prev->next = to;
+                from->prev = from->next = from;
+            }
+
+            void cascade(int level, uint64_t slot)
+            {
+                NetworkAgentWheelTimer pending;
+                take(&_slots[level][slot], &pending);
+                while(pending.next != &pending)
+                {
+                    NetworkAgentWheelTimer* t = pending.next;
+                    //never below now, the ones due right now land in the slot fired next
+                    unlink(t);
+                    link(t);
+                }
+            }
+
+            NetworkAgentTimingWheel(const NetworkAgentTimingWheel&);
+            NetworkAgentTimingWheel& operator=(const NetworkAgentTimingWheel&);
+
+            uint64_t _now;
+            size_t _armed;
+            NetworkAgentWheelTimer _slots[LEVELS][SLOTS]; //list heads
+        };
+
+        //session timeouts of an agent, all in milliseconds and 0 when off
+        struct NetworkAgentTimeoutOptions
+        {
+            unsigned int idle_read; //nothing received for this long closes the session
+            unsigned int write_stall; //queued frames making no progress for this long close the session
+            unsigned int heartbeat; //send a heartbeat package after this long without sending anything
+            unsigned int tick; //wheel resolution
+
+            NetworkAgentTimeoutOptions() : idle_read(0), write_stall(0), heartbeat(0), tick(100){}
+
+            bool enabled() const { return idle_read || write_stall || heartbeat; }
+        };
+
+        /**
+         Session Timeouts of an Agent
+         one timing wheel per I/O shard, advanced on the shard by a periodic tick.
+         every session keeps one timer in its shard's wheel, armed for the earliest of
+         its deadlines. activity only records the current tick, the timer checks what
+         is really due once it fires and arms itself again for the next deadline.
+         reference counted like the metrics, sessions and the tick keep it alive
+         **/
+        class NetworkAgentTimeouts
+        {
+        public:
+            NetworkAgentTimeouts(unsigned int shards, const NetworkAgentTimeoutOptions& options)
+            : _refcount(1), _stopped(false), _options(options)
+            {
+                if(!_options.tick)
+                    _options.tick = 1;
+                _start = clock();
+                for(unsigned int i=0; i<shards; i++)
+                    _wheels.push_back(new NetworkAgentTimingWheel);
+            }
+
+            void retain()
+            {
+                _refcount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if(_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            const NetworkAgentTimeoutOptions& options() const { return _options; }
+            NetworkAgentTimingWheel& wheel(unsigned int shard) { return *_wheels[shard]; }
+
+            uint64_t tick_ns() const { return (uint64_t)_options.tick * 1000000; }
+            uint64_t ticks(unsigned int ms) const { return (ms + _options.tick - 1) / _options.tick; }
+
+            //tick the wheels should be at right now
+            uint64_t current_tick() const { return (clock() - _start) / tick_ns(); }
+
+            void stop() { _stopped.store(true, std::memory_order_release); }
+            bool stopped() const { return _stopped.load(std::memory_order_acquire); }
+
+        private:
+            ~NetworkAgentTimeouts()
+            {
+                for(size_t i=0; i<_wheels.size(); i++)
+                    delete _wheels[i];
+            }
+
+            static uint64_t clock()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            NetworkAgentTimeouts(const NetworkAgentTimeouts&);
+            NetworkAgentTimeouts& operator=(const NetworkAgentTimeouts&);
+
+            std::atomic<int> _refcount;
+            std::atomic<bool> _stopped; //the agent is gone, ticks end
+            NetworkAgentTimeoutOptions _options;
+            uint64_t _start;
+            std::vector<NetworkAgentTimingWheel*> _wheels;
+        };
+}
+#endif
@@ -0,0 +1,55 @@
+//
+//  NetworkAgentTrace.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_TRACE_H
+#define LIBGCDNET_ENGINE_NETWORK_TRACE_H
+
+/**
+ Compile Time Trace
+ LIBGCDNET_TRACE(fmt, ...) prints one line to stderr when the library is built
+ with LIBGCDNET_ENABLE_TRACE, and compiles to nothing otherwise. the arguments are
+ still compiled then, so that values only ever traced do not count as unused, but never run.
+ traces carry sizes and ids only, never payload bytes
+ **/
+#ifdef LIBGCDNET_ENABLE_TRACE
+
+#include <cstdio>
+#include <cstdarg>
+#include <unistd.h>
+
+namespace libgcdnet{
+
+        inline void trace_line(const char* fmt, ...)
+        {
+            //format first and hand the whole line to a single write so that
+            //concurrent contexts neither interleave nor serialize on a stream lock
+            char line[256];
+            int n = snprintf(line, sizeof(line), "libgcdnet: ");
+            va_list args;
+            va_start(args, fmt);
+            int m = vsnprintf(line + n, sizeof(line) - n - 1, fmt, args);
+            va_end(args);
+            n += m < 0 ? 0 : (m < (int)(sizeof(line) - n - 1) ? m : (int)(sizeof(line) - n - 2));
+            line[n++] = '\n';
+            ssize_t rc = ::write(2, line, n);
+            (void)rc;
+        }
+}
+
+#define LIBGCDNET_TRACE(...) ::libgcdnet::trace_line(__VA_ARGS__)
+
+#else
+
+namespace libgcdnet{
+
+        //never called
+        inline void trace_none(const char* fmt, ...){}
+}
+
+#define LIBGCDNET_TRACE(...) do{ if(0) ::libgcdnet::trace_none(__VA_ARGS__); }while(0)
+
+#endif
+
+#endif
@@ -0,0 +1,619 @@
+//
+//  NetworkAgentUringEngine.cpp
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+
+#include "NetworkAgentUringEngine.h"
+
+#if defined(__linux__) && defined(LIBGCDNET_HAVE_IO_URING)
+
+#include <Block.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h> //close()
+
+namespace libgcdnet {
+
+        __thread NetworkAgentUringEngine::Worker* NetworkAgentUringEngine::_current = NULL;
+
+        static const uint64_t TAG_MASK = 7; //Session and Listener are at least 8 byte aligned
+
+        static uint64_t tagged(void* p, unsigned int tag)
+        {
+            return (uint64_t)(uintptr_t)p | tag;
+        }
+
+        NetworkAgentUringEngine::NetworkAgentUringEngine(const std::vector<NetworkAgentShard>& shards) LIBGCDNET_THROWS(NetworkAgentException)
+        : _stop(false)
+        {
+            for(size_t i=0; i<shards.size(); i++)
+            {
+                Worker* w = new Worker;
+                w->engine = this;
+                w->cpu = shards[i].cpu;
+                w->br = NULL;
+                w->bufs = NULL;
+                _workers.push_back(w);
+
+                //cooperative task running keeps completions from interrupting the worker,
+                //older kernels do not know the flag
+                struct io_uring_params params;
+                memset(&params, 0, sizeof(params));
+                params.flags = IORING_SETUP_COOP_TASKRUN;
+                int rc = io_uring_queue_init_params(RING_ENTRIES, &w->ring, &params);
+                if(rc == -EINVAL)
+                {
+                    memset(&params, 0, sizeof(params));
+                    rc = io_uring_queue_init_params(RING_ENTRIES, &w->ring, &params);
+                }
+                w->ring_ready = rc == 0;
+
+                if(w->ring_ready)
+                {
+                    int err = 0;
+                    w->bufs = (char*)malloc((size_t)BUF_COUNT * BUF_SIZE);
+                    if(w->bufs)
+                        w->br = io_uring_setup_buf_ring(&w->ring, BUF_COUNT, BUF_GROUP, 0, &err);
+                }
+
+                if(!w->ring_ready || !w->br || !w->tasks.valid())
+                {
+                    //no thread started yet
+                    for(size_t j=0; j<_workers.size(); j++)
+                        teardown(_workers[j]);
+                    throw NetworkAgentException("failed to set up io_uring");
+                }
+
+                int mask = io_uring_buf_ring_mask(BUF_COUNT);
+                for(unsigned int b=0; b<BUF_COUNT; b++)
+                    io_uring_buf_ring_add(w->br, w->bufs + (size_t)b * BUF_SIZE, BUF_SIZE, b, mask, b);
+                io_uring_buf_ring_advance(w->br, BUF_COUNT);
+
+                //sessions fall back to plain fds when the kernel has no sparse file table
+                if(io_uring_register_files_sparse(&w->ring, MAX_FILES) == 0)
+                {
+                    w->free_slots.reserve(MAX_FILES);
+                    for(unsigned int f=MAX_FILES; f>0; f--)
+                        w->free_slots.push_back(f - 1);
+                }
+
+                arm_wake(w);
+            }
+
+            for(size_t i=0; i<_workers.size(); i++)
+                _workers[i]->thread = std::thread(&NetworkAgentUringEngine::run, this, _workers[i]);
+        }
+
+        NetworkAgentUringEngine::~NetworkAgentUringEngine()
+        {
+            _stop.store(true, std::memory_order_release);
+
+            for(size_t i=0; i<_workers.size(); i++)
+            {
+                Worker* w = _workers[i];
+                if(w->thread.joinable())
+                {
+                    w->tasks.wake();
+                    w->thread.join();
+                }
+
+                for(size_t j=0; j<w->listeners.size(); j++)
+                {
+                    close(w->listeners[j]->sock);
+                    Block_release(w->listeners[j]->on_ready);
+                    delete w->listeners[j];
+                }
+
+                teardown(w);
+            }
+            _workers.clear();
+        }
+
+        void NetworkAgentUringEngine::teardown(Worker* w)
+        {
+            if(w->ring_ready)
+            {
+                if(w->br)
+                    io_uring_free_buf_ring(&w->ring, w->br, BUF_COUNT, BUF_GROUP);
+                io_uring_queue_exit(&w->ring);
+            }
+            free(w->bufs);
+            delete w;
+        }
+
+        void NetworkAgentUringEngine::destroy()
+        {
+            if(_current && _current->engine == this)
+                std::thread([this]{ delete this; }).detach();
+            else
+                delete this;
+        }
+
+        //completion loop of one shard
+        void NetworkAgentUringEngine::run(Worker* w)
+        {
+            _current = w;
+
+            if(w->cpu >= 0)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(w->cpu, &set);
+                pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            }
+
+            while(!_stop.load(std::memory_order_acquire))
+            {
+                //everything prepared since the last round goes out with one syscall,
+                //the wait ends early for the next timer
+                int rc;
+                uint64_t timeout = w->timers.timeout_ns();
+                if(timeout == NetworkAgentTimerQueue::NONE)
+                    rc = io_uring_submit_and_wait(&w->ring, 1);
+                else
+                {
+                    struct __kernel_timespec ts;
+                    ts.tv_sec = timeout / 1000000000;
+                    ts.tv_nsec = timeout % 1000000000;
+                    struct io_uring_cqe* first;
+                    rc = io_uring_submit_and_wait_timeout(&w->ring, &first, 1, &ts, NULL);
+                    if(rc == -ETIME)
+                        rc = 0;
+                }
+                //transient ones pass, anything else means the ring is unusable. leaving the loop
+                //would hang the shard's sessions and every sync() aimed at it, fail loudly instead
+                if(rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY && rc != -ENOMEM)
+                {
+                    fprintf(stderr, "libgcdnet: io_uring wait failed on a shard worker: %s\n", strerror(-rc));
+                    abort();
+                }
+
+                struct io_uring_cqe* cqe;
+                unsigned int head, count = 0;
+                io_uring_for_each_cqe(&w->ring, head, cqe)
+                {
+                    complete(w, cqe);
+                    count++;
+                }
+                io_uring_cq_advance(&w->ring, count);
+
+                w->tasks.drain();
+                w->timers.run_expired();
+            }
+
+            w->tasks.drain();
+        }
+
+        void NetworkAgentUringEngine::complete(Worker* w, struct io_uring_cqe* cqe)
+        {
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            void* ptr = (void*)(uintptr_t)(data & ~TAG_MASK);
+            bool more = cqe->flags & IORING_CQE_F_MORE;
+
+            switch(data & TAG_MASK)
+            {
+                case TAG_WAKE:
+                    //posted tasks run after the batch
+                    w->tasks.ack();
+                    if(!more && !_stop.load(std::memory_order_acquire))
+                        arm_wake(w);
+                    break;
+
+                case TAG_LISTEN:
+                {
+                    Listener* l = (Listener*)ptr;
+                    if(cqe->res >= 0 && !l->removed)
+                        l->on_ready();
+                    if(!more)
+                    {
+                        l->armed = false;
+                        if(l->removed)
+                        {
+                            Block_release(l->on_ready);
+                            delete l;
+                        }
+                        else if(!l->paused && !_stop.load(std::memory_order_acquire))
+                            arm_listener(w, l);
+                    }
+                    break;
+                }
+
+                case TAG_WATCH:
+                {
+                    Watch* watch = (Watch*)ptr;
+                    if(!watch->dropped)
+                        watch->on_ready();
+                    Block_release(watch->on_ready);
+                    delete watch;
+                    break;
+                }
+
+                case TAG_RECV:
+                    on_recv(w, (Session*)ptr, cqe->res, cqe->flags);
+                    break;
+
+                case TAG_SEND:
+                    on_send(w, (Session*)ptr, cqe->res);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        void NetworkAgentUringEngine::on_recv(Worker* w, Session* us, int res, unsigned int flags)
+        {
+            NetworkAgentClientSession* s = us->s;
+            if(!(flags & IORING_CQE_F_MORE))
+            {
+                us->recv_armed = false;
+                us->pending--;
+            }
+
+            if(res > 0)
+            {
+                //hand the bytes over and give the buffer straight back to the kernel
+                unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                char* buf = w->bufs + (size_t)bid * BUF_SIZE;
+                handle_input(s, buf, res);
+                io_uring_buf_ring_add(w->br, buf, BUF_SIZE, bid, io_uring_buf_ring_mask(BUF_COUNT), 0);
+                io_uring_buf_ring_advance(w->br, 1);
+            }
+            //peer closed or the socket failed, running out of buffers only ends the multishot
+            else if(res != -ENOBUFS && res != -ECANCELED)
+                handle_input(s, NULL, 0);
+
+            if(!us->recv_armed && !s->closed && s->reading())
+                arm_recv(w, us);
+
+            release_if_done(w, us);
+        }
+
+        void NetworkAgentUringEngine::on_send(Worker* w, Session* us, int res)
+        {
+            NetworkAgentClientSession* s = us->s;
+            us->send_inflight = false;
+            us->pending--;
+            s->w_queue.unpin();
+
+            //advances the queue, a short send leaves the rest for the next round
+            handle_sent(s, res);
+            if(!s->closed && s->w_active && !s->w_queue.empty())
+                submit_send(w, us);
+
+            release_if_done(w, us);
+        }
+
+        struct io_uring_sqe* NetworkAgentUringEngine::get_sqe(Worker* w)
+        {
+            struct io_uring_sqe* sqe = io_uring_get_sqe(&w->ring);
+            while(!sqe)
+            {
+                //submission queue full, flush it early
+                io_uring_submit(&w->ring);
+                sqe = io_uring_get_sqe(&w->ring);
+            }
+            return sqe;
+        }
+
+        void NetworkAgentUringEngine::prep_fd(Session* us, struct io_uring_sqe* sqe)
+        {
+            if(us->slot >= 0)
+            {
+                sqe->fd = us->slot;
+                sqe->flags |= IOSQE_FIXED_FILE;
+            }
+        }
+
+        void NetworkAgentUringEngine::arm_wake(Worker* w)
+        {
+            struct io_uring_sqe* sqe = get_sqe(w);
+            io_uring_prep_poll_multishot(sqe, w->tasks.fd(), POLLIN);
+            io_uring_sqe_set_data64(sqe, tagged(NULL, TAG_WAKE));
+        }
+
+        void NetworkAgentUringEngine::arm_listener(Worker* w, Listener* l)
+        {
+            struct io_uring_sqe* sqe = get_sqe(w);
+            io_uring_prep_poll_multishot(sqe, l->sock, POLLIN);
+            io_uring_sqe_set_data64(sqe, tagged(l, TAG_LISTEN));
+            l->armed = true;
+        }
+
+        void NetworkAgentUringEngine::arm_recv(Worker* w, Session* us)
+        {
+            struct io_uring_sqe* sqe = get_sqe(w);
+            io_uring_prep_recv_multishot(sqe, us->s->sock, NULL, 0, 0);
+            prep_fd(us, sqe);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = BUF_GROUP;
+            io_uring_sqe_set_data64(sqe, tagged(us, TAG_RECV));
+            us->recv_armed = true;
+            us->pending++;
+        }
+
+        void NetworkAgentUringEngine::submit_send(Worker* w, Session* us)
+        {
+            NetworkAgentClientSession* s = us->s;
+            memset(&us->msg, 0, sizeof(us->msg));
+            us->msg.msg_iov = us->iov;
+            us->msg.msg_iovlen = s->w_queue.gather(us->iov, NetworkAgentOutboundQueue::MAX_IOV);
+
+            struct io_uring_sqe* sqe = get_sqe(w);
+            io_uring_prep_sendmsg(sqe, s->sock, &us->msg, MSG_NOSIGNAL);
+            prep_fd(us, sqe);
+            io_uring_sqe_set_data64(sqe, tagged(us, TAG_SEND));
+
+            //frames pushed while the send is in flight must not move the gathered bytes
+            s->w_queue.pin();
+            us->send_inflight = true;
+            us->pending++;
+        }
+
+        //runs on the session's worker
+        void NetworkAgentUringEngine::register_session(Worker* w, Session* us)
+        {
+            if(!w->free_slots.empty())
+            {
+                int slot = w->free_slots.back();
+                int fd = us->s->sock;
+                if(io_uring_register_files_update(&w->ring, slot, &fd, 1) == 1)
+                {
+                    us->slot = slot;
+                    w->free_slots.pop_back();
+                }
+            }
+
+            arm_recv(w, us);
+        }
+
+        //last completion of a detached session is in, give back its fd and delete it
+        void NetworkAgentUringEngine::release_if_done(Worker* w, Session* us)
+        {
+            NetworkAgentClientSession* s = us->s;
+            if(!s->closed || us->pending || us->released)
+                return;
+            us->released = true;
+
+            if(us->slot >= 0)
+            {
+                int none = -1;
+                io_uring_register_files_update(&w->ring, us->slot, &none, 1);
+                w->free_slots.push_back(us->slot);
+                us->slot = -1;
+            }
+            close(s->sock);
+
+            //tasks posted before still see a valid (closed) session
+            w->tasks.post(^{
+                NetworkAgentClientSession::dispose(s);
+                delete us;
+            });
+        }
+
+        void NetworkAgentUringEngine::attach(NetworkAgentClientSession* s) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            Session* us = new Session;
+            us->s = s;
+            us->slot = -1;
+            us->pending = 0;
+            us->recv_armed = us->send_inflight = us->released = false;
+            s->io_state = us;
+
+            //the ring belongs to its worker, sessions accepted elsewhere register through a task
+            //that runs before anything else submitted to the session
+            Worker* w = _workers[s->context];
+            if(_current == w)
+                register_session(w, us);
+            else
+                w->tasks.post(^{
+                    register_session(w, us);
+                });
+        }
+
+        void NetworkAgentUringEngine::detach(NetworkAgentClientSession* s)
+        {
+            Worker* w = _workers[s->context];
+            Session* us = (Session*)s->io_state;
+
+            //the multishot receive and a pending send complete with -ECANCELED
+            if(us->pending)
+            {
+                struct io_uring_sqe* sqe = get_sqe(w);
+                io_uring_prep_cancel_fd(sqe, us->slot >= 0 ? us->slot : s->sock,
+                                        IORING_ASYNC_CANCEL_ALL | (us->slot >= 0 ? IORING_ASYNC_CANCEL_FD_FIXED : 0));
+                io_uring_sqe_set_data64(sqe, tagged(NULL, TAG_NONE));
+            }
+
+            release_if_done(w, us);
+        }
+
+        void NetworkAgentUringEngine::want_write(NetworkAgentClientSession* s, bool on)
+        {
+            //completion based, a send is only issued when there is something to send
+            Session* us = (Session*)s->io_state;
+            if(on && !us->send_inflight && !s->closed && !s->w_queue.empty())
+                submit_send(_workers[s->context], us);
+        }
+
+        void NetworkAgentUringEngine::want_read(NetworkAgentClientSession* s, bool on)
+        {
+            Worker* w = _workers[s->context];
+            Session* us = (Session*)s->io_state;
+
+            //completions already queued still come in, the multishot receive ends with -ECANCELED
+            //and on_recv() re-arms it then if reading was resumed in the meantime
+            if(!on && us->recv_armed)
+            {
+                struct io_uring_sqe* sqe = get_sqe(w);
+                io_uring_prep_cancel64(sqe, tagged(us, TAG_RECV), 0);
+                io_uring_sqe_set_data64(sqe, tagged(NULL, TAG_NONE));
+            }
+            else if(on && !us->recv_armed && !s->closed)
+                arm_recv(w, us);
+        }
+
+        void NetworkAgentUringEngine::async(NetworkAgentClientSession* s, NetworkAgentTask task)
+        {
+            _workers[s->context]->tasks.post(task);
+        }
+
+        void NetworkAgentUringEngine::sync(NetworkAgentClientSession* s, NetworkAgentTask task)
+        {
+            Worker* w = _workers[s->context];
+            if(_current == w)
+            {
+                task();
+                return;
+            }
+
+            w->tasks.post_and_wait(task);
+        }
+
+        void NetworkAgentUringEngine::add_listener(int listen_sock, int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            Worker* w = _workers[context < 0 ? 0 : context];
+
+            Listener* l = new Listener;
+            l->sock = listen_sock;
+            l->armed = l->paused = l->removed = false;
+            l->on_ready = Block_copy(on_ready);
+            {
+                std::lock_guard<std::mutex> guard(w->lock);
+                w->listeners.push_back(l);
+            }
+
+            if(_current == w)
+                arm_listener(w, l);
+            else
+                w->tasks.post(^{
+                    arm_listener(w, l);
+                });
+        }
+
+        void NetworkAgentUringEngine::remove_listener(int listen_sock)
+        {
+            for(size_t i=0; i<_workers.size(); i++)
+            {
+                Worker* w = _workers[i];
+                Listener* l = NULL;
+                {
+                    std::lock_guard<std::mutex> guard(w->lock);
+                    for(size_t j=0; j<w->listeners.size() && !l; j++)
+                        if(w->listeners[j]->sock == listen_sock)
+                        {
+                            l = w->listeners[j];
+                            w->listeners.erase(w->listeners.begin() + j);
+                        }
+                }
+                if(!l)
+                    continue;
+
+                //on the worker, so that no on_ready is running meanwhile. an armed poll
+                //completes with -ECANCELED and frees the listener then
+                NetworkAgentTask drop = ^{
+                    l->removed = true;
+                    close(l->sock);
+                    if(l->armed)
+                    {
+                        struct io_uring_sqe* sqe = get_sqe(w);
+                        io_uring_prep_poll_remove(sqe, tagged(l, TAG_LISTEN));
+                        io_uring_sqe_set_data64(sqe, tagged(NULL, TAG_NONE));
+                    }
+                    else
+                    {
+                        Block_release(l->on_ready);
+                        delete l;
+                    }
+                };
+                if(_current == w)
+                    drop();
+                else
+                    w->tasks.post_and_wait(drop);
+                return;
+            }
+        }
+
+        void NetworkAgentUringEngine::pause_listener(int listen_sock, uint64_t delay_ns)
+        {
+            Worker* w = _current;
+            Listener* l = NULL;
+            {
+                std::lock_guard<std::mutex> guard(w->lock);
+                for(size_t j=0; j<w->listeners.size() && !l; j++)
+                    if(w->listeners[j]->sock == listen_sock)
+                        l = w->listeners[j];
+            }
+            if(!l || l->paused)
+                return;
+
+            //the poll ends with -ECANCELED and stays down while paused
+            l->paused = true;
+            if(l->armed)
+            {
+                struct io_uring_sqe* sqe = get_sqe(w);
+                io_uring_prep_poll_remove(sqe, tagged(l, TAG_LISTEN));
+                io_uring_sqe_set_data64(sqe, tagged(NULL, TAG_NONE));
+            }
+
+            w->timers.schedule(delay_ns, ^{
+                //removed meanwhile, it is no longer listed
+                std::lock_guard<std::mutex> guard(w->lock);
+                for(size_t j=0; j<w->listeners.size(); j++)
+                    if(w->listeners[j] == l)
+                    {
+                        l->paused = false;
+                        if(!l->armed)
+                            arm_listener(w, l);
+                    }
+            });
+        }
+
+        void NetworkAgentUringEngine::post(unsigned int context, NetworkAgentTask task)
+        {
+            _workers[context]->tasks.post(task);
+        }
+
+        void NetworkAgentUringEngine::after(unsigned int context, uint64_t delay_ns, NetworkAgentTask task)
+        {
+            //the timer queue belongs to its worker
+            Worker* w = _workers[context];
+            if(_current == w)
+                w->timers.schedule(delay_ns, task);
+            else
+                w->tasks.post(^{
+                    w->timers.schedule(delay_ns, task);
+                });
+        }
+
+        void* NetworkAgentUringEngine::watch_writable(int sock, unsigned int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException)
+        {
+            Watch* watch = new Watch;
+            watch->dropped = false;
+            watch->on_ready = Block_copy(on_ready);
+
+            struct io_uring_sqe* sqe = get_sqe(_workers[context]);
+            io_uring_prep_poll_add(sqe, sock, POLLOUT);
+            io_uring_sqe_set_data64(sqe, tagged(watch, TAG_WATCH));
+            return watch;
+        }
+
+        void NetworkAgentUringEngine::unwatch(void* watch)
+        {
+            //the poll completes either way, with -ECANCELED or with the event
+            ((Watch*)watch)->dropped = true;
+            struct io_uring_sqe* sqe = get_sqe(_current);
+            io_uring_prep_poll_remove(sqe, tagged(watch, TAG_WATCH));
+            io_uring_sqe_set_data64(sqe, tagged(NULL, TAG_NONE));
+        }
+
+}
+
+#endif
@@ -0,0 +1,148 @@
+//
+//  NetworkAgentUringEngine.h
+//
+//  Created by Denny C. Dai on 10-10-17.
+//
+#ifndef LIBGCDNET_ENGINE_NETWORK_URING_ENGINE_H
+#define LIBGCDNET_ENGINE_NETWORK_URING_ENGINE_H
+
+#if defined(__linux__) && defined(LIBGCDNET_HAVE_IO_URING)
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <sys/socket.h>
+#include <liburing.h>
+#include "NetworkAgent.h"
+#include "NetworkAgentTaskQueue.h"
+#include "NetworkAgentTimerQueue.h"
+
+namespace libgcdnet{
+
+        /**
+         io_uring I/O Engine
+         one ring and worker thread per shard. every session keeps a multishot receive
+         armed on its registered fd, the kernel picks a buffer out of the shard's provided
+         buffer ring for each completion, so a busy socket costs no syscall per read.
+         sends gather the whole outbound queue into one sendmsg, and all operations
+         prepared while handling a batch of completions go out with a single submit
+         **/
+        class NetworkAgentUringEngine : public NetworkAgentEngine
+        {
+        public:
+            static const unsigned int RING_ENTRIES = 1024;
+            static const unsigned int MAX_FILES = 16384; //registered fd slots per shard
+            static const unsigned int BUF_COUNT = 1024; //provided receive buffers per shard, power of two
+            static const unsigned int BUF_SIZE = 4096;
+            static const unsigned short BUF_GROUP = 0;
+
+            NetworkAgentUringEngine(const std::vector<NetworkAgentShard>& shards) LIBGCDNET_THROWS(NetworkAgentException);
+
+            Kind kind() const { return URING; }
+            unsigned int contexts() const { return _workers.size(); }
+
+            void attach(NetworkAgentClientSession* s) LIBGCDNET_THROWS(NetworkAgentException);
+            void detach(NetworkAgentClientSession* s);
+            void want_write(NetworkAgentClientSession* s, bool on);
+            void want_read(NetworkAgentClientSession* s, bool on);
+
+            void async(NetworkAgentClientSession* s, NetworkAgentTask task);
+            void sync(NetworkAgentClientSession* s, NetworkAgentTask task);
+
+            void add_listener(int listen_sock, int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException);
+            void remove_listener(int listen_sock);
+            void pause_listener(int listen_sock, uint64_t delay_ns);
+
+            void post(unsigned int context, NetworkAgentTask task);
+            void after(unsigned int context, uint64_t delay_ns, NetworkAgentTask task);
+            void* watch_writable(int sock, unsigned int context, NetworkAgentTask on_ready) LIBGCDNET_THROWS(NetworkAgentException);
+            void unwatch(void* watch);
+
+        protected:
+            ~NetworkAgentUringEngine();
+
+            //the last session may go away on a worker thread, which cannot join itself
+            void destroy();
+
+        private:
+            //completion tags, kept in the low bits of the user data
+            enum Tag{
+                TAG_NONE = 0, //cancellations, nothing to do
+                TAG_WAKE,
+                TAG_RECV,
+                TAG_SEND,
+                TAG_LISTEN,
+                TAG_WATCH
+            };
+
+            struct Listener
+            {
+                int sock;
+                bool armed; //its multishot poll has not completed for good
+                bool paused; //not re-armed until the pause is over
+                bool removed; //deleted with the last completion of its poll
+                NetworkAgentTask on_ready;
+            };
+
+            //one shot writable poll, freed on its completion
+            struct Watch
+            {
+                bool dropped; //unwatched, the completion only frees it
+                NetworkAgentTask on_ready;
+            };
+
+            //per-session state, hangs off NetworkAgentClientSession::io_state
+            struct Session
+            {
+                NetworkAgentClientSession* s;
+                int slot; //registered file index, -1 to use the plain fd
+                unsigned int pending; //submitted operations without their final completion
+                bool recv_armed;
+                bool send_inflight;
+                bool released;
+                struct msghdr msg;
+                struct iovec iov[NetworkAgentOutboundQueue::MAX_IOV];
+            };
+
+            struct Worker
+            {
+                NetworkAgentUringEngine* engine;
+                struct io_uring ring;
+                bool ring_ready;
+                struct io_uring_buf_ring* br;
+                char* bufs; //BUF_COUNT * BUF_SIZE bytes backing the provided buffers
+                int cpu; //core to pin the thread to, -1 if unbound
+                std::thread thread;
+                NetworkAgentTaskQueue tasks;
+                NetworkAgentTimerQueue timers; //worker thread only
+                std::vector<int> free_slots;
+                std::mutex lock; //guards listeners
+                std::vector<Listener*> listeners;
+            };
+
+            void run(Worker* w);
+            void complete(Worker* w, struct io_uring_cqe* cqe);
+            void on_recv(Worker* w, Session* us, int res, unsigned int flags);
+            void on_send(Worker* w, Session* us, int res);
+
+            struct io_uring_sqe* get_sqe(Worker* w);
+            void prep_fd(Session* us, struct io_uring_sqe* sqe);
+            void register_session(Worker* w, Session* us);
+            void arm_wake(Worker* w);
+            void arm_listener(Worker* w, Listener* l);
+            void arm_recv(Worker* w, Session* us);
+            void submit_send(Worker* w, Session* us);
+            void release_if_done(Worker* w, Session* us);
+
+            static void teardown(Worker* w);
+
+            std::vector<Worker*> _workers;
+            std::atomic<bool> _stop;
+
+            static __thread Worker* _current; //worker running on this thread, NULL elsewhere
+        };
+}
+
+#endif
+#endif